@@ -36,6 +36,7 @@
 
 #include <moveit/move_group/names.h>
 #include <actionlib/server/simple_action_server.h>
+#include <actionlib/server/action_server.h>
 #include <moveit_msgs/MoveGroupAction.h>
 #include <moveit_msgs/ExecuteKnownTrajectory.h>
 #include <moveit_msgs/QueryPlannerInterfaces.h>
@@ -47,6 +48,8 @@
 #include <moveit/trajectory_processing/trajectory_tools.h>
 #include <moveit/kinematic_constraints/utils.h>
 #include <moveit/pick_place/pick_place.h>
+#include <algorithm>
+#include <deque>
 
 namespace move_group
 {
@@ -63,17 +66,33 @@ public:
       LOOK
     };
   
-  MoveGroupServer(const planning_scene_monitor::PlanningSceneMonitorPtr& psm, bool debug) : 
+  MoveGroupServer(const planning_scene_monitor::PlanningSceneMonitorPtr& psm, unsigned int planning_threads, bool debug) : 
     node_handle_("~"),
     planning_scene_monitor_(psm),
     allow_trajectory_execution_(true),
-    move_state_(IDLE),
+    move_workers_running_(true),
+    have_active_execute_goal_(false),
+    active_execute_goal_preempted_(false),
+    active_execute_goal_owns_execution_(false),
+    have_pending_execute_goal_(false),
     pickup_state_(IDLE)
   { 
     planning_pipeline_.reset(new planning_pipeline::PlanningPipeline(planning_scene_monitor_->getKinematicModel()));
+
+    // planners are not safe to call from multiple threads at the same time, so each concurrently served planning request gets its own pipeline
+    available_planning_pipelines_.push_back(planning_pipeline_);
+    for (unsigned int i = 1 ; i < planning_threads ; ++i)
+      available_planning_pipelines_.push_back(planning_pipeline::PlanningPipelinePtr(new planning_pipeline::PlanningPipeline(planning_scene_monitor_->getKinematicModel())));
+    if (planning_threads > 1)
+      ROS_INFO("MoveGroup can compute up to %u motion plans concurrently", planning_threads);
     
     // if the user wants to be able to disable execution of paths, they can just set this ROS param to false
     node_handle_.param("allow_trajectory_execution", allow_trajectory_execution_, true);
+
+    // if this ROS param is true, planners work on snapshots of the monitored scene, instead of blocking scene updates while planning
+    bool use_scene_snapshots = false;
+    node_handle_.param("use_scene_snapshots", use_scene_snapshots, false);
+    planning_scene_monitor_->useSceneSnapshots(use_scene_snapshots);
     
     if (allow_trajectory_execution_)
     {  
@@ -84,24 +103,35 @@ public:
         plan_with_sensing_->displayCostSources(true);
     }
     
-    pick_place_.reset(new pick_place::PickPlace(planning_pipeline_));
+    // pick and place has a pipeline of its own, so pickups do not use a planner instance that may be leased by a planning request
+    pick_place_.reset(new pick_place::PickPlace(planning_pipeline::PlanningPipelinePtr(new planning_pipeline::PlanningPipeline(planning_scene_monitor_->getKinematicModel()))));
     
-    // configure the planning pipeline
-    planning_pipeline_->displayComputedMotionPlans(true);
-    planning_pipeline_->checkSolutionPaths(true);
-
-    if (debug)
-      planning_pipeline_->publishReceivedRequests(true);
+    // configure the planning pipelines
+    std::vector<planning_pipeline::PlanningPipelinePtr> pipelines = available_planning_pipelines_;
+    pipelines.push_back(pick_place_->getPlanningPipeline());
+    for (std::size_t i = 0 ; i < pipelines.size() ; ++i)
+    {
+      pipelines[i]->displayComputedMotionPlans(true);
+      pipelines[i]->checkSolutionPaths(true);
+      if (debug)
+        pipelines[i]->publishReceivedRequests(true);
+    }
     
     // start the service servers
     plan_service_ = root_node_handle_.advertiseService(PLANNER_SERVICE_NAME, &MoveGroupServer::computePlanService, this);
     execute_service_ = root_node_handle_.advertiseService(EXECUTE_SERVICE_NAME, &MoveGroupServer::executeTrajectoryService, this);
     query_service_ = root_node_handle_.advertiseService(QUERY_SERVICE_NAME, &MoveGroupServer::queryInterface, this);
 
+    // start the threads that serve the move goals: plan-only goals are computed concurrently, as many at a time as there
+    // are planning pipelines; goals that move the robot are served one at a time
+    for (unsigned int i = 0 ; i < planning_threads ; ++i)
+      move_workers_.create_thread(boost::bind(&MoveGroupServer::planOnlyMoveWorker, this));
+    move_workers_.create_thread(boost::bind(&MoveGroupServer::executeMoveWorker, this));
+    
     // start the move action server
-    move_action_server_.reset(new actionlib::SimpleActionServer<moveit_msgs::MoveGroupAction>(root_node_handle_, MOVE_ACTION,
-                                                                                              boost::bind(&MoveGroupServer::executeMoveCallback, this, _1), false));
-    move_action_server_->registerPreemptCallback(boost::bind(&MoveGroupServer::preemptMoveCallback, this));
+    move_action_server_.reset(new MoveActionServer(root_node_handle_, MOVE_ACTION,
+                                                   boost::bind(&MoveGroupServer::moveGoalCallback, this, _1),
+                                                   boost::bind(&MoveGroupServer::moveCancelCallback, this, _1), false));
     move_action_server_->start();
 
     // start the pickup action server
@@ -119,9 +149,21 @@ public:
   
   ~MoveGroupServer(void)
   {
+    // no goal or cancel callbacks reach the move workers once the move action server is gone
     move_action_server_.reset();
+    {
+      boost::mutex::scoped_lock slock(move_goals_lock_);
+      move_workers_running_ = false;
+      preemptActiveExecuteGoal();
+      move_goals_condition_.notify_all();
+    }
+    
+    // stop a pickup or place that may be executing; their servers wait for the goal being served when they are destroyed
+    if (plan_execution_)
+      plan_execution_->stop();
     pickup_action_server_.reset();
     place_action_server_.reset();
+    move_workers_.join_all();
     execute_service_.shutdown();
     plan_service_.shutdown();
     query_service_.shutdown();
@@ -138,17 +180,71 @@ public:
   }
   
 private:
+
+  typedef actionlib::ActionServer<moveit_msgs::MoveGroupAction> MoveActionServer;
+  
+  /** \brief Exclusive access to one of the planning pipelines, for the duration of a planning request */
+  class PlanningPipelineLease
+  {
+  public:
+    PlanningPipelineLease(MoveGroupServer *owner) : owner_(owner)
+    {
+      boost::mutex::scoped_lock slock(owner_->planning_pipelines_lock_);
+      while (owner_->available_planning_pipelines_.empty())
+        owner_->planning_pipelines_condition_.wait(slock);
+      pipeline_ = owner_->available_planning_pipelines_.back();
+      owner_->available_planning_pipelines_.pop_back();
+    }
+    
+    ~PlanningPipelineLease(void)
+    {
+      {
+        boost::mutex::scoped_lock slock(owner_->planning_pipelines_lock_);
+        owner_->available_planning_pipelines_.push_back(pipeline_);
+      }
+      owner_->planning_pipelines_condition_.notify_one();
+    }
+    
+    const planning_pipeline::PlanningPipelinePtr& operator->(void) const
+    {
+      return pipeline_;
+    }
+    
+  private:
+    MoveGroupServer *owner_;
+    planning_pipeline::PlanningPipelinePtr pipeline_;
+  };
+  
+  void trackConstraintFrames(const moveit_msgs::Constraints &constr)
+  {
+    for (std::size_t i = 0 ; i < constr.position_constraints.size() ; ++i)
+      planning_scene_monitor_->trackFrame(constr.position_constraints[i].header.frame_id);
+    for (std::size_t i = 0 ; i < constr.orientation_constraints.size() ; ++i)
+      planning_scene_monitor_->trackFrame(constr.orientation_constraints[i].header.frame_id);
+    for (std::size_t i = 0 ; i < constr.visibility_constraints.size() ; ++i)
+      planning_scene_monitor_->trackFrame(constr.visibility_constraints[i].target_pose.header.frame_id);
+  }
+  
+  /// make sure the transforms of the frames a request is expressed in are maintained by the planning scene monitor
+  void trackRequestFrames(const moveit_msgs::MotionPlanRequest &req)
+  {
+    planning_scene_monitor_->trackFrame(req.workspace_parameters.header.frame_id);
+    for (std::size_t i = 0 ; i < req.goal_constraints.size() ; ++i)
+      trackConstraintFrames(req.goal_constraints[i]);
+    trackConstraintFrames(req.path_constraints);
+  }
   
   bool planUsingPlanningPipeline(const moveit_msgs::MotionPlanRequest &req, plan_execution::ExecutableMotionPlan &plan)
   {    
     setMoveState(PLANNING);
 
+    PlanningPipelineLease pipeline(this); // wait for a pipeline before locking the scene, so scene updates are not blocked while waiting
     planning_scene_monitor::LockedPlanningSceneRO lscene(plan.planning_scene_monitor_);
     bool solved = false;
     moveit_msgs::MotionPlanResponse res;
     try
     {
-      solved = planning_pipeline_->generatePlan(plan.planning_scene_, req, res);
+      solved = pipeline->generatePlan(plan.planning_scene_, req, res);
     }
     catch(std::runtime_error &ex)
     {
@@ -174,6 +270,18 @@ private:
   }
   
   void startMoveExecutionCallback(void) { setMoveState(MONITOR); }
+  
+  /// Called by plan_execution_ before each planning attempt for the goal that moves the robot: from now on, preempting
+  /// that goal stops plan_execution_, which is then known to be working on it (and not, e.g., on a pickup)
+  void startMovePlanningCallback(void)
+  {
+    boost::mutex::scoped_lock slock(move_goals_lock_);
+    active_execute_goal_owns_execution_ = true;
+    // a preempt requested before plan_execution_ started working on this goal is passed on now; earlier, it would
+    // have been cleared when the planning started
+    if (active_execute_goal_preempted_)
+      plan_execution_->stop();
+  }
   void startMoveLookCallback(void) { setMoveState(LOOK); }
 
   void startPickupExecutionCallback(void) { setPickupState(MONITOR); }
@@ -183,13 +291,14 @@ private:
   {
     ROS_INFO("Planning request received for MoveGroup action. Forwarding to planning pipeline.");
     
+    PlanningPipelineLease pipeline(this);
     planning_scene_monitor::LockedPlanningSceneRO lscene(planning_scene_monitor_); // lock the scene so that it does not modify the world representation while diff() is called
     const planning_scene::PlanningSceneConstPtr &the_scene = (planning_scene::PlanningScene::isEmpty(goal->planning_options.planning_scene_diff)) ?
       static_cast<const planning_scene::PlanningSceneConstPtr&>(lscene) : lscene->diff(goal->planning_options.planning_scene_diff);
     moveit_msgs::MotionPlanResponse res;
     try
     {
-      planning_pipeline_->generatePlan(the_scene, goal->request, res);
+      pipeline->generatePlan(the_scene, goal->request, res);
     }
     catch(std::runtime_error &ex)
     {
@@ -225,6 +334,15 @@ private:
   void executeMoveCallback_PlanAndExecute(const moveit_msgs::MoveGroupGoalConstPtr& goal, moveit_msgs::MoveGroupResult &action_res)
   {  
     ROS_INFO("Combined planning and execution request received for MoveGroup action. Forwarding to planning and execution pipeline.");
+    boost::mutex::scoped_lock elock(execution_lock_);
+    {
+      boost::mutex::scoped_lock slock(move_goals_lock_);
+      if (active_execute_goal_preempted_)
+      {
+        action_res.error_code.val = moveit_msgs::MoveItErrorCodes::PREEMPTED;
+        return;
+      }
+    }
 
     if (planning_scene::PlanningScene::isEmpty(goal->planning_options.planning_scene_diff))
     {
@@ -252,6 +370,7 @@ private:
     opt.replan_ = goal->planning_options.replan;
     opt.replan_attempts_ = goal->planning_options.replan_attempts;
     opt.before_execution_callback_ = boost::bind(&MoveGroupServer::startMoveExecutionCallback, this);
+    opt.before_plan_callback_ = boost::bind(&MoveGroupServer::startMovePlanningCallback, this);
     
     opt.plan_callback_ = boost::bind(&MoveGroupServer::planUsingPlanningPipeline, this, boost::cref(motion_plan_request), _1);
     if (goal->planning_options.look_around && plan_with_sensing_)
@@ -263,6 +382,10 @@ private:
     
     plan_execution::ExecutableMotionPlan plan;
     plan_execution_->planAndExecute(plan, planning_scene_diff, opt);  
+    {
+      boost::mutex::scoped_lock slock(move_goals_lock_);
+      active_execute_goal_owns_execution_ = false;
+    }
     
     action_res.trajectory_start = plan.trajectory_start_;
     if (plan.planned_trajectory_.empty())
@@ -273,39 +396,148 @@ private:
     action_res.error_code = plan.error_code_;
   }
   
-  void executeMoveCallback(const moveit_msgs::MoveGroupGoalConstPtr& goal)
+  void moveGoalCallback(MoveActionServer::GoalHandle gh)
   {
-    setMoveState(PLANNING);
-    planning_scene_monitor_->updateFrameTransforms();
-
-    moveit_msgs::MoveGroupResult action_res;
-    if (goal->planning_options.plan_only || !allow_trajectory_execution_)
+    // this is called with the action server locked, so the goal is only queued here
+    boost::mutex::scoped_lock slock(move_goals_lock_);
+    if (gh.getGoal()->planning_options.plan_only || !allow_trajectory_execution_)
+      plan_only_move_goals_.push_back(gh);
+    else
+    {
+      // as with a simple action server, a new goal that moves the robot preempts the previous one
+      if (have_pending_execute_goal_)
+        pending_execute_goal_.setCanceled(moveit_msgs::MoveGroupResult(), "This goal was canceled because another goal was received");
+      pending_execute_goal_ = gh;
+      have_pending_execute_goal_ = true;
+      preemptActiveExecuteGoal();
+    }
+    move_goals_condition_.notify_all();
+  }
+  
+  /// Preempt the goal that moves the robot, if there is one; called with move_goals_lock_ held
+  void preemptActiveExecuteGoal(void)
+  {
+    if (!have_active_execute_goal_)
+      return;
+    active_execute_goal_preempted_ = true;
+    // plan_execution_ is shared with pickup and place, so it is only stopped if it works on this goal
+    if (active_execute_goal_owns_execution_)
+      plan_execution_->stop();
+  }
+  
+  void moveCancelCallback(MoveActionServer::GoalHandle gh)
+  {
+    boost::mutex::scoped_lock slock(move_goals_lock_);
+    if (have_active_execute_goal_ && gh == active_execute_goal_)
+      preemptActiveExecuteGoal();
+    else
+      if (have_pending_execute_goal_ && gh == pending_execute_goal_)
+      {
+        gh.setCanceled(moveit_msgs::MoveGroupResult(), "Canceled before execution started");
+        have_pending_execute_goal_ = false;
+      }
+      else
+      {
+        // plan-only goals that are being computed run to completion; the ones still waiting are dropped
+        std::deque<MoveActionServer::GoalHandle>::iterator it = std::find(plan_only_move_goals_.begin(), plan_only_move_goals_.end(), gh);
+        if (it != plan_only_move_goals_.end())
+        {
+          gh.setCanceled(moveit_msgs::MoveGroupResult(), "Canceled before planning started");
+          plan_only_move_goals_.erase(it);
+        }
+      }
+  }
+  
+  /// Accept \e gh; return false if it was canceled before it could be accepted (it is then reported as canceled)
+  bool acceptMoveGoal(MoveActionServer::GoalHandle &gh)
+  {
+    gh.setAccepted();
+    if (gh.getGoalStatus().status == actionlib_msgs::GoalStatus::PREEMPTING)
+    {
+      gh.setCanceled(moveit_msgs::MoveGroupResult(), "Preempted");
+      return false;
+    }
+    return true;
+  }
+  
+  void planOnlyMoveWorker(void)
+  {
+    while (true)
     {
+      MoveActionServer::GoalHandle gh;
+      {
+        boost::mutex::scoped_lock slock(move_goals_lock_);
+        while (move_workers_running_ && plan_only_move_goals_.empty())
+          move_goals_condition_.wait(slock);
+        if (!move_workers_running_)
+          return;
+        gh = plan_only_move_goals_.front();
+        plan_only_move_goals_.pop_front();
+      }
+      if (!acceptMoveGoal(gh))
+        continue;
+      
+      moveit_msgs::MoveGroupGoalConstPtr goal = gh.getGoal();
+      publishMoveState(gh, PLANNING);
+      trackRequestFrames(goal->request);
+      planning_scene_monitor_->updateFrameTransforms();
+      
+      moveit_msgs::MoveGroupResult action_res;
       if (!goal->planning_options.plan_only)
         ROS_WARN("This instance of MoveGroup is not allowed to execute trajectories but the goal request has plan_only set to false. Only a motion plan will be computed anyway.");
       executeMoveCallback_PlanOnly(goal, action_res);
+      setMoveResult(gh, action_res, true);
     }
-    else
-      executeMoveCallback_PlanAndExecute(goal, action_res);
-
+  }
+  
+  void executeMoveWorker(void)
+  {
+    while (true)
+    {
+      MoveActionServer::GoalHandle gh;
+      {
+        boost::mutex::scoped_lock slock(move_goals_lock_);
+        while (move_workers_running_ && !have_pending_execute_goal_)
+          move_goals_condition_.wait(slock);
+        if (!move_workers_running_)
+          return;
+        active_execute_goal_ = pending_execute_goal_;
+        have_pending_execute_goal_ = false;
+        have_active_execute_goal_ = true;
+        active_execute_goal_preempted_ = false;
+        active_execute_goal_owns_execution_ = false;
+        gh = active_execute_goal_;
+      }
+      if (acceptMoveGoal(gh))
+      {
+        moveit_msgs::MoveGroupGoalConstPtr goal = gh.getGoal();
+        setMoveState(PLANNING);
+        trackRequestFrames(goal->request);
+        planning_scene_monitor_->updateFrameTransforms();
+        
+        moveit_msgs::MoveGroupResult action_res;
+        executeMoveCallback_PlanAndExecute(goal, action_res);
+        setMoveResult(gh, action_res, false);
+        setMoveState(IDLE);
+      }
+      boost::mutex::scoped_lock slock(move_goals_lock_);
+      have_active_execute_goal_ = false;
+    }
+  }
+  
+  void setMoveResult(MoveActionServer::GoalHandle &gh, const moveit_msgs::MoveGroupResult &action_res, bool plan_only)
+  {
     bool planned_trajectory_empty = trajectory_processing::isTrajectoryEmpty(action_res.planned_trajectory);
-    std::string response = getActionResultString(action_res.error_code, planned_trajectory_empty, goal->planning_options.plan_only);
+    std::string response = getActionResultString(action_res.error_code, planned_trajectory_empty, plan_only);
     if (action_res.error_code.val == moveit_msgs::MoveItErrorCodes::SUCCESS)
-      move_action_server_->setSucceeded(action_res, response);
+      gh.setSucceeded(action_res, response);
     else
     {
       if (action_res.error_code.val == moveit_msgs::MoveItErrorCodes::PREEMPTED)
-        move_action_server_->setPreempted(action_res, response);
+        gh.setCanceled(action_res, response);
       else 
-        move_action_server_->setAborted(action_res, response);
+        gh.setAborted(action_res, response);
     }
-    
-    setMoveState(IDLE);
-  }
-
-  void preemptMoveCallback(void)
-  {
-    plan_execution_->stop();
   }
 
   std::string getActionResultString(const moveit_msgs::MoveItErrorCodes &error_code, bool planned_trajectory_empty, bool plan_only)
@@ -377,11 +609,24 @@ private:
     }
   }
   
+  /// Publish the state of the goal that moves the robot (there is at most one at a time)
   void setMoveState(MoveGroupState state)
   {
-    move_state_ = state;
-    move_feedback_.state = stateToStr(state);
-    move_action_server_->publishFeedback(move_feedback_);
+    MoveActionServer::GoalHandle gh;
+    {
+      boost::mutex::scoped_lock slock(move_goals_lock_);
+      if (!have_active_execute_goal_)
+        return;
+      gh = active_execute_goal_;
+    }
+    publishMoveState(gh, state);
+  }
+  
+  void publishMoveState(MoveActionServer::GoalHandle &gh, MoveGroupState state)
+  {
+    moveit_msgs::MoveGroupFeedback feedback;
+    feedback.state = stateToStr(state);
+    gh.publishFeedback(feedback);
   }
   
   void executePickupCallback_PlanOnly(const moveit_msgs::PickupGoalConstPtr& goal, moveit_msgs::PickupResult &action_res)
@@ -488,6 +733,7 @@ private:
   
   void executePickupCallback_PlanAndExecute(const moveit_msgs::PickupGoalConstPtr& goal, moveit_msgs::PickupResult &action_res)
   {
+    boost::mutex::scoped_lock elock(execution_lock_);
     plan_execution::PlanExecution::Options opt;
     
     opt.replan_ = goal->planning_options.replan;
@@ -515,7 +761,8 @@ private:
   {
     setPickupState(PLANNING);
     
-    planning_scene_monitor_->updateFrameTransforms();
+    // the frames referenced by pickup goals (grasps, support surfaces, constraints) are not tracked, so all frames are looked up
+    planning_scene_monitor_->updateAllFrameTransforms();
 
     moveit_msgs::PickupResult action_res;
 
@@ -566,14 +813,16 @@ private:
   bool computePlanService(moveit_msgs::GetMotionPlan::Request &req, moveit_msgs::GetMotionPlan::Response &res)
   {
     ROS_INFO("Received new planning service request...");
+    trackRequestFrames(req.motion_plan_request);
     planning_scene_monitor_->updateFrameTransforms();
     
     bool solved = false;   
+    PlanningPipelineLease pipeline(this);
     planning_scene_monitor::LockedPlanningSceneRO ps(planning_scene_monitor_);
 
     try
     {
-      solved = planning_pipeline_->generatePlan(ps, req.motion_plan_request, res.motion_plan_response);
+      solved = pipeline->generatePlan(ps, req.motion_plan_request, res.motion_plan_response);
     }
     catch(std::runtime_error &ex)
     {
@@ -599,6 +848,7 @@ private:
       return true;
     }
     
+    boost::mutex::scoped_lock elock(execution_lock_);
     trajectory_execution_manager_->clear();
     if (trajectory_execution_manager_->push(req.trajectory))
     {
@@ -654,11 +904,32 @@ private:
   plan_execution::PlanExecutionPtr plan_execution_;
   plan_execution::PlanWithSensingPtr plan_with_sensing_;
   pick_place::PickPlacePtr pick_place_;
+
+  /// the planning pipelines not currently in use; planning requests wait for one to become available
+  std::vector<planning_pipeline::PlanningPipelinePtr> available_planning_pipelines_;
+  boost::mutex planning_pipelines_lock_;
+  boost::condition_variable planning_pipelines_condition_;
+
+  /// requests that execute trajectories are served one at a time, since they share the trajectory execution manager
+  boost::mutex execution_lock_;
   
   bool allow_trajectory_execution_;
   
-  boost::scoped_ptr<actionlib::SimpleActionServer<moveit_msgs::MoveGroupAction> > move_action_server_;
-  moveit_msgs::MoveGroupFeedback move_feedback_;
+  boost::scoped_ptr<MoveActionServer> move_action_server_;
+  
+  /// the threads that serve move goals; plan-only goals wait in plan_only_move_goals_, and the goal that moves the
+  /// robot next waits in pending_execute_goal_; these are protected by move_goals_lock_
+  boost::thread_group move_workers_;
+  bool move_workers_running_;
+  std::deque<MoveActionServer::GoalHandle> plan_only_move_goals_;
+  MoveActionServer::GoalHandle active_execute_goal_;
+  bool have_active_execute_goal_;
+  bool active_execute_goal_preempted_; /// a preempt was requested for active_execute_goal_
+  bool active_execute_goal_owns_execution_; /// plan_execution_ is working on active_execute_goal_
+  MoveActionServer::GoalHandle pending_execute_goal_;
+  bool have_pending_execute_goal_;
+  boost::mutex move_goals_lock_;
+  boost::condition_variable move_goals_condition_;
 
   boost::scoped_ptr<actionlib::SimpleActionServer<moveit_msgs::PickupAction> > pickup_action_server_;
   moveit_msgs::PickupFeedback pickup_feedback_;
@@ -670,7 +941,6 @@ private:
   ros::ServiceServer execute_service_;
   ros::ServiceServer query_service_;
   
-  MoveGroupState move_state_;
   MoveGroupState pickup_state_;
 };
 
@@ -679,8 +949,15 @@ private:
 int main(int argc, char **argv)
 {
   ros::init(argc, argv, move_group::NODE_NAME);
+
+  // the number of planning service requests that can be served concurrently; one more thread is
+  // used so that monitoring callbacks are not starved while plans are computed
+  int planning_threads = 1;
+  ros::NodeHandle("~").param("planning_threads", planning_threads, 1);
+  if (planning_threads < 1)
+    planning_threads = 1;
   
-  ros::AsyncSpinner spinner(1);
+  ros::AsyncSpinner spinner(planning_threads + 1);
   spinner.start();
   
   boost::shared_ptr<tf::TransformListener> tf(new tf::TransformListener());
@@ -699,7 +976,7 @@ int main(int argc, char **argv)
         debug = true;
         break;
       }
-    move_group::MoveGroupServer mgs(planning_scene_monitor, debug);
+    move_group::MoveGroupServer mgs(planning_scene_monitor, planning_threads, debug);
     mgs.status();
     ros::waitForShutdown();
   }
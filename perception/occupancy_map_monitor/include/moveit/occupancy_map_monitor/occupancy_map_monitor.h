@@ -45,6 +45,7 @@
 #include <tf/tf.h>
 #include <moveit/occupancy_map_monitor/occupancy_map.h>
 #include <moveit/occupancy_map_monitor/occupancy_map_updater.h>
+#include <Eigen/Geometry>
 #include <set>
 
 namespace occupancy_map_monitor
@@ -56,18 +57,37 @@ public:
   
   struct Options
   {
-    Options(void) : map_resolution(0.0)
+    Options(void) : map_resolution(0.0), keyframe_period(-1.0)
     {
     }
     
     std::string map_frame;
     double map_resolution;
+
+    /** @brief The minimum time (seconds) between publications of the complete map. In between, only the cells whose
+     *  state changed are published. A value of 0 publishes the complete map after every update. If negative, the value
+     *  is read from the param server.
+     *
+     *  The complete map is published on octomap_binary and is identified by its header.stamp. The changed cells are
+     *  published on octomap_binary_updates; the data of such a message starts with UPDATE_PREFIX_SIZE bytes: three
+     *  little-endian uint32 values holding the seconds and nanoseconds of the stamp of the complete map the changes
+     *  apply to and the index of the update since that map (starting at 1). The rest of the data is a binary octree
+     *  with the changed cells as leaves. A receiver that sees a different stamp or a gap in the indices has missed
+     *  changes and should wait for the next complete map.
+     *
+     *  Binary octrees carry only whether a cell is occupied or free, not its log-odds value, so a map rebuilt from
+     *  the updates is a maximum-likelihood copy. No consumer in MoveIt decodes octomap_binary_updates yet; the
+     *  planning scene monitor reads only the complete map. */
+    double keyframe_period;
   };
   
   OccupancyMapMonitor(const boost::shared_ptr<tf::Transformer> &tf); 
   OccupancyMapMonitor(const Options &opt, const boost::shared_ptr<tf::Transformer> &tf);
 
   ~OccupancyMapMonitor(void);
+
+  /** @brief The number of bytes that precede the binary octree in the data of a message on octomap_binary_updates */
+  static const std::size_t UPDATE_PREFIX_SIZE = 12;
   
   /** @brief start the monitor (will begin updating the octomap */
   void startMonitor(void);
@@ -102,6 +122,19 @@ public:
   /** @brief unlock the underlying octree. */
   void unlockOcTreeWrite(void);
   
+  /** @brief Set the function the updaters use to get the state of the robot at a particular time. This must be called before startMonitor() */
+  void setKinematicStateFunction(const boost::function<kinematic_state::KinematicStateConstPtr(const ros::Time&)> &state_fn);
+  
+  /** @brief Get the statistics of each updater (sensor), in the order the sensors are specified on the param server */
+  void getUpdaterStatistics(std::vector<OccMapUpdaterStatistics> &stats) const;
+  
+  /** @brief Get the regions of the map that contain the cells whose state changed in the most recent update, as boxes in the map frame.
+   *  This is meant to be called from the update callback; the boxes are replaced by the next update. */
+  const std::vector<Eigen::AlignedBox3d>& getLastUpdateRegions(void) const
+  {
+    return last_update_regions_;
+  }
+  
   /** @brief Set the callback to trigger when updates to the maintained octomap are received */
   void setUpdateCallback(const boost::function<void(void)> &update_callback)
   {
@@ -116,9 +149,23 @@ private:
   void updateReady(OccupancyMapUpdater *updater);
   
   void treeUpdateThread(void);
+
+  /** @brief Apply changes computed by an updater to the tree. The tree must be locked for writing.
+   *  The keys of the cells whose state changed are added to \e changed_keys_ */
+  void applyUpdate(const OccMapUpdate &update);
+  void applyUpdate(const octomap::OcTreeKey &key, bool occupied);
+  
+  /** @brief Compute last_update_regions_ from the keys in \e changed_keys_, starting at index \e first */
+  void computeUpdateRegions(std::size_t first);
+  
   void publish_markers(void);
+  /** @brief Publish the complete map; its stamp identifies it for the updates that follow */
   void publish_octomap_binary(void);
 
+  /** @brief Publish the cells that changed state since the last publication, prefixed by the stamp of the last
+   *  complete map and the index of this update */
+  void publish_octomap_binary_update(void);
+
   Options opt_;
   
   OccMapTreePtr tree_;
@@ -129,6 +176,12 @@ private:
 
   std::vector<boost::shared_ptr<OccupancyMapUpdater> > map_updaters_;
   std::set<OccupancyMapUpdater*> updates_available_;
+  std::vector<OccMapUpdate> pending_updates_; /// buffers for the changes computed by updaters, reused between updates
+  std::vector<std::pair<octomap::OcTreeKey, bool> > changed_keys_; /// cells that changed state since the last publication, and whether they are occupied
+  ros::Time last_keyframe_time_;
+  ros::Time keyframe_stamp_; /// the stamp of the last publication of the complete map
+  uint32_t updates_since_keyframe_; /// the number of changes of the map since the last publication of the complete map
+  std::vector<Eigen::AlignedBox3d> last_update_regions_;
   
   boost::condition_variable update_cond_;
   boost::mutex update_mut_;
@@ -139,6 +192,7 @@ private:
   ros::Publisher occupied_marker_pub_;
   ros::Publisher free_marker_pub_;
   ros::Publisher octree_binary_pub_;
+  ros::Publisher octree_binary_update_pub_;
 };
 
 }
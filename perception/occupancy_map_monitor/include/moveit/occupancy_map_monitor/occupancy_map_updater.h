@@ -42,9 +42,60 @@
 #include <boost/function.hpp>
 #include <ros/ros.h>
 #include <moveit/occupancy_map_monitor/occupancy_map.h>
+#include <moveit/kinematic_state/kinematic_state.h>
+#include <vector>
 
 namespace occupancy_map_monitor
 {
+
+/** @brief The changes an updater computed for the occupancy map: the keys of the cells to be marked free and the keys of
+ *  the cells to be marked occupied. The two sets of keys are disjoint. */
+struct OccMapUpdate
+{
+  std::vector<octomap::OcTreeKey> free_keys;
+  std::vector<octomap::OcTreeKey> occupied_keys;
+  
+  void clear(void)
+  {
+    free_keys.clear();
+    occupied_keys.clear();
+  }
+  
+  bool empty(void) const
+  {
+    return free_keys.empty() && occupied_keys.empty();
+  }
+};
+
+/** @brief Statistics about the sensor data received and processed by an updater */
+struct OccMapUpdaterStatistics
+{
+  OccMapUpdaterStatistics(void) : received(0), dropped(0), failed(0), processed(0), total_latency(0.0), max_latency(0.0)
+  {
+  }
+  
+  /** @brief The average delay (seconds) between the time stamp of the processed data and the time its update was computed */
+  double getAverageLatency(void) const
+  {
+    return processed > 0 ? total_latency / (double)processed : 0.0;
+  }
+  
+  /** @brief The number of processed messages per second, since the first message was received */
+  double getThroughput(const ros::Time &now) const
+  {
+    double dt = (now - first_received).toSec();
+    return dt > 0.0 ? (double)processed / dt : 0.0;
+  }
+  
+  std::size_t received;   /// number of messages received
+  std::size_t dropped;    /// number of messages discarded without being processed (subsampling, queue overflow, age)
+  std::size_t failed;     /// number of messages that could not be processed (missing transform, invalid data)
+  std::size_t processed;  /// number of messages used to update the map
+  double total_latency;
+  double max_latency;
+  ros::Time first_received;
+};
+
 	/**
 	 * @class OccupancyMapUpdater
    * Base class for classes which update the occupancy map.
@@ -61,16 +112,31 @@ public:
        */
   void setNotifyFunction(const boost::function<void(OccupancyMapUpdater*)> &notify_func) { notify_func_ = notify_func; }
 
+  /** @brief Set the function updaters can use to get the state of the robot at a particular time (e.g., for self filtering).
+   *  The function returns an empty pointer if the state is not known. This must be called before initialize(). */
+  void setKinematicStateFunction(const boost::function<kinematic_state::KinematicStateConstPtr(const ros::Time&)> &state_fn) { kinematic_state_fn_ = state_fn; }
+
   /** @brief Set updater params using struct that comes from parsing a yaml string*/
   virtual bool setParams(XmlRpc::XmlRpcValue &params) = 0;
 
   /** @brief Do any necessary setup (subscribe to ros topics, etc.)*/
   virtual void initialize(void) = 0;
 
-  /** @brief Update the map
+  /** @brief Compute the changes to be made to the map. This function is called without holding the lock on the tree,
+       *  so it should include all the expensive computation (e.g., ray tracing). The tree must not be modified. The monitor 
+       *  applies the computed changes later, while holding the tree write lock only for that short period.
        *  @param tree Pointer to octree which represents the occupancy map
+       *  @param update The changes to be applied to the map
+       *  @return True if there are changes to be applied
        */
-  virtual void process(const OccMapTreePtr &tree) = 0;
+  virtual bool computeUpdate(const OccMapTreeConstPtr &tree, OccMapUpdate &update) = 0;
+
+  /** @brief Get the statistics about the sensor data this updater received and processed */
+  OccMapUpdaterStatistics getStatistics(void) const
+  {
+    boost::mutex::scoped_lock slock(statistics_lock_);
+    return statistics_;
+  }
 
 protected:
 
@@ -81,8 +147,45 @@ protected:
       notify_func_(this);
   }
   
+  /** @brief Updater calls this when sensor data is received */
+  void recordReceived(void)
+  {
+    boost::mutex::scoped_lock slock(statistics_lock_);
+    if (statistics_.received++ == 0)
+      statistics_.first_received = ros::Time::now();
+  }
+
+  /** @brief Updater calls this when sensor data is discarded without being processed */
+  void recordDropped(std::size_t count = 1)
+  {
+    boost::mutex::scoped_lock slock(statistics_lock_);
+    statistics_.dropped += count;
+  }
+
+  /** @brief Updater calls this when sensor data could not be processed */
+  void recordFailed(void)
+  {
+    boost::mutex::scoped_lock slock(statistics_lock_);
+    statistics_.failed++;
+  }
+
+  /** @brief Updater calls this when the update for sensor data stamped at \e stamp is computed */
+  void recordProcessed(const ros::Time &stamp)
+  {
+    double latency = (ros::Time::now() - stamp).toSec();
+    boost::mutex::scoped_lock slock(statistics_lock_);
+    statistics_.processed++;
+    statistics_.total_latency += latency;
+    if (latency > statistics_.max_latency)
+      statistics_.max_latency = latency;
+  }
+  
+  boost::function<kinematic_state::KinematicStateConstPtr(const ros::Time&)> kinematic_state_fn_;
+  
 private:
   boost::function<void(OccupancyMapUpdater*)> notify_func_;
+  OccMapUpdaterStatistics statistics_;
+  mutable boost::mutex statistics_lock_;
 };
 }
 
@@ -46,6 +46,9 @@
 #include <moveit/occupancy_map_monitor/occupancy_map.h>
 #include <moveit/occupancy_map_monitor/occupancy_map_updater.h>
 #include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <deque>
 
 namespace occupancy_map_monitor
 {
@@ -59,12 +62,39 @@ namespace occupancy_map_monitor
     virtual bool setParams(const std::string &point_cloud_topic, double max_range,  size_t frame_subsample,
                            size_t point_subsample, const std::vector<robot_self_filter::LinkInfo> see_links);
     virtual void initialize(void);
-    virtual void process(const OccMapTreePtr &tree);
+    virtual bool computeUpdate(const OccMapTreeConstPtr &tree, OccMapUpdate &update);
+
+    /** @brief Set the number of threads used for ray tracing a point cloud. By default, one thread per CPU core is used. */
+    void setRayTracingThreads(unsigned int threads);
+
+    /** @brief Get the number of threads used for ray tracing a point cloud */
+    unsigned int getRayTracingThreads(void) const
+    {
+      return key_rays_.size();
+    }
       
   private:
 
     virtual void cloudMsgCallback(const sensor_msgs::PointCloud2::ConstPtr &cloud_msg);
-    virtual void processCloud(const OccMapTreePtr &tree, const sensor_msgs::PointCloud2::ConstPtr &cloud_msg);
+    virtual bool processCloud(const OccMapTreeConstPtr &tree, const sensor_msgs::PointCloud2::ConstPtr &cloud_msg, OccMapUpdate &update);
+
+    /** @brief A block of the point cloud (rows [row_begin, row_end), columns [col_begin, col_end)) that is ray traced by one thread,
+     *  and the keys of the cells found to be free or occupied in that block (sorted, with no duplicates) */
+    struct RayTracingBlock
+    {
+      unsigned int row_begin, row_end;
+      unsigned int col_begin, col_end;
+      octomap::KeyRay *key_ray;
+      std::vector<octomap::OcTreeKey> free_keys;
+      std::vector<octomap::OcTreeKey> occupied_keys;
+    };
+    
+    void traceRays(const OccMapTreeConstPtr &tree, const robot_self_filter::PointCloud2View &cloud, const std::vector<bool> &self_points,
+                   const tf::Transform &map_H_sensor, const octomap::point3d &sensor_origin, RayTracingBlock &block) const;
+    
+    /** @brief The loop of the thread that traces block \e index of every cloud, starting with the round after \e round */
+    void tracerThread(std::size_t index, unsigned long round);
+    void stopTracers(void);
     
     ros::NodeHandle root_nh_;
       
@@ -76,15 +106,32 @@ namespace occupancy_map_monitor
     double max_range_;
     size_t frame_subsample_;
     size_t point_subsample_;
+    bool self_filter_from_state_; /// compute the poses of the self filtered links from the robot state instead of TF
+    bool keep_latest_;            /// if true, only the most recent cloud is kept for processing; otherwise, up to queue_size_ clouds are queued and the oldest are dropped
+    size_t queue_size_;
+    double max_age_;              /// clouds older than this (seconds) when their turn to be processed comes are dropped; 0 disables the check
       
     message_filters::Subscriber<sensor_msgs::PointCloud2> *point_cloud_subscriber_;
     tf::MessageFilter<sensor_msgs::PointCloud2> *point_cloud_filter_;
-    sensor_msgs::PointCloud2::ConstPtr last_point_cloud_;
-    boost::mutex last_point_cloud_mutex_;
+    std::deque<sensor_msgs::PointCloud2::ConstPtr> point_clouds_;
+    boost::mutex point_clouds_mutex_;
+    size_t frame_count_;
       
-    /* used to store all cells in the map which a given ray passes through during raycasting.
-       we cache this here because it dynamically pre-allocates a lot of memory in its contsructor */
-    octomap::KeyRay key_ray_;
+    /* used to store all cells in the map which a given ray passes through during raycasting (one per ray tracing thread).
+       we cache these here because they dynamically pre-allocate a lot of memory in their contsructor */
+    std::vector<boost::shared_ptr<octomap::KeyRay> > key_rays_;
+    
+    /* the threads that trace all the blocks of a cloud but the last one, which is traced by the thread processing the cloud.
+       they are started by setRayTracingThreads() and each processed cloud is a new round for them */
+    boost::scoped_ptr<boost::thread_group> tracers_;
+    boost::function<void(RayTracingBlock&)> trace_block_;
+    std::vector<RayTracingBlock> *tracing_blocks_;
+    unsigned long tracing_round_;
+    std::size_t pending_tracers_;
+    bool stop_tracers_;
+    boost::mutex tracers_mutex_;
+    boost::condition_variable tracers_condition_;
+    boost::condition_variable tracers_done_condition_;
 
     boost::shared_ptr<robot_self_filter::SelfMask> self_mask_;
   };
@@ -59,6 +59,7 @@ OccupancyMapMonitor::OccupancyMapMonitor(const boost::shared_ptr<tf::Transformer
 void OccupancyMapMonitor::initialize(const Options &input_opt, const boost::shared_ptr<tf::Transformer> &tf)
 { 
   tree_update_thread_running_ = false;
+  updates_since_keyframe_ = 0;
   opt_ = input_opt; // we need to be able to update options
   
   /* load params from param server */
@@ -73,6 +74,10 @@ void OccupancyMapMonitor::initialize(const Options &input_opt, const boost::shar
   if (opt_.map_frame.empty())
     if (!nh_.getParam("octomap_frame", opt_.map_frame))
       ROS_WARN("No target frame specified for Octomap. No transforms will be applied to received data.");
+
+  if (opt_.keyframe_period < 0.0)
+    nh_.param("octomap_keyframe_period", opt_.keyframe_period, 1.0);
+  ROS_DEBUG("Publishing the complete octomap every %lf seconds", opt_.keyframe_period);
   
   tree_.reset(new octomap::OcTree(opt_.map_resolution));
   tree_const_ = tree_;
@@ -123,6 +128,7 @@ void OccupancyMapMonitor::initialize(const Options &input_opt, const boost::shar
     }
   }
   octree_binary_pub_ = root_nh_.advertise<octomap_msgs::Octomap>("octomap_binary", 1);
+  octree_binary_update_pub_ = root_nh_.advertise<octomap_msgs::Octomap>("octomap_binary_updates", 100);
 }
 
 void OccupancyMapMonitor::treeUpdateThread(void)
@@ -132,26 +138,114 @@ void OccupancyMapMonitor::treeUpdateThread(void)
   {
     {
       boost::mutex::scoped_lock update_lock(update_mut_);
-      if (update_cond_.timed_wait(update_lock, boost::posix_time::milliseconds(100)))
-        updates_available_.swap(ready);
+      // updaters may have become ready while the previous updates were computed; only wait if none did
+      if (updates_available_.empty())
+        update_cond_.timed_wait(update_lock, boost::posix_time::milliseconds(100));
+      updates_available_.swap(ready);
     }
     if (tree_update_thread_running_ && !ready.empty())
     {
       ROS_DEBUG("Calling updaters");
+      
+      // the updaters compute their changes without holding the tree lock; this is safe because this thread is
+      // the only one that modifies the tree, so readers (e.g., planners) are only blocked while changes are applied
+      if (pending_updates_.size() < ready.size())
+        pending_updates_.resize(ready.size());
+      std::size_t count = 0;
+      for (std::set<OccupancyMapUpdater*>::iterator it = ready.begin() ; it != ready.end() ; ++it)
       {
-        boost::unique_lock<boost::shared_mutex> ulock(tree_mutex_);
-        for (std::set<OccupancyMapUpdater*>::iterator it = ready.begin() ; it != ready.end() ; ++it)
-          (*it)->process(tree_);
+        pending_updates_[count].clear();
+        if ((*it)->computeUpdate(tree_const_, pending_updates_[count]))
+          count++;
       }
-      if (update_callback_)
-        update_callback_();
       ready.clear();
-
-      publish_octomap_binary();
+      
+      if (count > 0)
+      {
+        std::size_t first_changed = changed_keys_.size();
+        {
+          boost::unique_lock<boost::shared_mutex> ulock(tree_mutex_);
+          for (std::size_t i = 0 ; i < count ; ++i)
+            applyUpdate(pending_updates_[i]);
+        }
+        computeUpdateRegions(first_changed);
+        if (update_callback_)
+          update_callback_();
+        
+        // the tree is only modified by this thread, so it can be read here without locking
+        ros::Time now = ros::Time::now();
+        if (opt_.keyframe_period <= 0.0 || now - last_keyframe_time_ >= ros::Duration(opt_.keyframe_period))
+        {
+          publish_octomap_binary();
+          last_keyframe_time_ = now;
+          changed_keys_.clear();
+        }
+        else
+          publish_octomap_binary_update();
+      }
     }
   }
 }
 
+void OccupancyMapMonitor::applyUpdate(const OccMapUpdate &update)
+{
+  // each change updates only the inner nodes on the path to its key, and prunes them where possible, so the
+  // exclusive lock is not held for a walk over the whole tree
+  for (std::size_t i = 0 ; i < update.free_keys.size() ; ++i)
+    applyUpdate(update.free_keys[i], false);
+  for (std::size_t i = 0 ; i < update.occupied_keys.size() ; ++i)
+    applyUpdate(update.occupied_keys[i], true);
+}
+
+void OccupancyMapMonitor::applyUpdate(const octomap::OcTreeKey &key, bool occupied)
+{
+  const OccMapNode *node = tree_->search(key);
+  bool known = node != NULL;
+  bool was_occupied = known && tree_->isNodeOccupied(node);
+  // if the update makes the children of a node identical, they are pruned and their parent is returned
+  node = tree_->updateNode(key, occupied);
+  bool is_occupied = tree_->isNodeOccupied(node);
+  if (!known || was_occupied != is_occupied)
+    changed_keys_.push_back(std::make_pair(key, is_occupied));
+}
+
+void OccupancyMapMonitor::computeUpdateRegions(std::size_t first)
+{
+  // changed cells are grouped in blocks of 16 x 16 x 16 cells, so there are a few boxes rather than one box per cell
+  static const unsigned int BLOCK_BITS = 4;
+  
+  octomap::KeySet blocks;
+  for (std::size_t i = first ; i < changed_keys_.size() ; ++i)
+  {
+    const octomap::OcTreeKey &key = changed_keys_[i].first;
+    blocks.insert(octomap::OcTreeKey(key[0] >> BLOCK_BITS, key[1] >> BLOCK_BITS, key[2] >> BLOCK_BITS));
+  }
+  
+  last_update_regions_.clear();
+  double resolution = tree_->getResolution();
+  Eigen::Vector3d block_size = Eigen::Vector3d::Constant(resolution * (double)(1 << BLOCK_BITS));
+  for (octomap::KeySet::const_iterator it = blocks.begin() ; it != blocks.end() ; ++it)
+  {
+    // the corner of a block is the corner of its first cell
+    octomap::point3d center = tree_->keyToCoord(octomap::OcTreeKey((*it)[0] << BLOCK_BITS, (*it)[1] << BLOCK_BITS, (*it)[2] << BLOCK_BITS));
+    Eigen::Vector3d corner(center.x() - resolution / 2.0, center.y() - resolution / 2.0, center.z() - resolution / 2.0);
+    last_update_regions_.push_back(Eigen::AlignedBox3d(corner, corner + block_size));
+  }
+}
+
+void OccupancyMapMonitor::setKinematicStateFunction(const boost::function<kinematic_state::KinematicStateConstPtr(const ros::Time&)> &state_fn)
+{
+  for (std::size_t i = 0 ; i < map_updaters_.size() ; ++i)
+    map_updaters_[i]->setKinematicStateFunction(state_fn);
+}
+
+void OccupancyMapMonitor::getUpdaterStatistics(std::vector<OccMapUpdaterStatistics> &stats) const
+{
+  stats.resize(map_updaters_.size());
+  for (std::size_t i = 0 ; i < map_updaters_.size() ; ++i)
+    stats[i] = map_updaters_[i]->getStatistics();
+}
+
 void OccupancyMapMonitor::updateReady(OccupancyMapUpdater *updater)
 { 
   {
@@ -188,6 +282,10 @@ void OccupancyMapMonitor::publish_octomap_binary(void)
   map.header.frame_id = opt_.map_frame;
   map.header.stamp = ros::Time::now();
 
+  /* roscpp overwrites header.seq, so the complete map is identified by its stamp instead; updates refer to it */
+  keyframe_stamp_ = map.header.stamp;
+  updates_since_keyframe_ = 0;
+
   if (octomap_msgs::binaryMapToMsgData(*tree_, map.data))
   {
     octree_binary_pub_.publish(map);
@@ -198,6 +296,42 @@ void OccupancyMapMonitor::publish_octomap_binary(void)
   }
 }
 
+void OccupancyMapMonitor::publish_octomap_binary_update(void)
+{
+  if (changed_keys_.empty())
+    return;
+  
+  /* the index advances even if nobody listens, so the numbers count the changes of the map */
+  uint32_t index = ++updates_since_keyframe_;
+  if (octree_binary_update_pub_.getNumSubscribers() > 0)
+  {
+    /* the changed cells are sent as a (sparse) tree of their own; subscribers insert its leaves in their copy of the map */
+    octomap::OcTree delta(tree_->getResolution());
+    for (std::size_t i = 0 ; i < changed_keys_.size() ; ++i)
+      delta.updateNode(changed_keys_[i].first, changed_keys_[i].second, true);
+    delta.updateInnerOccupancy();
+    
+    octomap_msgs::Octomap map;
+    map.header.frame_id = opt_.map_frame;
+    map.header.stamp = ros::Time::now();
+    std::vector<int8_t> tree_data;
+    if (octomap_msgs::binaryMapToMsgData(delta, tree_data))
+    {
+      /* the sequence information is part of the payload, since roscpp does not preserve header.seq */
+      const uint32_t prefix[3] = { keyframe_stamp_.sec, keyframe_stamp_.nsec, index };
+      map.data.reserve(UPDATE_PREFIX_SIZE + tree_data.size());
+      for (std::size_t i = 0 ; i < 3 ; ++i)
+        for (std::size_t b = 0 ; b < 4 ; ++b)
+          map.data.push_back((int8_t)((prefix[i] >> (8 * b)) & 0xFF));
+      map.data.insert(map.data.end(), tree_data.begin(), tree_data.end());
+      octree_binary_update_pub_.publish(map);
+    }
+    else
+      ROS_ERROR("Could not generate OctoMap update message");
+  }
+  changed_keys_.clear();
+}
+
 void OccupancyMapMonitor::startMonitor(void)
 {
   if (!tree_update_thread_running_)
@@ -38,24 +38,57 @@
 #include <tf/tf.h>
 #include <tf/message_filter.h>
 #include <message_filters/subscriber.h>
-#include <pcl/point_types.h>
-#include <pcl/point_cloud.h>
-#include <pcl/ros/conversions.h>
 #include <moveit/robot_self_filter/self_mask.h>
+#include <moveit/robot_self_filter/point_cloud2_view.h>
+#include <algorithm>
+#include <iterator>
 
 namespace occupancy_map_monitor
 {
 
+namespace
+{
+/* a strict ordering for octree keys, so we can sort and merge vectors of keys */
+struct OcTreeKeyLess
+{
+  bool operator()(const octomap::OcTreeKey &a, const octomap::OcTreeKey &b) const
+  {
+    if (a.k[0] != b.k[0])
+      return a.k[0] < b.k[0];
+    if (a.k[1] != b.k[1])
+      return a.k[1] < b.k[1];
+    return a.k[2] < b.k[2];
+  }
+};
+
+void sortAndRemoveDuplicates(std::vector<octomap::OcTreeKey> &keys)
+{
+  std::sort(keys.begin(), keys.end(), OcTreeKeyLess());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+}
+
 
 PointCloudOccupancyMapUpdater::PointCloudOccupancyMapUpdater(const boost::shared_ptr<tf::Transformer> &tf, const std::string &map_frame)
   : tf_(tf), map_frame_(map_frame),
+    self_filter_from_state_(false),
+    keep_latest_(true),
+    queue_size_(5),
+    max_age_(0.0),
     point_cloud_subscriber_(NULL),
-    point_cloud_filter_(NULL)
+    point_cloud_filter_(NULL),
+    frame_count_(0),
+    tracing_blocks_(NULL),
+    tracing_round_(0),
+    pending_tracers_(0),
+    stop_tracers_(false)
 {
+  setRayTracingThreads(boost::thread::hardware_concurrency());
 }
 
 PointCloudOccupancyMapUpdater::~PointCloudOccupancyMapUpdater(void)
 {
+  stopTracers();
   delete point_cloud_filter_;
   delete point_cloud_subscriber_;
 }
@@ -89,9 +122,98 @@ bool PointCloudOccupancyMapUpdater::setParams(XmlRpc::XmlRpcValue &params)
     }
   }
 
+  if(params.hasMember("ray_tracing_threads"))
+  {
+    int threads = int (params["ray_tracing_threads"]);
+    if (threads > 0)
+      setRayTracingThreads(threads);
+    else
+    {
+      ROS_WARN("The number of ray tracing threads must be positive (%d was specified). Using one thread per CPU core.", threads);
+      setRayTracingThreads(boost::thread::hardware_concurrency());
+    }
+  }
+
+  if(params.hasMember("self_filter_from_state"))
+    self_filter_from_state_ = bool (params["self_filter_from_state"]);
+
+  if(params.hasMember("queue_policy"))
+  {
+    std::string policy = std::string (params["queue_policy"]);
+    if (policy == "keep_latest")
+      keep_latest_ = true;
+    else
+      if (policy == "drop_oldest")
+        keep_latest_ = false;
+      else
+        ROS_ERROR("Unknown queue policy '%s' for point cloud sensor. Valid policies are 'keep_latest' and 'drop_oldest'.", policy.c_str());
+  }
+  
+  if(params.hasMember("queue_size"))
+    queue_size_ = std::max(1, int (params["queue_size"]));
+
+  if(params.hasMember("max_age"))
+    max_age_ = double (params["max_age"]);
+
   return this->setParams(point_cloud_topic, max_range, frame_subsample, point_subsample, links);
 }
 
+void PointCloudOccupancyMapUpdater::setRayTracingThreads(unsigned int threads)
+{
+  if (threads < 1)
+    threads = 1;
+  stopTracers();
+  key_rays_.resize(threads);
+  for (std::size_t i = 0 ; i < key_rays_.size() ; ++i)
+    if (!key_rays_[i])
+      key_rays_[i].reset(new octomap::KeyRay());
+  
+  boost::mutex::scoped_lock slock(tracers_mutex_);
+  tracers_.reset(new boost::thread_group());
+  for (std::size_t i = 0 ; i + 1 < key_rays_.size() ; ++i)
+    tracers_->create_thread(boost::bind(&PointCloudOccupancyMapUpdater::tracerThread, this, i, tracing_round_));
+}
+
+void PointCloudOccupancyMapUpdater::stopTracers(void)
+{
+  {
+    boost::mutex::scoped_lock slock(tracers_mutex_);
+    if (!tracers_)
+      return;
+    stop_tracers_ = true;
+  }
+  tracers_condition_.notify_all();
+  tracers_->join_all();
+  
+  boost::mutex::scoped_lock slock(tracers_mutex_);
+  tracers_.reset();
+  stop_tracers_ = false;
+}
+
+void PointCloudOccupancyMapUpdater::tracerThread(std::size_t index, unsigned long round)
+{
+  boost::unique_lock<boost::mutex> ulock(tracers_mutex_);
+  while (true)
+  {
+    while (!stop_tracers_ && tracing_round_ == round)
+      tracers_condition_.wait(ulock);
+    if (stop_tracers_)
+      return;
+    round = tracing_round_;
+    
+    /* the last block is traced by the thread processing the cloud */
+    if (index + 1 < tracing_blocks_->size())
+    {
+      RayTracingBlock &block = (*tracing_blocks_)[index];
+      ulock.unlock();
+      trace_block_(block);
+      ulock.lock();
+    }
+    if (--pending_tracers_ == 0)
+      tracers_done_condition_.notify_all();
+  }
+}
+
 bool PointCloudOccupancyMapUpdater::setParams(const std::string &point_cloud_topic, double max_range,  size_t frame_subsample,
                                               size_t point_subsample, const std::vector<robot_self_filter::LinkInfo> links)
 {
@@ -106,11 +228,19 @@ bool PointCloudOccupancyMapUpdater::setParams(const std::string &point_cloud_top
 
 void PointCloudOccupancyMapUpdater::initialize()
 {
+  if (self_mask_ && self_filter_from_state_)
+  {
+    if (kinematic_state_fn_)
+      self_mask_->setKinematicStateFunction(kinematic_state_fn_);
+    else
+      ROS_WARN("Self filtering from the robot state was requested, but the robot state is not available. Using TF instead.");
+  }
+  
   /* subscribe to point cloud topic using tf filter*/
-  point_cloud_subscriber_ = new message_filters::Subscriber<sensor_msgs::PointCloud2>(root_nh_, point_cloud_topic_, 1024);
+  point_cloud_subscriber_ = new message_filters::Subscriber<sensor_msgs::PointCloud2>(root_nh_, point_cloud_topic_, queue_size_);
   if (tf_)
   {
-    point_cloud_filter_ = new tf::MessageFilter<sensor_msgs::PointCloud2>(*point_cloud_subscriber_, *tf_, map_frame_, 1024);
+    point_cloud_filter_ = new tf::MessageFilter<sensor_msgs::PointCloud2>(*point_cloud_subscriber_, *tf_, map_frame_, queue_size_);
     point_cloud_filter_->registerCallback(boost::bind(&PointCloudOccupancyMapUpdater::cloudMsgCallback, this, _1));
     ROS_INFO("Listening to '%s' using message filter with target frame '%s'", point_cloud_topic_.c_str(), point_cloud_filter_->getTargetFramesString().c_str());
   }
@@ -124,37 +254,77 @@ void PointCloudOccupancyMapUpdater::initialize()
 void PointCloudOccupancyMapUpdater::cloudMsgCallback(const sensor_msgs::PointCloud2::ConstPtr &cloud_msg)
 {
   ROS_DEBUG("Got a point cloud message");
+  recordReceived();
+  
   {
-    boost::lock_guard<boost::mutex> _lock(last_point_cloud_mutex_);
-    last_point_cloud_ = cloud_msg;
+    boost::lock_guard<boost::mutex> _lock(point_clouds_mutex_);
+    
+    /* only every frame_subsample_-th cloud is used */
+    if (frame_subsample_ > 1 && frame_count_++ % frame_subsample_ != 0)
+    {
+      recordDropped();
+      return;
+    }
+    
+    std::size_t max_size = keep_latest_ ? 1 : queue_size_;
+    if (point_clouds_.size() >= max_size)
+    {
+      std::size_t drop = point_clouds_.size() - max_size + 1;
+      point_clouds_.erase(point_clouds_.begin(), point_clouds_.begin() + drop);
+      recordDropped(drop);
+    }
+    point_clouds_.push_back(cloud_msg);
   }
   /* tell the monitor that we are ready to update the map */
   notifyUpdateReady();
 }
 
-void PointCloudOccupancyMapUpdater::process(const OccMapTreePtr &tree)
+bool PointCloudOccupancyMapUpdater::computeUpdate(const OccMapTreeConstPtr &tree, OccMapUpdate &update)
 {
-  ROS_DEBUG("Updating occupancy map with new cloud");
+  ROS_DEBUG("Computing occupancy map update for new cloud");
   sensor_msgs::PointCloud2::ConstPtr cloud;
+  bool more = false;
   {
-    boost::lock_guard<boost::mutex> _lock(last_point_cloud_mutex_);
-    cloud = last_point_cloud_;
-    last_point_cloud_.reset();
+    boost::lock_guard<boost::mutex> _lock(point_clouds_mutex_);
+    ros::Time now = ros::Time::now();
+    while (!point_clouds_.empty() && !cloud)
+    {
+      if (max_age_ <= 0.0 || (now - point_clouds_.front()->header.stamp).toSec() <= max_age_)
+        cloud = point_clouds_.front();
+      else
+      {
+        ROS_DEBUG("Dropping point cloud that is %lf seconds old", (now - point_clouds_.front()->header.stamp).toSec());
+        recordDropped();
+      }
+      point_clouds_.pop_front();
+    }
+    more = !point_clouds_.empty();
   }
   
+  /* one cloud is processed at a time; make sure we are called again for the remaining ones */
+  if (more)
+    notifyUpdateReady();
+  
   if (cloud)
   {
-    processCloud(tree, cloud);
-    ROS_DEBUG("Done updating occupancy map");
+    bool result = processCloud(tree, cloud, update);
+    ROS_DEBUG("Done computing occupancy map update");
+    return result;
   }
   else
+  {
     ROS_DEBUG("No point cloud to process");
+    return false;
+  }
 }
 
-void PointCloudOccupancyMapUpdater::processCloud(const OccMapTreePtr &tree, const sensor_msgs::PointCloud2::ConstPtr &cloud_msg)
+bool PointCloudOccupancyMapUpdater::processCloud(const OccMapTreeConstPtr &tree, const sensor_msgs::PointCloud2::ConstPtr &cloud_msg, OccMapUpdate &update)
 {
   if (!tf_)
-    return;
+  {
+    recordFailed();
+    return false;
+  }
   
   /* get transform for cloud into map frame */
   tf::StampedTransform map_H_sensor;
@@ -165,47 +335,137 @@ void PointCloudOccupancyMapUpdater::processCloud(const OccMapTreePtr &tree, cons
   catch (tf::TransformException& ex)
   {
     ROS_ERROR_STREAM("Transform error of sensor data: " << ex.what() << ", quitting callback");
-    return;
+    recordFailed();
+    return false;
   }
 
-  /* convert cloud message to pcl cloud object */
-  pcl::PointCloud<pcl::PointXYZ> cloud;
-  pcl::fromROSMsg(*cloud_msg, cloud);
+  /* read the points directly from the message */
+  robot_self_filter::PointCloud2View cloud(*cloud_msg);
+  if (!cloud.isValid())
+  {
+    ROS_ERROR("Point cloud on topic '%s' does not contain valid float x, y, z fields", point_cloud_topic_.c_str());
+    recordFailed();
+    return false;
+  }
 
   /* compute sensor origin in map frame */
   tf::Vector3 sensor_origin_tf = map_H_sensor.getOrigin();
   octomap::point3d sensor_origin(sensor_origin_tf.getX(), sensor_origin_tf.getY(), sensor_origin_tf.getZ());
 
   /* mask out points on the robot */
-  std::vector<int> mask;
+  std::vector<bool> self_points;
   if(self_mask_)
-    self_mask_->maskContainment(cloud, mask);
+    self_mask_->maskContainment(*cloud_msg, self_points);
   
   /* do ray tracing to find which cells this point cloud indicates should be free, and which it indicates
-   * should be occupied */
-  octomap::KeySet free_cells, occupied_cells;
-  unsigned int row, col;
-  for(row = 0; row < cloud.height; row += point_subsample_)
+   * should be occupied. the cloud is split in blocks of rows (of columns, for unorganized clouds), one per thread.
+   * blocks start at multiples of the subsampling step, so the same points are used as when tracing serially */
+  std::size_t threads = key_rays_.size();
+  bool by_rows = cloud.getHeight() > 1;
+  unsigned int extent = by_rows ? cloud.getHeight() : cloud.getWidth();
+  unsigned int step = point_subsample_ > 0 ? point_subsample_ : 1;
+  unsigned int block_size = ((extent + step - 1) / step + threads - 1) / threads * step;
+  
+  std::vector<RayTracingBlock> blocks;
+  for (std::size_t t = 0 ; t < threads ; ++t)
+  {
+    unsigned int begin = std::min<unsigned int>(extent, t * block_size);
+    unsigned int end = std::min<unsigned int>(extent, begin + block_size);
+    if (begin >= end)
+      break;
+    RayTracingBlock b;
+    b.row_begin = by_rows ? begin : 0;
+    b.row_end = by_rows ? end : cloud.getHeight();
+    b.col_begin = by_rows ? 0 : begin;
+    b.col_end = by_rows ? cloud.getWidth() : end;
+    b.key_ray = key_rays_[t].get();
+    blocks.push_back(b);
+  }
+  
+  /* an empty cloud is processed, but it changes nothing */
+  if (blocks.empty())
+  {
+    recordProcessed(cloud_msg->header.stamp);
+    return false;
+  }
+  
+  /* the tracer threads trace all the blocks but the last one, which is traced in the calling thread */
+  {
+    boost::mutex::scoped_lock slock(tracers_mutex_);
+    trace_block_ = boost::bind(&PointCloudOccupancyMapUpdater::traceRays, this, boost::cref(tree), boost::cref(cloud), boost::cref(self_points),
+                               boost::cref(map_H_sensor), boost::cref(sensor_origin), _1);
+    tracing_blocks_ = &blocks;
+    pending_tracers_ = key_rays_.size() - 1;
+    tracing_round_++;
+  }
+  tracers_condition_.notify_all();
+  traceRays(tree, cloud, self_points, map_H_sensor, sensor_origin, blocks.back());
   {
-    for(col = 0; col < cloud.width; col += point_subsample_)
+    boost::unique_lock<boost::mutex> ulock(tracers_mutex_);
+    while (pending_tracers_ > 0)
+      tracers_done_condition_.wait(ulock);
+    tracing_blocks_ = NULL;
+    trace_block_.clear();
+  }
+  
+  /* merge the keys found by the different threads */
+  std::vector<octomap::OcTreeKey> &free_keys = blocks[0].free_keys;
+  std::vector<octomap::OcTreeKey> &occupied_keys = blocks[0].occupied_keys;
+  for (std::size_t t = 1 ; t < blocks.size() ; ++t)
+  {
+    free_keys.insert(free_keys.end(), blocks[t].free_keys.begin(), blocks[t].free_keys.end());
+    occupied_keys.insert(occupied_keys.end(), blocks[t].occupied_keys.begin(), blocks[t].occupied_keys.end());
+  }
+  if (blocks.size() > 1)
+  {
+    sortAndRemoveDuplicates(free_keys);
+    sortAndRemoveDuplicates(occupied_keys);
+  }
+  
+  /* mark free cells only if not seen occupied in this cloud */
+  update.free_keys.clear();
+  std::set_difference(free_keys.begin(), free_keys.end(), occupied_keys.begin(), occupied_keys.end(),
+                      std::back_inserter(update.free_keys), OcTreeKeyLess());
+  
+  /* all occupied cells are marked */
+  update.occupied_keys.swap(occupied_keys);
+  recordProcessed(cloud_msg->header.stamp);
+  
+  return !update.empty();
+}
+
+void PointCloudOccupancyMapUpdater::traceRays(const OccMapTreeConstPtr &tree, const robot_self_filter::PointCloud2View &cloud, const std::vector<bool> &self_points,
+                                              const tf::Transform &map_H_sensor, const octomap::point3d &sensor_origin, RayTracingBlock &block) const
+{
+  octomap::KeyRay &key_ray = *block.key_ray;
+  std::vector<octomap::OcTreeKey> &free_keys = block.free_keys;
+  std::vector<octomap::OcTreeKey> &occupied_keys = block.occupied_keys;
+
+  /* rays from neighboring points pass through mostly the same cells, so we periodically remove duplicates to keep memory bounded */
+  static const std::size_t COMPACT_THRESHOLD = 1 << 18;
+  std::size_t compacted_size = 0;
+  
+  unsigned int step = point_subsample_ > 0 ? point_subsample_ : 1;
+  for (unsigned int row = block.row_begin; row < block.row_end; row += step)
+  {
+    for (unsigned int col = block.col_begin; col < block.col_end; col += step)
     {
-      bool self_point = false;
-      if(!mask.empty() && mask[row*cloud.width + col] == robot_self_filter::INSIDE)
-        self_point = true;
+      bool self_point = !self_points.empty() && self_points[(std::size_t)row * cloud.getWidth() + col];
 
-      pcl::PointXYZ p = cloud(col, row);
+      float x, y, z;
+      cloud.getPoint(col, row, x, y, z);
       
       /* check for NaN */
-      if(!((p.x == p.x) && (p.y == p.y) && (p.z == p.z)))
+      if(!((x == x) && (y == y) && (z == z)))
         continue;
       
       /* transform to map frame */
-      tf::Vector3 point_tf = map_H_sensor * tf::Vector3(p.x, p.y, p.z);
+      tf::Vector3 point_tf = map_H_sensor * tf::Vector3(x, y, z);
       octomap::point3d point(point_tf.getX(), point_tf.getY(), point_tf.getZ());
       
       /* free cells along ray */
-      if (tree->computeRayKeys(sensor_origin, point, key_ray_))
-        free_cells.insert(key_ray_.begin(), key_ray_.end());
+      if (tree->computeRayKeys(sensor_origin, point, key_ray))
+        free_keys.insert(free_keys.end(), key_ray.begin(), key_ray.end());
       
       /* occupied cell at ray endpoint if ray is shorter than max range and this point
          isn't on a part of the robot*/
@@ -216,25 +476,19 @@ void PointCloudOccupancyMapUpdater::processCloud(const OccMapTreePtr &tree, cons
         {
           octomap::OcTreeKey key;
           if (tree->coordToKeyChecked(point, key))
-            occupied_cells.insert(key);
+            occupied_keys.push_back(key);
         }
       }
     }
+    
+    if (free_keys.size() > 2 * compacted_size + COMPACT_THRESHOLD)
+    {
+      sortAndRemoveDuplicates(free_keys);
+      compacted_size = free_keys.size();
+    }
   }
-  
-  ROS_DEBUG("Marking free cells in octomap");
-  
-  /* mark free cells only if not seen occupied in this cloud */
-  for (octomap::KeySet::iterator it = free_cells.begin(), end = free_cells.end(); it != end; ++it)
-    /* this check seems unnecessary since we would just overwrite them in the next loop? -jbinney */
-    if (occupied_cells.find(*it) == occupied_cells.end())
-      tree->updateNode(*it, false);
-  
-  ROS_DEBUG("Marking occupied cells in octomap");
-  
-  /* now mark all occupied cells */
-  for (octomap::KeySet::iterator it = occupied_cells.begin(), end = free_cells.end(); it != end; it++)
-    tree->updateNode(*it, true);
+  sortAndRemoveDuplicates(free_keys);
+  sortAndRemoveDuplicates(occupied_keys);
 }
 
 }
@@ -0,0 +1,142 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2012, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+#ifndef ROBOT_SELF_FILTER_POINT_CLOUD2_VIEW_
+#define ROBOT_SELF_FILTER_POINT_CLOUD2_VIEW_
+
+#include <sensor_msgs/PointCloud2.h>
+#include <cstring>
+
+namespace robot_self_filter
+{
+
+/** \brief Read-only access to the x, y, z coordinates of the points of a sensor_msgs::PointCloud2. The coordinates
+    are read directly from the data of the message, so no copy or conversion of the cloud is needed. The message
+    must outlive the view. */
+class PointCloud2View
+{
+public:
+
+  PointCloud2View(const sensor_msgs::PointCloud2 &cloud) :
+    data_(cloud.data.empty() ? NULL : &cloud.data[0]), width_(cloud.width), height_(cloud.height),
+    point_step_(cloud.point_step), row_step_(cloud.row_step), valid_(false)
+  {
+    int found = 0;
+    for (std::size_t i = 0 ; i < cloud.fields.size() ; ++i)
+    {
+      const sensor_msgs::PointField &f = cloud.fields[i];
+      if (f.datatype != sensor_msgs::PointField::FLOAT32 || f.name.size() != 1)
+        continue;
+      if (f.name[0] == 'x')
+      {
+        offset_[0] = f.offset;
+        found |= 1;
+      }
+      else
+        if (f.name[0] == 'y')
+        {
+          offset_[1] = f.offset;
+          found |= 2;
+        }
+        else
+          if (f.name[0] == 'z')
+          {
+            offset_[2] = f.offset;
+            found |= 4;
+          }
+    }
+    valid_ = found == 7 && cloud.data.size() >= (std::size_t)row_step_ * height_ && (std::size_t)point_step_ * width_ <= row_step_;
+    contiguous_ = row_step_ == point_step_ * width_;
+  }
+
+  /** \brief Return true if the cloud has float x, y, z fields and its data is consistent with its dimensions */
+  bool isValid(void) const
+  {
+    return valid_;
+  }
+
+  unsigned int getWidth(void) const
+  {
+    return width_;
+  }
+
+  unsigned int getHeight(void) const
+  {
+    return height_;
+  }
+
+  /** \brief The number of points in the cloud (width * height) */
+  std::size_t size(void) const
+  {
+    return (std::size_t)width_ * height_;
+  }
+
+  /** \brief Get the coordinates of the point at column \e col and row \e row */
+  void getPoint(unsigned int col, unsigned int row, float &x, float &y, float &z) const
+  {
+    read(data_ + (std::size_t)row * row_step_ + (std::size_t)col * point_step_, x, y, z);
+  }
+
+  /** \brief Get the coordinates of the point at \e index (row * width + col) */
+  void getPoint(std::size_t index, float &x, float &y, float &z) const
+  {
+    if (contiguous_)
+      read(data_ + index * point_step_, x, y, z);
+    else
+      getPoint(index % width_, index / width_, x, y, z);
+  }
+
+private:
+
+  void read(const uint8_t *point, float &x, float &y, float &z) const
+  {
+    // the data of the message has no alignment guarantees
+    memcpy(&x, point + offset_[0], sizeof(float));
+    memcpy(&y, point + offset_[1], sizeof(float));
+    memcpy(&z, point + offset_[2], sizeof(float));
+  }
+
+  const uint8_t *data_;
+  uint32_t       width_;
+  uint32_t       height_;
+  uint32_t       point_step_;
+  uint32_t       row_step_;
+  uint32_t       offset_[3];
+  bool           valid_;
+  bool           contiguous_;
+};
+
+}
+
+#endif
@@ -31,9 +31,13 @@
 #define ROBOT_SELF_FILTER_SELF_MASK_
 
 #include <sensor_msgs/PointCloud.h>
+#include <moveit/robot_self_filter/point_cloud2_view.h>
 #include <geometric_shapes/bodies.h>
+#include <moveit/kinematic_state/kinematic_state.h>
 #include <tf/transform_listener.h>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 #include <string>
 #include <vector>
 
@@ -57,6 +61,9 @@ struct LinkInfo
   double scale;
 };
 
+/** \brief A function that returns the state of the robot at a specified time, or an empty pointer if that state is not known */
+typedef boost::function<kinematic_state::KinematicStateConstPtr(const ros::Time&)> KinematicStateFn;
+
 /** \brief Computing a mask for a pointcloud that states which points are inside the robot */
 class SelfMask
 {
@@ -66,6 +73,7 @@ protected:
     SeeLink(void)
     {
       body = unscaledBody = NULL;
+      type = shapes::UNKNOWN_SHAPE;
     }
 
     std::string name;
@@ -73,6 +81,20 @@ protected:
     bodies::Body *unscaledBody;
     Eigen::Affine3d constTransf;
     double volume;
+
+    /** \brief The type of the link's shape. For spheres, boxes and cylinders the containment
+        test is done inline using \e extents and \e inversePose, without calling into \e body */
+    shapes::ShapeType type;
+
+    /** \brief For spheres, the radius; for boxes, the half-lengths along each axis; for cylinders,
+        the radius and the half-length (x and z); all values include scaling and padding */
+    Eigen::Vector3d extents;
+
+    /** \brief Same as \e extents, but for the unscaled body */
+    Eigen::Vector3d unscaledExtents;
+
+    /** \brief The transform from the assumed frame to the frame of the body */
+    Eigen::Affine3d inversePose;
   };
 
   struct SortBodies
@@ -86,14 +108,12 @@ protected:
 public:
 
   /** \brief Construct the filter */
-  SelfMask(tf::Transformer &tf, const std::vector<LinkInfo> &links) : tf_(tf)
-  {
-    configure (links);
-  }
+  SelfMask(tf::Transformer &tf, const std::vector<LinkInfo> &links);
 
   /** \brief Destructor to clean up */
   ~SelfMask(void)
   {
+    stopWorkers ();
     freeMemory ();
   }
 
@@ -102,6 +122,12 @@ public:
          */
   void maskContainment (const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask);
 
+  /** \brief Compute the containment mask for a given pointcloud message, reading the points directly from the message data.
+            Element i of \e inside is true if point i (row * width + col) is inside the robot. If the message does not contain
+            float x, y, z fields, \e inside is left empty.
+         */
+  void maskContainment (const sensor_msgs::PointCloud2& data_in, std::vector<bool> &inside);
+
   /** \brief Compute the intersection mask for a given
             pointcloud. If a mask element can have one of the values
             INSIDE, OUTSIDE or SHADOW. If the value is SHADOW, the
@@ -153,9 +179,25 @@ public:
             performed, assumeFrame() should be called before use */
   int getMaskIntersection (const Eigen::Vector3d &pt, const boost::function<void(const Eigen::Vector3d&)> &intersectionCallback = NULL) const;
 
+  /** \brief Compute the poses of the links from the state of the robot returned by \e state_fn instead of
+      looking up a transform for each link. Only the transform from the model frame of the state to the assumed
+      frame is looked up. If the state is not available, the poses are looked up individually, as usual. */
+  void setKinematicStateFunction (const KinematicStateFn &state_fn);
+
   /** \brief Get the set of link names that have been instantiated for self filtering */
   void getLinkNames (std::vector<std::string> &frames) const;
 
+  /** \brief Set the maximum number of threads used to compute masks. By default, one thread per CPU core is used.
+      The calling thread is one of them; the others are started with the first mask that is large enough to be split
+      and are kept for later masks. Masks computed with an intersection callback are always computed in the calling thread. */
+  void setThreads (unsigned int threads);
+
+  /** \brief Get the maximum number of threads used to compute masks */
+  unsigned int getThreads (void) const
+  {
+    return threads_;
+  }
+
 private:
   /** \brief Free memory. */
   void freeMemory (void);
@@ -166,12 +208,46 @@ private:
   /** \brief Compute bounding spheres for the checked robot links. */
   void computeBoundingSpheres (void);
 
+  /** \brief Set the pose of a link in the assumed frame */
+  void setLinkPose (std::size_t index, const Eigen::Affine3d &transf);
+
+  /** \brief Place the links in the assumed frame using the state returned by \e state_fn_. Return false if the state is not available. */
+  bool assumeFrameFromState (const std::string &frame_id, const ros::Time &stamp);
+
+  /** \brief Place the links in the assumed frame using a transform lookup for each link */
+  void assumeFrameFromTF (const std::string &frame_id, const ros::Time &stamp);
+
   /** \brief Perform the actual mask computation. */
   void maskAuxContainment (const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask);
 
   /** \brief Perform the actual mask computation. */
   void maskAuxIntersection (const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, const boost::function<void(const Eigen::Vector3d&)> &callback);
 
+  /** \brief Compute the containment mask for points [begin, end) */
+  void maskAuxContainmentRange (const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, std::size_t begin, std::size_t end) const;
+
+  /** \brief Compute the containment mask for points [begin, end) */
+  void maskAuxContainmentViewRange (const PointCloud2View& data_in, std::vector<bool> &inside, std::size_t begin, std::size_t end) const;
+
+  /** \brief Compute the intersection mask for points [begin, end) */
+  void maskAuxIntersectionRange (const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, std::size_t begin, std::size_t end,
+                                 const boost::function<void(const Eigen::Vector3d&)> &callback) const;
+
+  /** \brief Split the points of a cloud in ranges processed by different threads and call \e range_fn for each range */
+  void runInParallel (std::size_t np, const boost::function<void(std::size_t, std::size_t)> &range_fn);
+
+  /** \brief Process range \e index of the current round each time a new round is started, until the workers are stopped */
+  void workerThread (std::size_t index, unsigned long round);
+
+  /** \brief Stop and join the worker threads, if they are running */
+  void stopWorkers (void);
+
+  /** \brief Check if a point is inside a link, skipping the virtual call into the body for simple shapes */
+  bool linkContainsPoint (const SeeLink &link, bool scaled, const Eigen::Vector3d &pt) const;
+
+  /** \brief Check if a point is inside the bounding sphere of any link */
+  bool inBoundingSpheres (const Eigen::Vector3d &pt) const;
+
   tf::Transformer                     &tf_;
   ros::NodeHandle                     nh_;
 
@@ -181,6 +257,28 @@ private:
   std::vector<SeeLink>                bodies_;
   std::vector<double>                 bspheresRadius2_;
   std::vector<bodies::BoundingSphere> bspheres_;
+  bodies::BoundingSphere              bound_;         // a sphere that bounds the entire robot
+  double                              boundRadius2_;
+
+  unsigned int                        threads_;
+
+  // threads_ - 1 worker threads that help the calling thread compute masks, started once and reused between masks
+  boost::scoped_ptr<boost::thread_group> workers_;
+  boost::function<void(std::size_t, std::size_t)> work_range_fn_;
+  std::size_t                         work_points_;
+  std::size_t                         work_per_thread_;
+  unsigned long                       work_round_;
+  std::size_t                         pending_workers_;
+  bool                                stop_workers_;
+  boost::mutex                        workers_mutex_;
+  boost::condition_variable           workers_condition_;
+  boost::condition_variable           workers_done_condition_;
+
+  KinematicStateFn                    state_fn_;
+
+  // the frame and time the links were last placed at, so the poses are not recomputed for the same cloud
+  std::string                         assumed_frame_;
+  ros::Time                           assumed_stamp_;
 };
 
 bool createLinksFromParams(XmlRpc::XmlRpcValue &params, std::vector<LinkInfo> &links);
@@ -38,6 +38,15 @@
 #include <algorithm>
 #include <sstream>
 #include <climits>
+#include <cmath>
+#include <boost/thread.hpp>
+
+robot_self_filter::SelfMask::SelfMask(tf::Transformer &tf, const std::vector<LinkInfo> &links) : tf_(tf), min_sensor_dist_(0.0), boundRadius2_(0.0),
+  work_points_(0), work_per_thread_(0), work_round_(0), pending_workers_(0), stop_workers_(false)
+{
+  threads_ = std::max(1u, boost::thread::hardware_concurrency());
+  configure(links);
+}
 
 void robot_self_filter::SelfMask::freeMemory (void)
 {
@@ -114,6 +123,7 @@ bool robot_self_filter::SelfMask::configure(const std::vector<LinkInfo> &links)
 {
   // in case configure was called before, we free the memory
   freeMemory();
+  assumed_frame_.clear();
   sensor_pos_(0) = 0;
   sensor_pos_(1) = 0;
   sensor_pos_(2) = 0;
@@ -180,6 +190,39 @@ bool robot_self_filter::SelfMask::configure(const std::vector<LinkInfo> &links)
       ROS_DEBUG_STREAM("Self see link name " <<  links[i].name << " padding " << links[i].padding);
       sl.volume = sl.body->computeVolume();
       sl.unscaledBody = bodies::createBodyFromShape(shape);
+
+      // keep the dimensions of simple shapes, so containment can be checked without virtual calls
+      sl.type = shape->type;
+      switch (shape->type)
+      {
+      case shapes::SPHERE:
+        {
+          double r = static_cast<const shapes::Sphere*>(shape)->radius;
+          sl.extents = Eigen::Vector3d::Constant(r * links[i].scale + links[i].padding);
+          sl.unscaledExtents = Eigen::Vector3d::Constant(r);
+        }
+        break;
+      case shapes::BOX:
+        {
+          const double *size = static_cast<const shapes::Box*>(shape)->size;
+          for (int k = 0 ; k < 3 ; ++k)
+          {
+            sl.extents[k] = size[k] * links[i].scale / 2.0 + links[i].padding;
+            sl.unscaledExtents[k] = size[k] / 2.0;
+          }
+        }
+        break;
+      case shapes::CYLINDER:
+        {
+          const shapes::Cylinder *cyl = static_cast<const shapes::Cylinder*>(shape);
+          sl.extents = Eigen::Vector3d(cyl->radius * links[i].scale + links[i].padding, 0.0, cyl->length * links[i].scale / 2.0 + links[i].padding);
+          sl.unscaledExtents = Eigen::Vector3d(cyl->radius, 0.0, cyl->length / 2.0);
+        }
+        break;
+      default:
+        sl.type = shapes::UNKNOWN_SHAPE;
+        break;
+      }
       bodies_.push_back(sl);
 
       ROS_DEBUG("Added link: %s", sl.name.c_str());
@@ -219,6 +262,13 @@ void robot_self_filter::SelfMask::getLinkNames(std::vector<std::string> &frames)
     frames.push_back(bodies_[i].name);
 }
 
+void robot_self_filter::SelfMask::setThreads(unsigned int threads)
+{
+  // the workers are started again, with the new count, by the next mask that needs them
+  stopWorkers();
+  threads_ = std::max(1u, threads);
+}
+
 void robot_self_filter::SelfMask::maskContainment(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask)
 {
   mask.resize(data_in.points.size());
@@ -231,6 +281,24 @@ void robot_self_filter::SelfMask::maskContainment(const pcl::PointCloud<pcl::Poi
   }
 }
 
+void robot_self_filter::SelfMask::maskContainment(const sensor_msgs::PointCloud2& data_in, std::vector<bool> &inside)
+{
+  PointCloud2View view(data_in);
+  if (!view.isValid())
+  {
+    ROS_ERROR("Point cloud in frame '%s' does not contain valid float x, y, z fields", data_in.header.frame_id.c_str());
+    inside.clear();
+    return;
+  }
+  
+  inside.assign(view.size(), false);
+  if (!bodies_.empty())
+  {
+    assumeFrame(data_in.header.frame_id, data_in.header.stamp);
+    runInParallel(view.size(), boost::bind(&SelfMask::maskAuxContainmentViewRange, this, boost::cref(view), boost::ref(inside), _1, _2));
+  }
+}
+
 void robot_self_filter::SelfMask::maskIntersection(const pcl::PointCloud<pcl::PointXYZ>& data_in, const std::string &sensor_frame, const double min_sensor_dist,
                                                    std::vector<int> &mask, const boost::function<void(const Eigen::Vector3d&)> &callback)
 {
@@ -269,6 +337,10 @@ void robot_self_filter::SelfMask::computeBoundingSpheres(void)
     bodies_[i].body->computeBoundingSphere(bspheres_[i]);
     bspheresRadius2_[i] = bspheres_[i].radius * bspheres_[i].radius;
   }
+  
+  // compute a sphere that bounds the entire robot
+  bodies::mergeBoundingSpheres(bspheres_, bound_);
+  boundRadius2_ = bound_.radius * bound_.radius;
 }
 
 void robot_self_filter::SelfMask::assumeFrame(const std::string& frame_id, const ros::Time& stamp, const Eigen::Vector3d &sensor_pos, double min_sensor_dist)
@@ -309,7 +381,75 @@ void robot_self_filter::SelfMask::assumeFrame(const std::string& frame_id, const
   min_sensor_dist_ = min_sensor_dist;
 }
 
+void robot_self_filter::SelfMask::setKinematicStateFunction(const KinematicStateFn &state_fn)
+{
+  state_fn_ = state_fn;
+  assumed_frame_.clear();
+}
+
 void robot_self_filter::SelfMask::assumeFrame(const std::string &frame_id, const ros::Time &stamp)
+{
+  // the links are already placed for this frame and time (a zero stamp means the latest data, so it is never cached)
+  if (!stamp.isZero() && stamp == assumed_stamp_ && frame_id == assumed_frame_)
+    return;
+  
+  if (!state_fn_ || !assumeFrameFromState(frame_id, stamp))
+    assumeFrameFromTF(frame_id, stamp);
+  
+  computeBoundingSpheres();
+  assumed_frame_ = frame_id;
+  assumed_stamp_ = stamp;
+}
+
+void robot_self_filter::SelfMask::setLinkPose(std::size_t index, const Eigen::Affine3d &transf)
+{
+  // set it for each body; we also include the offset specified in URDF
+  Eigen::Affine3d pose = transf * bodies_[index].constTransf;
+  bodies_[index].body->setPose(pose);
+  bodies_[index].unscaledBody->setPose(pose);
+  bodies_[index].inversePose = pose.inverse(Eigen::Isometry);
+}
+
+bool robot_self_filter::SelfMask::assumeFrameFromState(const std::string &frame_id, const ros::Time &stamp)
+{
+  kinematic_state::KinematicStateConstPtr state = state_fn_(stamp);
+  if (!state)
+    return false;
+  
+  // a single transform brings all the links from the model frame to the assumed frame
+  const std::string &model_frame = state->getKinematicModel()->getModelFrame();
+  tf::StampedTransform tf_transf;
+  try
+  {
+    std::string err;
+    if (!tf_.waitForTransform(frame_id, model_frame, stamp, ros::Duration(.1), ros::Duration(.01), &err))
+      ROS_ERROR("WaitForTransform timed out from %s to %s after 100ms.  Error string: %s", model_frame.c_str(), frame_id.c_str(), err.c_str());
+    tf_.lookupTransform(frame_id, model_frame, stamp, tf_transf);
+  }
+  catch(tf::TransformException& ex)
+  {
+    ROS_ERROR("Unable to lookup transform from %s to %s. Exception: %s", model_frame.c_str(), frame_id.c_str(), ex.what());
+    return false;
+  }
+  Eigen::Affine3d frame_H_model;
+  tf::transformTFToEigen(tf_transf, frame_H_model);
+  
+  const std::size_t bs = bodies_.size();
+  for (std::size_t i = 0 ; i < bs ; ++i)
+  {
+    const kinematic_state::LinkState *ls = state->getLinkState(bodies_[i].name);
+    if (!ls)
+    {
+      ROS_ERROR("Link '%s' is not known to the kinematic model. Using TF for self filtering.", bodies_[i].name.c_str());
+      state_fn_.clear();
+      return false;
+    }
+    setLinkPose(i, frame_H_model * ls->getGlobalLinkTransform());
+  }
+  return true;
+}
+
+void robot_self_filter::SelfMask::assumeFrameFromTF(const std::string &frame_id, const ros::Time &stamp)
 {
   const unsigned int bs = bodies_.size();
   
@@ -335,105 +475,220 @@ void robot_self_filter::SelfMask::assumeFrame(const std::string &frame_id, const
 
     Eigen::Affine3d transf;
     tf::transformTFToEigen(tf_transf, transf);
+    setLinkPose(i, transf);
+  }
+}
 
-    //ROS_INFO_STREAM("Transform from " << bodies_[i].name << " to " << frame_id << " is:");
-    //ROS_INFO_STREAM(":  " << transf.matrix());
+namespace robot_self_filter
+{
+namespace
+{
+// below this many points per thread, the cost of handing ranges to other threads is not worth it
+static const std::size_t MIN_POINTS_PER_THREAD = 2048;
+}
+}
+
+void robot_self_filter::SelfMask::runInParallel(std::size_t np, const boost::function<void(std::size_t, std::size_t)> &range_fn)
+{
+  std::size_t nt = std::min<std::size_t>(threads_, np / MIN_POINTS_PER_THREAD);
+  if (nt <= 1)
+  {
+    range_fn(0, np);
+    return;
+  }
+  
+  // ranges start at multiples of 64 points, so threads never write to the same word of a bit mask
+  std::size_t per_thread = ((np + nt - 1) / nt + 63) & ~(std::size_t)63;
+  {
+    boost::mutex::scoped_lock slock(workers_mutex_);
+    if (!workers_)
+    {
+      workers_.reset(new boost::thread_group());
+      for (std::size_t i = 0 ; i + 1 < threads_ ; ++i)
+        workers_->create_thread(boost::bind(&SelfMask::workerThread, this, i, work_round_));
+    }
+    work_range_fn_ = range_fn;
+    work_points_ = np;
+    work_per_thread_ = per_thread;
+    pending_workers_ = threads_ - 1;
+    work_round_++;
+  }
+  workers_condition_.notify_all();
+  // the last range is processed in the calling thread
+  range_fn(((np - 1) / per_thread) * per_thread, np);
+  {
+    boost::unique_lock<boost::mutex> ulock(workers_mutex_);
+    while (pending_workers_ > 0)
+      workers_done_condition_.wait(ulock);
+    work_range_fn_.clear();
+  }
+}
 
-    // set it for each body; we also include the offset specified in URDF
-    bodies_[i].body->setPose(transf * bodies_[i].constTransf);
-    bodies_[i].unscaledBody->setPose(transf * bodies_[i].constTransf);
+void robot_self_filter::SelfMask::workerThread(std::size_t index, unsigned long round)
+{
+  boost::unique_lock<boost::mutex> ulock(workers_mutex_);
+  while (true)
+  {
+    while (!stop_workers_ && work_round_ == round)
+      workers_condition_.wait(ulock);
+    if (stop_workers_)
+      return;
+    round = work_round_;
+    
+    // rounds with fewer ranges than threads leave some of the workers idle
+    std::size_t begin = index * work_per_thread_;
+    if (begin + work_per_thread_ < work_points_)
+    {
+      ulock.unlock();
+      work_range_fn_(begin, begin + work_per_thread_);
+      ulock.lock();
+    }
+    if (--pending_workers_ == 0)
+      workers_done_condition_.notify_all();
+  }
+}
 
-    //Eigen::Affine3d verify_trans = bodies_[i].body->getPose();
-    //ROS_INFO_STREAM("Translation from " << bodies_[i].name << " to " << frame_id << " is " << verify_trans.translation());
+void robot_self_filter::SelfMask::stopWorkers(void)
+{
+  {
+    boost::mutex::scoped_lock slock(workers_mutex_);
+    if (!workers_)
+      return;
+    stop_workers_ = true;
   }
+  workers_condition_.notify_all();
+  workers_->join_all();
   
-  computeBoundingSpheres();
+  boost::mutex::scoped_lock slock(workers_mutex_);
+  workers_.reset();
+  stop_workers_ = false;
 }
 
-void robot_self_filter::SelfMask::maskAuxContainment(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask)
+bool robot_self_filter::SelfMask::linkContainsPoint(const SeeLink &link, bool scaled, const Eigen::Vector3d &pt) const
 {
-  const unsigned int bs = bodies_.size();
-  const unsigned int np = data_in.points.size();
+  const Eigen::Vector3d &e = scaled ? link.extents : link.unscaledExtents;
+  switch (link.type)
+  {
+  case shapes::SPHERE:
+    return (link.inversePose * pt).squaredNorm() < e.x() * e.x();
+  case shapes::BOX:
+    {
+      Eigen::Vector3d p = link.inversePose * pt;
+      return fabs(p.x()) <= e.x() && fabs(p.y()) <= e.y() && fabs(p.z()) <= e.z();
+    }
+  case shapes::CYLINDER:
+    {
+      Eigen::Vector3d p = link.inversePose * pt;
+      return fabs(p.z()) <= e.z() && p.x() * p.x() + p.y() * p.y() <= e.x() * e.x();
+    }
+  default:
+    return scaled ? link.body->containsPoint(pt) : link.unscaledBody->containsPoint(pt);
+  }
+}
 
-  // compute a sphere that bounds the entire robot
-  bodies::BoundingSphere bound;
-  bodies::mergeBoundingSpheres(bspheres_, bound);
-  double radiusSquared = bound.radius * bound.radius;
+bool robot_self_filter::SelfMask::inBoundingSpheres(const Eigen::Vector3d &pt) const
+{
+  if ((bound_.center - pt).squaredNorm() >= boundRadius2_)
+    return false;
+  const std::size_t bs = bspheres_.size();
+  for (std::size_t j = 0 ; j < bs ; ++j)
+    if ((bspheres_[j].center - pt).squaredNorm() < bspheresRadius2_[j])
+      return true;
+  return false;
+}
 
+void robot_self_filter::SelfMask::maskAuxContainment(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask)
+{
+  runInParallel(data_in.points.size(), boost::bind(&SelfMask::maskAuxContainmentRange, this, boost::cref(data_in), boost::ref(mask), _1, _2));
+}
+
+void robot_self_filter::SelfMask::maskAuxContainmentRange(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask,
+                                                          std::size_t begin, std::size_t end) const
+{
+  const std::size_t bs = bodies_.size();
+  
   // we now decide which points we keep
-  //#pragma omp parallel for schedule(dynamic)
-  for (int i = 0 ; i < (int)np ; ++i)
+  for (std::size_t i = begin ; i < end ; ++i)
   {
-    //ROS_INFO("Point %d: %6.2f %6.2f %6.2f", i, data_in.points[i].x, data_in.points[i].y, data_in.points[i].z);
     Eigen::Vector3d pt = Eigen::Vector3d(data_in.points[i].x, data_in.points[i].y, data_in.points[i].z);
     int out = OUTSIDE;
-    if ((bound.center - pt).squaredNorm() < radiusSquared)
-    {
-      //ROS_INFO("Point in bounding sphere for robot");
-      for (unsigned int j = 0 ; out == OUTSIDE && j < bs ; ++j)
-      {
-        //ROS_INFO("Body %d  of type %d has volume %f", j, bodies_[j].body->getType(), bodies_[j].body->computeVolume());
-        if (bodies_[j].body->containsPoint(pt))
-        {
-          ROS_DEBUG("Point %d in link %s", i, bodies_[j].name.c_str());
+    if (inBoundingSpheres(pt))
+      for (std::size_t j = 0 ; out == OUTSIDE && j < bs ; ++j)
+        if ((bspheres_[j].center - pt).squaredNorm() < bspheresRadius2_[j] && linkContainsPoint(bodies_[j], true, pt))
           out = INSIDE;
-        }
-      }
-    }
-
     mask[i] = out;
   }
 }
 
-void robot_self_filter::SelfMask::maskAuxIntersection(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, const boost::function<void(const Eigen::Vector3d&)> &callback)
+void robot_self_filter::SelfMask::maskAuxContainmentViewRange(const PointCloud2View& data_in, std::vector<bool> &inside,
+                                                              std::size_t begin, std::size_t end) const
 {
-  const unsigned int bs = bodies_.size();
-  const unsigned int np = data_in.points.size();
+  const std::size_t bs = bodies_.size();
+  float x, y, z;
   
-  // compute a sphere that bounds the entire robot
-  bodies::BoundingSphere bound;
-  bodies::mergeBoundingSpheres(bspheres_, bound);
-  double radiusSquared = bound.radius * bound.radius;
+  for (std::size_t i = begin ; i < end ; ++i)
+  {
+    data_in.getPoint(i, x, y, z);
+    Eigen::Vector3d pt(x, y, z);
+    if (inBoundingSpheres(pt))
+      for (std::size_t j = 0 ; j < bs ; ++j)
+        if ((bspheres_[j].center - pt).squaredNorm() < bspheresRadius2_[j] && linkContainsPoint(bodies_[j], true, pt))
+        {
+          inside[i] = true;
+          break;
+        }
+  }
+}
 
-  //std::cout << "Testing " << np << " points\n";
+void robot_self_filter::SelfMask::maskAuxIntersection(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, const boost::function<void(const Eigen::Vector3d&)> &callback)
+{
+  // the callback is not required to be thread safe, so we only parallelize when there is none
+  if (callback)
+    maskAuxIntersectionRange(data_in, mask, 0, data_in.points.size(), callback);
+  else
+    runInParallel(data_in.points.size(), boost::bind(&SelfMask::maskAuxIntersectionRange, this, boost::cref(data_in), boost::ref(mask), _1, _2, callback));
+}
 
+void robot_self_filter::SelfMask::maskAuxIntersectionRange(const pcl::PointCloud<pcl::PointXYZ>& data_in, std::vector<int> &mask, std::size_t begin, std::size_t end,
+                                                           const boost::function<void(const Eigen::Vector3d&)> &callback) const
+{
+  const std::size_t bs = bodies_.size();
+  EigenSTL::vector_Vector3d intersections;
+  
   // we now decide which points we keep
-  //#pragma omp parallel for schedule(dynamic)
-  for (int i = 0 ; i < (int)np ; ++i)
+  for (std::size_t i = begin ; i < end ; ++i)
   {
-    bool print = false;
-    //if(i%100 == 0) print = true;
     Eigen::Vector3d pt = Eigen::Vector3d(data_in.points[i].x, data_in.points[i].y, data_in.points[i].z);
     int out = OUTSIDE;
-
+    bool in_bound = inBoundingSpheres(pt);
+    
     // we first check is the point is in the unscaled body.
     // if it is, the point is definitely inside
-    if ((bound.center - pt).squaredNorm() < radiusSquared)
-      for (unsigned int j = 0 ; out == OUTSIDE && j < bs ; ++j)
-        if (bodies_[j].unscaledBody->containsPoint(pt))
-        {
-          if(print)
-            std::cout << "Point " << i << " in unscaled body part " << bodies_[j].name << std::endl;
+    if (in_bound)
+      for (std::size_t j = 0 ; out == OUTSIDE && j < bs ; ++j)
+        if ((bspheres_[j].center - pt).squaredNorm() < bspheresRadius2_[j] && linkContainsPoint(bodies_[j], false, pt))
           out = INSIDE;
-        }
-
+    
     // if the point is not inside the unscaled body,
     if (out == OUTSIDE)
     {
       // we check it the point is a shadow point
       Eigen::Vector3d dir(sensor_pos_ - pt);
-      double  lng = dir.norm();
+      double lng = dir.norm();
       if (lng < min_sensor_dist_)
-      {
         out = INSIDE;
-        //std::cout << "Point " << i << " less than min sensor distance away\n";
-      }
       else
       {
         dir /= lng;
-        EigenSTL::vector_Vector3d intersections;
-        for (unsigned int j = 0 ; out == OUTSIDE && j < bs ; ++j)
+        for (std::size_t j = 0 ; out == OUTSIDE && j < bs ; ++j)
         {
+          // skip bodies whose bounding sphere the ray from the point to the sensor does not touch
+          Eigen::Vector3d to_center = bspheres_[j].center - pt;
+          double t = std::max(0.0, std::min(lng, to_center.dot(dir)));
+          if ((to_center - t * dir).squaredNorm() >= bspheresRadius2_[j])
+            continue;
+          
+          intersections.clear();
           if (bodies_[j].body->intersectsRay(pt, dir, &intersections, 1))
           {
             if (dir.dot(sensor_pos_ - intersections[0]) >= 0.0)
@@ -441,19 +696,15 @@ void robot_self_filter::SelfMask::maskAuxIntersection(const pcl::PointCloud<pcl:
               if (callback)
                 callback(intersections[0]);
               out = SHADOW;
-              if(print) std::cout << "Point " << i << " shadowed by body part " << bodies_[j].name << std::endl;
             }
           }
         }
+        
         // if it is not a shadow point, we check if it is inside the scaled body
-        if (out == OUTSIDE && (bound.center - pt).squaredNorm() < radiusSquared)
-          for (unsigned int j = 0 ; out == OUTSIDE && j < bs ; ++j)
-            if (bodies_[j].body->containsPoint(pt))
-            {
-              if(print)
-                std::cout << "Point " << i << " in scaled body part " << bodies_[j].name << std::endl;
+        if (out == OUTSIDE && in_bound)
+          for (std::size_t j = 0 ; out == OUTSIDE && j < bs ; ++j)
+            if ((bspheres_[j].center - pt).squaredNorm() < bspheresRadius2_[j] && linkContainsPoint(bodies_[j], true, pt))
               out = INSIDE;
-            }
       }
     }
     mask[i] = out;
@@ -465,7 +716,7 @@ int robot_self_filter::SelfMask::getMaskContainment(const Eigen::Vector3d &pt) c
   const unsigned int bs = bodies_.size();
   int out = OUTSIDE;
   for (unsigned int j = 0 ; out == OUTSIDE && j < bs ; ++j)
-    if (bodies_[j].body->containsPoint(pt))
+    if (linkContainsPoint(bodies_[j], true, pt))
       out = INSIDE;
   return out;
 }
@@ -44,6 +44,8 @@
 
 // System
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
 
 // ROS msgs
 #include <geometry_msgs/PoseStamped.h>
@@ -57,6 +59,7 @@
 #include <kdl/chainiksolvervel_pinv.hpp>
 #include <kdl/chainiksolverpos_nr_jl.hpp>
 #include <kdl/chainfksolverpos_recursive.hpp>
+#include <kdl/tree.hpp>
 
 // MoveIt!
 #include <moveit/kinematics_base/kinematics_base.h>
@@ -66,6 +69,23 @@
 
 namespace kdl_kinematics_plugin                        
 {
+
+/**
+ * @brief The parsed robot description, shared by all the plugin instances that use the same robot description
+ */
+struct RobotModelData
+{
+  boost::shared_ptr<urdf::ModelInterface> urdf_model;
+  boost::shared_ptr<srdf::Model> srdf_model;
+  kinematic_model::KinematicModelConstPtr kinematic_model;
+  KDL::Tree kdl_tree;
+  
+  /** The chains extracted from the tree so far, indexed by (base, tip); guarded by the lock of the model cache */
+  mutable std::map<std::pair<std::string, std::string>, boost::shared_ptr<const KDL::Chain> > kdl_chains;
+};
+
+typedef boost::shared_ptr<const RobotModelData> RobotModelDataConstPtr;
+
 /**
  * @class Specific implementation of kinematics using KDL. This version can be used with any robot.
  */
@@ -114,6 +134,34 @@ namespace kdl_kinematics_plugin
     virtual bool getPositionFK(const std::vector<std::string> &link_names,
                                const std::vector<double> &joint_angles, 
                                std::vector<geometry_msgs::Pose> &poses) const;
+
+    /**
+     * @brief Compute the poses of the links in \e link_names for a batch of joint configurations. The pose of link l
+     * for configuration c is stored in poses[c * link_names.size() + l]. Link names are resolved once for the whole
+     * batch and each configuration is evaluated with a single sweep along the chain.
+     * @return False if a link is not part of the chain or a configuration does not have the size of the group
+     */
+    bool getPositionFKBatch(const std::vector<std::string> &link_names,
+                            const std::vector<std::vector<double> > &joint_configurations,
+                            EigenSTL::vector_Affine3d &poses) const;
+
+    /**
+     * @brief Search for IK solutions for a batch of poses. The queries are distributed over \e threads threads that
+     * share this solver instance.
+     * @param ik_poses The desired poses of the tip link
+     * @param ik_seed_states Either one seed used for all the poses, or one seed for each pose
+     * @param timeout The amount of time (in seconds) available to the solver for each pose
+     * @param solutions The solution for each pose (empty if no solution was found)
+     * @param error_codes The error code for each pose
+     * @param threads The number of threads to use; if 0, the number of available cores
+     * @return The number of poses for which a solution was found
+     */
+    std::size_t searchPositionIKBatch(const std::vector<geometry_msgs::Pose> &ik_poses,
+                                      const std::vector<std::vector<double> > &ik_seed_states,
+                                      double timeout,
+                                      std::vector<std::vector<double> > &solutions,
+                                      std::vector<moveit_msgs::MoveItErrorCodes> &error_codes,
+                                      unsigned int threads = 0) const;
     
     virtual bool initialize(const std::string &group_name,
                             const std::string &base_name,
@@ -160,14 +208,71 @@ namespace kdl_kinematics_plugin
     bool timedOut(const ros::WallTime &start_time, double duration) const;
     
     
+    /**
+     * @brief The data a call to the solver modifies. The KDL solvers keep internal buffers and the kinematic states are
+     * used for sampling, so concurrent calls each need their own workspace.
+     */
+    struct Workspace
+    {
+      KDL::JntArray jnt_seed_state, jnt_pos_in, jnt_pos_out;
+
+      boost::shared_ptr<KDL::ChainFkSolverPos_recursive> fk_solver; /** KDL FK solver */
+
+      boost::shared_ptr<KDL::ChainIkSolverVel_pinv> ik_solver_vel; /** KDL IK velocity solver */
+
+      boost::shared_ptr<KDL::ChainIkSolverPos_NR_JL> ik_solver_pos; /** KDL IK position solver */
+
+      kinematic_state::KinematicStatePtr kinematic_state, kinematic_state_2;
+
+      std::vector<KDL::Frame> chain_frames; /** The pose at the end of each prefix of the chain */
+    };
+
+    typedef boost::shared_ptr<Workspace> WorkspacePtr;
+
+    /**
+     * @brief Holds a workspace taken from the pool of the plugin for as long as it is in scope
+     */
+    class WorkspaceLease
+    {
+    public:
+      WorkspaceLease(const KDLKinematicsPlugin *owner) : owner_(owner), workspace_(owner->acquireWorkspace())
+      {
+      }
+
+      ~WorkspaceLease()
+      {
+        owner_->releaseWorkspace(workspace_);
+      }
+
+      Workspace& operator*() const
+      {
+        return *workspace_;
+      }
+
+    private:
+      const KDLKinematicsPlugin *owner_;
+      WorkspacePtr workspace_;
+    };
+
+    friend class WorkspaceLease;
+
+    WorkspacePtr allocateWorkspace() const;
+
+    /** @brief Take a workspace from the pool, allocating a new one if all are in use */
+    WorkspacePtr acquireWorkspace() const;
+
+    void releaseWorkspace(const WorkspacePtr &workspace) const;
+
     /** @brief Check whether the solution lies within the consistency limit of the seed state
+     *  @param workspace The workspace of the calling thread
      *  @param seed_state Seed state
      *  @param redundancy Index of the redundant joint within the chain
      *  @param consistency_limit The returned state for redundant joint should be in the range [seed_state(redundancy_limit)-consistency_limit,seed_state(redundancy_limit)+consistency_limit]
      *  @param solution solution configuration
      *  @return true if check succeeds
      */
-    bool checkConsistency(const KDL::JntArray& seed_state,
+    bool checkConsistency(Workspace &workspace,
+                          const KDL::JntArray& seed_state,
                           const std::vector<double> &consistency_limit,
                           const KDL::JntArray& solution) const;
 
@@ -175,15 +280,25 @@ namespace kdl_kinematics_plugin
 
     int getKDLSegmentIndex(const std::string &name) const;
 
-    void getRandomConfiguration(KDL::JntArray &jnt_array) const;
+    /** @brief Compute the poses at the end of the first \e segment_count segments of the chain for configuration \e q
+     *  in a single sweep; the pose after k segments is stored in workspace.chain_frames[k] */
+    void computeChainFrames(Workspace &workspace, const KDL::JntArray &q, unsigned int segment_count) const;
+
+    struct IKBatch;
+
+    void searchPositionIKBatchWorker(IKBatch *batch) const;
+
+    void getRandomConfiguration(Workspace &workspace, KDL::JntArray &jnt_array) const;
 
     /** @brief Get a random configuration within joint limits close to the seed state
+     *  @param workspace The workspace of the calling thread
      *  @param seed_state Seed state
      *  @param redundancy Index of the redundant joint within the chain
      *  @param consistency_limit The returned state will contain a value for the redundant joint in the range [seed_state(redundancy_limit)-consistency_limit,seed_state(redundancy_limit)+consistency_limit]
      *  @param jnt_array Returned random configuration
      */
-    void getRandomConfiguration(const KDL::JntArray& seed_state,
+    void getRandomConfiguration(Workspace &workspace,
+                                const KDL::JntArray& seed_state,
                                 const std::vector<double> &consistency_limits,
                                 KDL::JntArray &jnt_array) const;
     
@@ -193,29 +308,23 @@ namespace kdl_kinematics_plugin
 
     moveit_msgs::KinematicSolverInfo fk_chain_info_; /** Store information for the forward kinematics solver */
 
-    KDL::Chain kdl_chain_; 
+    RobotModelDataConstPtr robot_model_data_; /** The parsed robot description, shared with other instances */
 
-    boost::shared_ptr<KDL::ChainIkSolverVel_pinv> ik_solver_vel_; /** KDL IK velocity solver */
+    boost::shared_ptr<const KDL::Chain> kdl_chain_; /** The chain of the group, shared with other instances */
 
-    boost::shared_ptr<KDL::ChainFkSolverPos_recursive> fk_solver_;/** KDL FK solver */
+    std::map<std::string, int> segment_index_; /** The index getKDLSegmentIndex() returns for each segment name */
 
-    boost::shared_ptr<KDL::ChainIkSolverPos_NR_JL> ik_solver_pos_;/** KDL IK position solver */ 
-    
     unsigned int dimension_; /** Dimension of the group */
 
     KDL::JntArray joint_min_, joint_max_; /** Joint limits */
 
-    robot_model_loader::RobotModelLoader robot_model_loader_; /** Used to load the robot model */
-
-    mutable KDL::JntArray jnt_seed_state_,jnt_pos_in_,jnt_pos_out_;/** Pre-allocated for the number of joints (hence mutable) */
-
-    mutable random_numbers::RandomNumberGenerator random_number_generator_;
+    int max_solver_iterations_; /** Parameters of the KDL IK position solver */
 
-    kinematic_model::KinematicModelPtr kinematic_model_;
+    double epsilon_;
 
-    kinematic_state::KinematicStatePtr kinematic_state_, kinematic_state_2_;
+    mutable std::vector<WorkspacePtr> free_workspaces_; /** Workspaces not in use by any call (hence mutable) */
 
-    //    kinematic_state::JointStateGroup* joint_state_group_, joint_state_group_2_;
+    mutable boost::mutex workspaces_lock_; /** Protects free_workspaces_ */
     
   };
 }
@@ -46,7 +46,12 @@
 #include <urdf_model/model.h>
 #include <srdfdom/model.h>
 
+#include <boost/thread.hpp>
+#include <boost/weak_ptr.hpp>
+#include <algorithm>
+
 static const double MAX_TIMEOUT_KDL_PLUGIN = 5.0;
+static const std::string ROBOT_DESCRIPTION = "robot_description";
  
 //register KDLKinematics as a KinematicsBase implementation
 CLASS_LOADER_REGISTER_CLASS(kdl_kinematics_plugin::KDLKinematicsPlugin, kinematics::KinematicsBase)
@@ -54,19 +59,109 @@ CLASS_LOADER_REGISTER_CLASS(kdl_kinematics_plugin::KDLKinematicsPlugin, kinemati
 namespace kdl_kinematics_plugin
 {
 
+namespace
+{
+
+// parsed robot descriptions, indexed by the name of the parameter they were loaded from; a description is parsed again
+// only once all the plugin instances that use it are destroyed
+boost::mutex robot_model_data_lock;
+std::map<std::string, boost::weak_ptr<const RobotModelData> > robot_model_data_cache;
+
+RobotModelDataConstPtr getRobotModelData(const std::string &robot_description)
+{
+  // the lock is held while parsing, so plugins initialized in parallel parse the description only once
+  boost::mutex::scoped_lock slock(robot_model_data_lock);
+  RobotModelDataConstPtr data = robot_model_data_cache[robot_description].lock();
+  if (data)
+    return data;
+  
+  robot_model_loader::RobotModelLoader robot_model_loader(robot_description);
+  if (!robot_model_loader.getURDF() || !robot_model_loader.getSRDF())
+  {
+    ROS_ERROR("Unable to load the robot description from '%s'", robot_description.c_str());
+    return data;
+  }
+  
+  boost::shared_ptr<RobotModelData> new_data(new RobotModelData());
+  new_data->urdf_model = robot_model_loader.getURDF();
+  new_data->srdf_model = robot_model_loader.getSRDF();
+  new_data->kinematic_model.reset(new kinematic_model::KinematicModel(new_data->urdf_model, new_data->srdf_model));
+  if (!kdl_parser::treeFromUrdfModel(*new_data->urdf_model, new_data->kdl_tree)) 
+  {
+    ROS_ERROR("Could not initialize tree object");
+    return data;
+  }
+  robot_model_data_cache[robot_description] = new_data;
+  return new_data;
+}
+
+boost::shared_ptr<const KDL::Chain> getChain(const RobotModelData &data, const std::string &base_frame, const std::string &tip_frame)
+{
+  boost::mutex::scoped_lock slock(robot_model_data_lock);
+  boost::shared_ptr<const KDL::Chain> &chain = data.kdl_chains[std::make_pair(base_frame, tip_frame)];
+  if (!chain)
+  {
+    boost::shared_ptr<KDL::Chain> new_chain(new KDL::Chain());
+    if (!data.kdl_tree.getChain(base_frame, tip_frame, *new_chain)) 
+      return chain;
+    chain = new_chain;
+  }
+  return chain;
+}
+
+}
+
 KDLKinematicsPlugin::KDLKinematicsPlugin():active_(false){}
 
-void KDLKinematicsPlugin::getRandomConfiguration(KDL::JntArray &jnt_array) const
+KDLKinematicsPlugin::WorkspacePtr KDLKinematicsPlugin::allocateWorkspace() const
+{
+  WorkspacePtr workspace(new Workspace());
+  workspace->jnt_seed_state.resize(dimension_);
+  workspace->jnt_pos_in.resize(dimension_);
+  workspace->jnt_pos_out.resize(dimension_);
+  workspace->fk_solver.reset(new KDL::ChainFkSolverPos_recursive(*kdl_chain_));
+  workspace->ik_solver_vel.reset(new KDL::ChainIkSolverVel_pinv(*kdl_chain_));
+  workspace->ik_solver_pos.reset(new KDL::ChainIkSolverPos_NR_JL(*kdl_chain_, joint_min_, joint_max_, *workspace->fk_solver, *workspace->ik_solver_vel,
+                                                                 max_solver_iterations_, epsilon_));
+  workspace->kinematic_state.reset(new kinematic_state::KinematicState(robot_model_data_->kinematic_model));
+  workspace->kinematic_state_2.reset(new kinematic_state::KinematicState(robot_model_data_->kinematic_model));
+  workspace->chain_frames.resize(kdl_chain_->getNrOfSegments() + 1);
+  return workspace;
+}
+
+KDLKinematicsPlugin::WorkspacePtr KDLKinematicsPlugin::acquireWorkspace() const
+{
+  {
+    boost::mutex::scoped_lock slock(workspaces_lock_);
+    if (!free_workspaces_.empty())
+    {
+      WorkspacePtr workspace = free_workspaces_.back();
+      free_workspaces_.pop_back();
+      return workspace;
+    }
+  }
+  // all workspaces are used by concurrent calls
+  return allocateWorkspace();
+}
+
+void KDLKinematicsPlugin::releaseWorkspace(const WorkspacePtr &workspace) const
+{
+  boost::mutex::scoped_lock slock(workspaces_lock_);
+  free_workspaces_.push_back(workspace);
+}
+
+void KDLKinematicsPlugin::getRandomConfiguration(Workspace &workspace, KDL::JntArray &jnt_array) const
 {
   std::vector<double> jnt_array_vector(dimension_,0.0);  
-  kinematic_state::JointStateGroup*  joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
+  kinematic_state::JointStateGroup*  joint_state_group = workspace.kinematic_state->getJointStateGroup(getGroupName());
   joint_state_group->setToRandomValues();  
   joint_state_group->getVariableValues(jnt_array_vector);
   for(std::size_t i=0; i < dimension_; ++i)
     jnt_array(i) = jnt_array_vector[i];    
 }
 
-void KDLKinematicsPlugin::getRandomConfiguration(const KDL::JntArray &seed_state,
+void KDLKinematicsPlugin::getRandomConfiguration(Workspace &workspace,
+                                                 const KDL::JntArray &seed_state,
                                                  const std::vector<double> &consistency_limits,
                                                  KDL::JntArray &jnt_array) const
 {
@@ -75,7 +170,7 @@ void KDLKinematicsPlugin::getRandomConfiguration(const KDL::JntArray &seed_state
   {  
     near.push_back(seed_state(i));    
   }  
-  kinematic_state::JointStateGroup*  joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
+  kinematic_state::JointStateGroup*  joint_state_group = workspace.kinematic_state->getJointStateGroup(getGroupName());
   joint_state_group->setToRandomValuesNearBy(near, consistency_limits);
   joint_state_group->getVariableValues(values);
   for(std::size_t i=0; i < dimension_; ++i) 
@@ -84,7 +179,8 @@ void KDLKinematicsPlugin::getRandomConfiguration(const KDL::JntArray &seed_state
   } 
 }
 
-bool KDLKinematicsPlugin::checkConsistency(const KDL::JntArray& seed_state,
+bool KDLKinematicsPlugin::checkConsistency(Workspace &workspace,
+                                           const KDL::JntArray& seed_state,
                                            const std::vector<double> &consistency_limits,
                                            const KDL::JntArray& solution) const
 {
@@ -94,8 +190,8 @@ bool KDLKinematicsPlugin::checkConsistency(const KDL::JntArray& seed_state,
     seed_state_vector[i] = seed_state(i);
     solution_vector[i] = solution(i);    
   }
-  kinematic_state::JointStateGroup* joint_state_group = kinematic_state_->getJointStateGroup(getGroupName());
-  kinematic_state::JointStateGroup* joint_state_group_2 = kinematic_state_2_->getJointStateGroup(getGroupName());
+  kinematic_state::JointStateGroup* joint_state_group = workspace.kinematic_state->getJointStateGroup(getGroupName());
+  kinematic_state::JointStateGroup* joint_state_group_2 = workspace.kinematic_state_2->getJointStateGroup(getGroupName());
   joint_state_group->setVariableValues(seed_state_vector);  
   joint_state_group_2->setVariableValues(solution_vector);
 
@@ -120,40 +216,31 @@ bool KDLKinematicsPlugin::initialize(const std::string& group_name,
   setValues(group_name, base_frame, tip_frame, search_discretization);
 
   ros::NodeHandle private_handle("~");  
-  const boost::shared_ptr<srdf::Model> &srdf = robot_model_loader_.getSRDF();
-  const boost::shared_ptr<urdf::ModelInterface>& urdf_model = robot_model_loader_.getURDF();
-
-  kinematic_model_.reset(new kinematic_model::KinematicModel(urdf_model, srdf));
+  robot_model_data_ = getRobotModelData(ROBOT_DESCRIPTION);
+  if (!robot_model_data_)
+    return false;
+  const kinematic_model::KinematicModelConstPtr &kinematic_model = robot_model_data_->kinematic_model;
 
-  if(!kinematic_model_->hasJointModelGroup(group_name))
+  if(!kinematic_model->hasJointModelGroup(group_name))
   {
     ROS_ERROR("Kinematic model does not contain group %s",group_name.c_str());
     return false;
   }  
-  kinematic_model::JointModelGroup* joint_model_group = kinematic_model_->getJointModelGroup(group_name);
+  const kinematic_model::JointModelGroup* joint_model_group = kinematic_model->getJointModelGroup(group_name);
   if(!joint_model_group->isChain())
   {
     ROS_ERROR("Group is not a chain");
     return false;
   }
   
-  KDL::Tree kdl_tree;
-  
-  if (!kdl_parser::treeFromUrdfModel(*urdf_model, kdl_tree)) 
-  {
-    ROS_ERROR("Could not initialize tree object");
-    return false;
-  }
-  if (!kdl_tree.getChain(base_frame_, tip_frame_, kdl_chain_)) 
+  kdl_chain_ = getChain(*robot_model_data_, base_frame_, tip_frame_);
+  if (!kdl_chain_) 
   {
     ROS_ERROR("Could not initialize chain object");
     return false;
   }
 
   dimension_ = joint_model_group->getVariableCount();
-  jnt_seed_state_.resize(dimension_);
-  jnt_pos_in_.resize(dimension_);
-  jnt_pos_out_.resize(dimension_);
   ik_chain_info_.joint_names = joint_model_group->getJointModelNames();
   ik_chain_info_.limits = joint_model_group->getVariableLimits();   
   fk_chain_info_.joint_names = ik_chain_info_.joint_names;
@@ -177,20 +264,19 @@ bool KDLKinematicsPlugin::initialize(const std::string& group_name,
   }
   
   // Get Solver Parameters
-  int max_solver_iterations;
-  double epsilon;
-
-  private_handle.param("max_solver_iterations", max_solver_iterations, 500);
-  private_handle.param("epsilon", epsilon, 1e-5);
+  segment_index_.clear();
+  for (unsigned int i = 0 ; i < kdl_chain_->getNrOfSegments() ; ++i)
+    segment_index_.insert(std::make_pair(kdl_chain_->getSegment(i).getName(), (int)i + 1));
 
-  // Build Solvers
-  fk_solver_.reset(new KDL::ChainFkSolverPos_recursive(kdl_chain_));
-  ik_solver_vel_.reset(new KDL::ChainIkSolverVel_pinv(kdl_chain_));
-  ik_solver_pos_.reset(new KDL::ChainIkSolverPos_NR_JL(kdl_chain_, joint_min_, joint_max_,*fk_solver_, *ik_solver_vel_, max_solver_iterations, epsilon));
+  private_handle.param("max_solver_iterations", max_solver_iterations_, 500);
+  private_handle.param("epsilon", epsilon_, 1e-5);
 
-  // Setup the joint state groups that we need
-  kinematic_state_.reset(new kinematic_state::KinematicState((const kinematic_model::KinematicModelConstPtr) kinematic_model_));
-  kinematic_state_2_.reset(new kinematic_state::KinematicState((const kinematic_model::KinematicModelConstPtr) kinematic_model_));  
+  // Build the solvers and the joint state groups that we need; more workspaces are allocated if concurrent calls need them
+  {
+    boost::mutex::scoped_lock slock(workspaces_lock_);
+    free_workspaces_.clear();
+  }
+  releaseWorkspace(allocateWorkspace());
 
   active_ = true;  
   ROS_INFO("KDL solver initialized");  
@@ -208,14 +294,23 @@ int KDLKinematicsPlugin::getJointIndex(const std::string &name) const
 
 int KDLKinematicsPlugin::getKDLSegmentIndex(const std::string &name) const
 {
-  int i=0; 
-  while (i < (int)kdl_chain_.getNrOfSegments()) {
-    if (kdl_chain_.getSegment(i).getName() == name) {
-      return i+1;
-    }
-    i++;
+  std::map<std::string, int>::const_iterator it = segment_index_.find(name);
+  return it != segment_index_.end() ? it->second : -1;
+}
+
+void KDLKinematicsPlugin::computeChainFrames(Workspace &workspace, const KDL::JntArray &q, unsigned int segment_count) const
+{
+  // same composition as KDL::ChainFkSolverPos_recursive, but all the intermediate poses are kept
+  workspace.chain_frames[0] = KDL::Frame::Identity();
+  unsigned int j = 0;
+  for (unsigned int i = 0 ; i < segment_count ; ++i)
+  {
+    const KDL::Segment &segment = kdl_chain_->getSegment(i);
+    if (segment.getJoint().getType() != KDL::Joint::None)
+      workspace.chain_frames[i + 1] = workspace.chain_frames[i] * segment.pose(q(j++));
+    else
+      workspace.chain_frames[i + 1] = workspace.chain_frames[i] * segment.pose(0.0);
   }
-  return -1;
 }
 
 bool KDLKinematicsPlugin::timedOut(const ros::WallTime &start_time, double duration) const
@@ -353,9 +448,11 @@ bool KDLKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
                    ik_pose.orientation.z << " " << 
                    ik_pose.orientation.w);
   //Do the IK
+  WorkspaceLease lease(this);
+  Workspace &ws = *lease;
   for(unsigned int i=0; i < dimension_; i++)
-    jnt_seed_state_(i) = ik_seed_state[i]; 
-  jnt_pos_in_ = jnt_seed_state_;
+    ws.jnt_seed_state(i) = ik_seed_state[i]; 
+  ws.jnt_pos_in = ws.jnt_seed_state;
 
   unsigned int counter(0);  
   while(1)  
@@ -368,11 +465,11 @@ bool KDLKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
       error_code.val = error_code.TIMED_OUT;
       return false;      
     }    
-    int ik_valid = ik_solver_pos_->CartToJnt(jnt_pos_in_,pose_desired,jnt_pos_out_);                     
+    int ik_valid = ws.ik_solver_pos->CartToJnt(ws.jnt_pos_in,pose_desired,ws.jnt_pos_out);                     
     if(!consistency_limits.empty()) 
     {
-      getRandomConfiguration(jnt_seed_state_, consistency_limits, jnt_pos_in_);
-      if(ik_valid < 0 || !checkConsistency(jnt_seed_state_, consistency_limits, jnt_pos_out_))
+      getRandomConfiguration(ws, ws.jnt_seed_state, consistency_limits, ws.jnt_pos_in);
+      if(ik_valid < 0 || !checkConsistency(ws, ws.jnt_seed_state, consistency_limits, ws.jnt_pos_out))
       {
         ROS_DEBUG("Could not find IK solution");        
         continue;
@@ -380,7 +477,7 @@ bool KDLKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
     }
     else
     {
-      getRandomConfiguration(jnt_pos_in_);
+      getRandomConfiguration(ws, ws.jnt_pos_in);
       if(ik_valid < 0)
       {
         ROS_DEBUG("Could not find IK solution");        
@@ -389,7 +486,7 @@ bool KDLKinematicsPlugin::searchPositionIK(const geometry_msgs::Pose &ik_pose,
     }
     ROS_DEBUG("Found IK solution");    
     for(unsigned int j=0; j < dimension_; j++)
-      solution[j] = jnt_pos_out_(j);
+      solution[j] = ws.jnt_pos_out(j);
     if(!solution_callback.empty())
       solution_callback(ik_pose,solution,error_code);
     else
@@ -427,30 +524,160 @@ bool KDLKinematicsPlugin::getPositionFK(const std::vector<std::string> &link_nam
     return false;    
   }
   
-  KDL::Frame p_out;
-  geometry_msgs::PoseStamped pose;
-  tf::Stamped<tf::Pose> tf_pose;
-  
+  WorkspaceLease lease(this);
+  Workspace &ws = *lease;
   for(unsigned int i=0; i < dimension_; i++)
   {
-    jnt_pos_in_(i) = joint_angles[i];
+    ws.jnt_pos_in(i) = joint_angles[i];
+  }
+  
+  // a single sweep along the chain serves all the requested links; as for KDL, an unknown link means the whole chain
+  std::vector<unsigned int> segment_counts(link_names.size());
+  unsigned int max_count = 0;
+  for(unsigned int i=0; i < link_names.size(); i++)
+  {
+    int index = getKDLSegmentIndex(link_names[i]);
+    ROS_DEBUG("End effector index: %d",index);
+    segment_counts[i] = index < 0 ? kdl_chain_->getNrOfSegments() : index;
+    max_count = std::max(max_count, segment_counts[i]);
   }
+  computeChainFrames(ws, ws.jnt_pos_in, max_count);
   
-  bool valid = true;
   for(unsigned int i=0; i < poses.size(); i++)
+    tf::poseKDLToMsg(ws.chain_frames[segment_counts[i]],poses[i]);
+  return true;
+}
+
+bool KDLKinematicsPlugin::getPositionFKBatch(const std::vector<std::string> &link_names,
+                                             const std::vector<std::vector<double> > &joint_configurations,
+                                             EigenSTL::vector_Affine3d &poses) const
+{
+  if(!active_)
+  {
+    ROS_ERROR("kinematics not active");    
+    return false;
+  }
+  
+  std::vector<unsigned int> segment_counts(link_names.size());
+  unsigned int max_count = 0;
+  for(unsigned int i=0; i < link_names.size(); i++)
   {
-    ROS_DEBUG("End effector index: %d",getKDLSegmentIndex(link_names[i]));
-    if(fk_solver_->JntToCart(jnt_pos_in_,p_out,getKDLSegmentIndex(link_names[i])) >=0)
+    int index = getKDLSegmentIndex(link_names[i]);
+    if (index < 0)
     {
-      tf::poseKDLToMsg(p_out,poses[i]);
+      ROS_ERROR("Link '%s' is not part of the chain", link_names[i].c_str());
+      return false;
     }
-    else
+    segment_counts[i] = index;
+    max_count = std::max(max_count, segment_counts[i]);
+  }
+  
+  WorkspaceLease lease(this);
+  Workspace &ws = *lease;
+  poses.resize(joint_configurations.size() * link_names.size());
+  std::size_t k = 0;
+  for(std::size_t c=0; c < joint_configurations.size(); c++)
+  {
+    const std::vector<double> &joint_angles = joint_configurations[c];
+    if(joint_angles.size() != dimension_)
     {
-      ROS_ERROR("Could not compute FK for %s",link_names[i].c_str());
-      valid = false;
+      ROS_ERROR("Joint angles vector must have size: %d",dimension_);
+      return false;    
+    }
+    for(unsigned int i=0; i < dimension_; i++)
+      ws.jnt_pos_in(i) = joint_angles[i];
+    computeChainFrames(ws, ws.jnt_pos_in, max_count);
+    for(unsigned int i=0; i < segment_counts.size(); i++, k++)
+    {
+      const KDL::Frame &f = ws.chain_frames[segment_counts[i]];
+      Eigen::Affine3d &pose = poses[k];
+      pose.setIdentity();
+      for (int r = 0 ; r < 3 ; ++r)
+      {
+        for (int col = 0 ; col < 3 ; ++col)
+          pose.linear()(r, col) = f.M(r, col);
+        pose.translation()(r) = f.p(r);
+      }
     }
   }
-  return valid;
+  return true;
+}
+
+struct KDLKinematicsPlugin::IKBatch
+{
+  const std::vector<geometry_msgs::Pose> *ik_poses;
+  const std::vector<std::vector<double> > *ik_seed_states;
+  double timeout;
+  std::vector<std::vector<double> > *solutions;
+  std::vector<moveit_msgs::MoveItErrorCodes> *error_codes;
+  
+  std::size_t next; /** The index of the next pose to solve for */
+  boost::mutex lock;
+};
+
+void KDLKinematicsPlugin::searchPositionIKBatchWorker(IKBatch *batch) const
+{
+  std::vector<double> solution;
+  while (true)
+  {
+    std::size_t i;
+    {
+      boost::mutex::scoped_lock slock(batch->lock);
+      if (batch->next >= batch->ik_poses->size())
+        break;
+      i = batch->next++;
+    }
+    const std::vector<double> &seed = batch->ik_seed_states->size() == 1 ? batch->ik_seed_states->front() : (*batch->ik_seed_states)[i];
+    if (searchPositionIK((*batch->ik_poses)[i], seed, batch->timeout, solution, (*batch->error_codes)[i]))
+      (*batch->solutions)[i].swap(solution);
+  }
+}
+
+std::size_t KDLKinematicsPlugin::searchPositionIKBatch(const std::vector<geometry_msgs::Pose> &ik_poses,
+                                                       const std::vector<std::vector<double> > &ik_seed_states,
+                                                       double timeout,
+                                                       std::vector<std::vector<double> > &solutions,
+                                                       std::vector<moveit_msgs::MoveItErrorCodes> &error_codes,
+                                                       unsigned int threads) const
+{
+  solutions.clear();
+  solutions.resize(ik_poses.size());
+  error_codes.resize(ik_poses.size());
+  if(ik_seed_states.size() != 1 && ik_seed_states.size() != ik_poses.size())
+  {
+    ROS_ERROR("Expected 1 or %zu seed states instead of %zu", ik_poses.size(), ik_seed_states.size());
+    for (std::size_t i = 0 ; i < error_codes.size() ; ++i)
+      error_codes[i].val = moveit_msgs::MoveItErrorCodes::NO_IK_SOLUTION;
+    return 0;
+  }
+  
+  IKBatch batch;
+  batch.ik_poses = &ik_poses;
+  batch.ik_seed_states = &ik_seed_states;
+  batch.timeout = timeout;
+  batch.solutions = &solutions;
+  batch.error_codes = &error_codes;
+  batch.next = 0;
+  
+  if (threads == 0)
+    threads = std::max(1u, boost::thread::hardware_concurrency());
+  threads = std::min<std::size_t>(threads, ik_poses.size());
+  if (threads <= 1)
+    searchPositionIKBatchWorker(&batch);
+  else
+  {
+    // every thread takes its own workspace from the pool, so they can all use this instance
+    boost::thread_group workers;
+    for (unsigned int t = 0 ; t < threads ; ++t)
+      workers.create_thread(boost::bind(&KDLKinematicsPlugin::searchPositionIKBatchWorker, this, &batch));
+    workers.join_all();
+  }
+  
+  std::size_t solved = 0;
+  for (std::size_t i = 0 ; i < error_codes.size() ; ++i)
+    if (error_codes[i].val == moveit_msgs::MoveItErrorCodes::SUCCESS)
+      solved++;
+  return solved;
 }
 
 const std::vector<std::string>& KDLKinematicsPlugin::getJointNames() const
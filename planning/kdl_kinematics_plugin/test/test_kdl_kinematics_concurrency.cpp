@@ -0,0 +1,191 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+// Calls one instance of the KDL kinematics plugin from many threads at once and checks that the results are the same
+// as the ones computed from a single thread. Needs the robot description on the parameter server; the group to test
+// is specified by the ~group parameter.
+
+#include <moveit/kdl_kinematics_plugin/kdl_kinematics_plugin.h>
+#include <boost/thread.hpp>
+#include <cmath>
+
+namespace
+{
+
+struct Samples
+{
+  std::vector<std::string>         tip_link;
+  std::vector<std::vector<double> > joint_values;
+  std::vector<geometry_msgs::Pose> poses;
+};
+
+struct WorkerResult
+{
+  WorkerResult(void) : fk_errors(0), ik_errors(0), ik_solved(0), ik_failed(0)
+  {
+  }
+
+  unsigned int fk_errors;
+  unsigned int ik_errors;
+  unsigned int ik_solved;
+  unsigned int ik_failed;
+};
+
+bool samePose(const geometry_msgs::Pose &a, const geometry_msgs::Pose &b, double tolerance)
+{
+  double dx = a.position.x - b.position.x;
+  double dy = a.position.y - b.position.y;
+  double dz = a.position.z - b.position.z;
+  double dot = a.orientation.x * b.orientation.x + a.orientation.y * b.orientation.y +
+    a.orientation.z * b.orientation.z + a.orientation.w * b.orientation.w;
+  return sqrt(dx * dx + dy * dy + dz * dz) <= tolerance && fabs(dot) >= 1.0 - tolerance;
+}
+
+void worker(const kdl_kinematics_plugin::KDLKinematicsPlugin *solver, const Samples *samples, unsigned int offset, double timeout, WorkerResult *result)
+{
+  std::size_t n = samples->poses.size();
+  std::vector<geometry_msgs::Pose> poses(1);
+  std::vector<double> solution;
+  moveit_msgs::MoveItErrorCodes error_code;
+  for (std::size_t k = 0 ; k < n ; ++k)
+  {
+    // threads start at different samples so they do not all solve the same query at the same time
+    std::size_t i = (k + offset) % n;
+
+    // FK is deterministic, so the result must match the one computed from a single thread exactly
+    if (!solver->getPositionFK(samples->tip_link, samples->joint_values[i], poses) || !samePose(poses[0], samples->poses[i], 0.0))
+      result->fk_errors++;
+
+    // IK may fail, but a reported solution must reach the requested pose
+    if (solver->searchPositionIK(samples->poses[i], samples->joint_values[(i + 1) % n], timeout, solution, error_code))
+    {
+      result->ik_solved++;
+      if (!solver->getPositionFK(samples->tip_link, solution, poses) || !samePose(poses[0], samples->poses[i], 1e-3))
+        result->ik_errors++;
+    }
+    else
+      result->ik_failed++;
+  }
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "test_kdl_kinematics_concurrency");
+  ros::NodeHandle nh("~");
+
+  std::string group;
+  if (!nh.getParam("group", group))
+  {
+    ROS_ERROR("The ~group parameter must be specified");
+    return 1;
+  }
+  int threads, sample_count;
+  double timeout;
+  nh.param("threads", threads, 8);
+  nh.param("samples", sample_count, 200);
+  nh.param("timeout", timeout, 0.1);
+  if (threads < 1 || sample_count < 1)
+  {
+    ROS_ERROR("The number of threads and samples must be positive");
+    return 1;
+  }
+
+  robot_model_loader::RobotModelLoader rml;
+  kinematic_model::KinematicModelConstPtr kmodel(new kinematic_model::KinematicModel(rml.getURDF(), rml.getSRDF()));
+  const kinematic_model::JointModelGroup *jmg = kmodel->getJointModelGroup(group);
+  if (!jmg || jmg->getLinkModels().empty())
+  {
+    ROS_ERROR("Group '%s' is not known or has no links", group.c_str());
+    return 1;
+  }
+  const std::vector<const kinematic_model::LinkModel*> &links = jmg->getLinkModels();
+  std::string base = links.front()->getParentJointModel()->getParentLinkModel() ?
+    links.front()->getParentJointModel()->getParentLinkModel()->getName() : kmodel->getModelFrame();
+  std::string tip = links.back()->getName();
+
+  kdl_kinematics_plugin::KDLKinematicsPlugin solver;
+  if (!solver.initialize(group, base, tip, 0.1))
+  {
+    ROS_ERROR("Unable to initialize the KDL solver for group '%s'", group.c_str());
+    return 1;
+  }
+
+  // reference results, computed from a single thread
+  Samples samples;
+  samples.tip_link.push_back(tip);
+  samples.joint_values.resize(sample_count);
+  samples.poses.resize(sample_count);
+  kinematic_state::KinematicState state(kmodel);
+  kinematic_state::JointStateGroup *jsg = state.getJointStateGroup(group);
+  std::vector<geometry_msgs::Pose> poses(1);
+  for (int i = 0 ; i < sample_count ; ++i)
+  {
+    jsg->setToRandomValues();
+    jsg->getVariableValues(samples.joint_values[i]);
+    if (!solver.getPositionFK(samples.tip_link, samples.joint_values[i], poses))
+    {
+      ROS_ERROR("Unable to compute reference FK");
+      return 1;
+    }
+    samples.poses[i] = poses[0];
+  }
+
+  std::vector<WorkerResult> results(threads);
+  ros::WallTime start = ros::WallTime::now();
+  boost::thread_group workers;
+  for (int t = 0 ; t < threads ; ++t)
+    workers.create_thread(boost::bind(&worker, &solver, &samples, t * sample_count / threads, timeout, &results[t]));
+  workers.join_all();
+  double duration = (ros::WallTime::now() - start).toSec();
+
+  WorkerResult total;
+  for (int t = 0 ; t < threads ; ++t)
+  {
+    total.fk_errors += results[t].fk_errors;
+    total.ik_errors += results[t].ik_errors;
+    total.ik_solved += results[t].ik_solved;
+    total.ik_failed += results[t].ik_failed;
+  }
+  ROS_INFO("%d threads x %d samples in %lf seconds: %u FK errors, %u IK solutions (%u wrong), %u IK failures",
+           threads, sample_count, duration, total.fk_errors, total.ik_solved, total.ik_errors, total.ik_failed);
+
+  if (total.fk_errors > 0 || total.ik_errors > 0)
+  {
+    ROS_ERROR("Fail!");
+    return 1;
+  }
+  return 0;
+}
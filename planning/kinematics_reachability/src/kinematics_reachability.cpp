@@ -145,6 +145,8 @@ bool KinematicsReachability::computeWorkspace(moveit_ros_planning::WorkspacePoin
     */
   }
 
+  planning_scene_monitor_->trackFrame(workspace.header.frame_id);
+  planning_scene_monitor_->trackFrame(workspace.parameters.header.frame_id);
   planning_scene_monitor_->updateFrameTransforms();
   planning_scene_monitor_->lockSceneRead();    
 
@@ -38,6 +38,7 @@
 #define MOVEIT_PLAN_EXECUTION_PLAN_EXECUTION_
 
 #include <moveit/plan_execution/plan_representation.h>
+#include <moveit/plan_execution/worker_pool.h>
 #include <moveit/trajectory_execution_manager/trajectory_execution_manager.h>
 #include <moveit/planning_scene_monitor/planning_scene_monitor.h>
 #include <moveit/planning_scene_monitor/trajectory_monitor.h>
@@ -81,6 +82,27 @@ public:
     boost::function<void(void)> before_execution_callback_;
     boost::function<void(void)> done_callback_;
   };
+
+  /// Timing of the monitoring of the last executed plan, in seconds
+  struct MonitoringStatistics
+  {
+    MonitoringStatistics(void) : revalidations_(0),
+                                 max_latency_(0.0),
+                                 mean_latency_(0.0),
+                                 stop_latency_(0.0)
+    {
+    }
+    
+    /// The number of times the remaining path was checked because the scene changed
+    unsigned int revalidations_;
+    
+    /// The largest and average time from a scene change to the end of the check of the remaining path
+    double max_latency_;
+    double mean_latency_;
+    
+    /// If the path became invalid, the time from the scene change to the moment the execution was stopped; 0 otherwise
+    double stop_latency_;
+  };
   
   PlanExecution(const planning_scene_monitor::PlanningSceneMonitorPtr &planning_scene_monitor, 
                 const trajectory_execution_manager::TrajectoryExecutionManagerPtr& trajectory_execution);
@@ -119,6 +141,23 @@ public:
   {
     return default_max_replan_attempts_;
   }
+  
+  /// Set the maximum frequency at which the remaining path is checked when the scene changes during execution
+  void setMaxPathRevalidationFrequency(double freq)
+  {
+    if (freq > 0.0)
+      min_revalidation_interval_ = ros::WallDuration(1.0 / freq);
+  }
+  
+  double getMaxPathRevalidationFrequency(void) const
+  {
+    return 1.0 / min_revalidation_interval_.toSec();
+  }
+  
+  const MonitoringStatistics& getLastMonitoringStatistics(void) const
+  {
+    return monitoring_statistics_;
+  }
 
   void planAndExecute(ExecutableMotionPlan &plan, const Options &opt);
   void planAndExecute(ExecutableMotionPlan &plan, const moveit_msgs::PlanningScene &scene_diff, const Options &opt);
@@ -128,11 +167,19 @@ public:
 private:
 
   void planAndExecuteHelper(ExecutableMotionPlan &plan, const Options &opt);  
+  /// The space occupied by the robot at one waypoint of a plan
+  struct StateBounds;
+  
   moveit_msgs::MoveItErrorCodes executeAndMonitor(const ExecutableMotionPlan &plan);
-  bool isRemainingPathValid(const ExecutableMotionPlan &plan);
+  
+  /** \brief Check the waypoints of \e plan that were not yet executed. If \e changed_regions is not NULL, only the waypoints
+      for which the robot (as described by \e bounds) may intersect one of the regions are checked. */
+  bool isRemainingPathValid(const ExecutableMotionPlan &plan, const std::vector<Eigen::AlignedBox3d> *changed_regions,
+                            const std::vector<std::vector<StateBounds> > &bounds);
   
   void planningSceneUpdatedCallback(const planning_scene_monitor::PlanningSceneMonitor::SceneUpdateType update_type);
   void doneWithTrajectoryExecution(const moveit_controller_manager::ExecutionStatus &status);
+  void setExecutionComplete(bool complete);
   
   ros::NodeHandle node_handle_;
   planning_scene_monitor::PlanningSceneMonitorPtr planning_scene_monitor_;
@@ -141,10 +188,29 @@ private:
 
   unsigned int default_max_replan_attempts_;
   
+  // the flags below are set by other threads; they are protected by monitor_lock_ and changes are signaled with monitor_condition_
   bool preempt_requested_;
   bool new_scene_update_;
-  
   bool execution_complete_;
+
+  // the time of the first scene change that was not yet checked against the remaining path
+  ros::WallTime scene_update_time_;
+  
+  // the geometry version of the monitored scene the path was last checked against
+  unsigned long checked_geometry_version_;
+  
+  // the padding added to the robot bounds when deciding which waypoints are affected by a change of the scene
+  double revalidation_padding_;
+  
+  // the threads that check the remaining path in parallel; they are started once, since the path is checked up to
+  // max_path_revalidation_frequency times a second
+  boost::scoped_ptr<WorkerPool> path_check_pool_;
+  
+  boost::mutex monitor_lock_;
+  boost::condition_variable monitor_condition_;
+  
+  ros::WallDuration min_revalidation_interval_;
+  MonitoringStatistics monitoring_statistics_;
   
   class DynamicReconfigureImpl;
   DynamicReconfigureImpl *reconfigure_impl_;
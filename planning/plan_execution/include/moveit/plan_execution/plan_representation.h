@@ -38,6 +38,7 @@
 #define MOVEIT_PLAN_EXECUTION_PLAN_REPRESENTATION_
 
 #include <moveit/planning_scene_monitor/planning_scene_monitor.h>
+#include <moveit_msgs/PlanningScene.h>
 #include <moveit_msgs/RobotState.h>
 #include <moveit_msgs/RobotTrajectory.h>
 #include <moveit_msgs/MoveItErrorCodes.h>
@@ -51,6 +52,9 @@ struct ExecutableMotionPlan
 { 
   planning_scene_monitor::PlanningSceneMonitorPtr planning_scene_monitor_;
   planning_scene::PlanningSceneConstPtr planning_scene_;
+
+  /// The diff applied to the monitored scene to obtain planning_scene_ (empty if no diff is applied)
+  moveit_msgs::PlanningScene planning_scene_diff_;
   
   std::string planning_group_;
   moveit_msgs::RobotState trajectory_start_;
@@ -68,5 +72,10 @@ struct ExecutableMotionPlan
 /// The signature of a function that can compute a motion plan
 typedef boost::function<bool(ExecutableMotionPlan &plan)> ExecutableMotionPlanComputationFn;
 
+/** \brief If the planning scene monitor of \e plan serves scene snapshots, point the planning scene of \e plan
+    to the most recent snapshot (with planning_scene_diff_ applied, if not empty). Otherwise, this function has no effect,
+    since the planning scene of the plan already is the maintained scene. */
+void updatePlanningSceneSnapshot(ExecutableMotionPlan &plan);
+
 }
 #endif
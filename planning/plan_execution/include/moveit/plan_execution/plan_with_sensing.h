@@ -38,6 +38,7 @@
 #define MOVEIT_PLAN_EXECUTION_PLAN_WITH_SENSING_
 
 #include <moveit/plan_execution/plan_representation.h>
+#include <moveit/plan_execution/worker_pool.h>
 #include <moveit/trajectory_execution_manager/trajectory_execution_manager.h>
 
 #include <moveit/planning_scene_monitor/trajectory_monitor.h>
@@ -102,6 +103,19 @@ public:
     discard_overlapping_cost_sources_ = value;
   }
   
+  /// Get the minimum joint-space distance between consecutive states of a trajectory that are evaluated for cost sources
+  double getCostSourceStateDistance(void) const
+  {
+    return cost_source_state_distance_;
+  }
+  
+  /// Only evaluate the cost sources of states that are at least \e distance away (in joint space) from the previously
+  /// evaluated state of the trajectory; 0 evaluates every state
+  void setCostSourceStateDistance(double distance)
+  {
+    cost_source_state_distance_ = distance;
+  }
+  
   void setBeforeLookCallback(const boost::function<void()> &callback)
   {
     before_look_callback_ = callback;
@@ -113,6 +127,9 @@ private:
   
   bool lookAt(const std::set<collision_detection::CostSource> &cost_sources, const std::string &frame_id);
   
+  /// Select the states of \e plan to evaluate for cost sources, in the order they appear in the plan
+  void selectCostSourceStates(const ExecutableMotionPlan &plan, std::vector<const kinematic_state::KinematicState*> &states) const;
+  
   ros::NodeHandle node_handle_;
   trajectory_execution_manager::TrajectoryExecutionManagerPtr trajectory_execution_manager_;
   
@@ -123,6 +140,10 @@ private:
 
   double discard_overlapping_cost_sources_;
   unsigned int max_cost_sources_;
+  double cost_source_state_distance_;
+  
+  // the threads that evaluate the cost sources of the states of a plan in parallel
+  boost::scoped_ptr<WorkerPool> cost_source_pool_;
 
   bool display_cost_sources_;
   ros::Publisher cost_sources_publisher_;
@@ -0,0 +1,92 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#ifndef MOVEIT_PLAN_EXECUTION_WORKER_POOL_
+#define MOVEIT_PLAN_EXECUTION_WORKER_POOL_
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+
+namespace plan_execution
+{
+
+/** @brief A set of threads that are started once and then run batches of jobs. The thread that calls run() works on the
+    batch too, so a pool of n threads runs up to n + 1 jobs at a time. */
+class WorkerPool
+{
+public:
+  
+  typedef boost::function<void(void)> Job;
+  
+  /** @brief Start \e threads threads; with 0 threads, jobs run in the calling thread */
+  explicit WorkerPool(unsigned int threads);
+  ~WorkerPool(void);
+  
+  unsigned int getThreadCount(void) const
+  {
+    return thread_count_;
+  }
+  
+  /** @brief Run all the jobs in \e jobs and return when they are all done. Calls from different threads are serialized.
+      Exceptions thrown by a job are logged and do not stop the rest of the batch. */
+  void run(const std::vector<Job> &jobs);
+  
+private:
+  
+  void workerThread(void);
+  
+  /// Run jobs of the current batch until none are left to start; called with \e lock_ held
+  void runJobs(boost::unique_lock<boost::mutex> &ulock);
+  
+  unsigned int thread_count_;
+  boost::thread_group threads_;
+  
+  // the batch being run; these are protected by lock_
+  const std::vector<Job> *jobs_;
+  std::size_t next_job_;
+  std::size_t pending_jobs_;
+  bool stop_;
+  
+  boost::mutex lock_;
+  boost::condition_variable work_condition_;
+  boost::condition_variable done_condition_;
+  
+  // only one batch runs at a time
+  boost::mutex run_lock_;
+};
+
+}
+
+#endif
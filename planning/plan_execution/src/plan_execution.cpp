@@ -38,7 +38,9 @@
 #include <moveit/kinematic_state/conversions.h>
 #include <moveit/trajectory_processing/trajectory_tools.h>
 #include <moveit/collision_detection/collision_tools.h>
+#include <moveit/planning_scene_monitor/bounding_boxes.h>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/thread.hpp>
 
 #include <dynamic_reconfigure/server.h>
 #include <moveit_ros_planning/PlanExecutionDynamicReconfigureConfig.h>
@@ -63,12 +65,100 @@ private:
   {
     owner_->setMaxReplanAttempts(config.max_replan_attempts);
     owner_->setTrajectoryStateRecordingFrequency(config.record_trajectory_state_frequency);
+    owner_->setMaxPathRevalidationFrequency(config.max_path_revalidation_frequency);
   }
   
   PlanExecution *owner_;
   dynamic_reconfigure::Server<PlanExecutionDynamicReconfigureConfig> dynamic_reconfigure_server_;
 };
 
+namespace
+{
+
+/// The states of the remaining path that need to be checked are split in chunks, which are checked in parallel. Chunks are
+/// handed out in execution order and the ones past the first invalid state found so far are skipped.
+class RemainingPathCheck
+{
+public:
+  
+  static const std::size_t CHUNK_SIZE = 8;
+  
+  RemainingPathCheck(const planning_scene::PlanningSceneConstPtr &scene, const std::string &group,
+                     const std::vector<const kinematic_state::KinematicState*> &states) :
+    scene_(scene), group_(group), states_(states), next_chunk_(0), first_invalid_(states.size())
+  {
+  }
+  
+  /// Return the index of the first invalid state, or the number of states if they are all valid
+  std::size_t run(WorkerPool &pool)
+  {
+    std::size_t chunks = (states_.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    std::size_t workers = std::min<std::size_t>(pool.getThreadCount() + 1, chunks);
+    pool.run(std::vector<WorkerPool::Job>(workers, boost::bind(&RemainingPathCheck::worker, this)));
+    return first_invalid_;
+  }
+  
+private:
+  
+  void worker(void)
+  {
+    while (true)
+    {
+      std::size_t begin;
+      {
+        boost::mutex::scoped_lock slock(lock_);
+        begin = next_chunk_ * CHUNK_SIZE;
+        if (begin >= first_invalid_)
+          return;
+        next_chunk_++;
+      }
+      std::size_t end = std::min(begin + CHUNK_SIZE, states_.size());
+      for (std::size_t i = begin ; i < end ; ++i)
+        if (!scene_->isStateFeasible(*states_[i], false) || scene_->isStateColliding(*states_[i], group_, false))
+        {
+          // all the chunks handed out after this one start past i, so this worker has nothing left to do
+          boost::mutex::scoped_lock slock(lock_);
+          first_invalid_ = std::min(first_invalid_, i);
+          return;
+        }
+    }
+  }
+  
+  const planning_scene::PlanningSceneConstPtr &scene_;
+  const std::string &group_;
+  const std::vector<const kinematic_state::KinematicState*> &states_;
+  std::size_t next_chunk_;
+  std::size_t first_invalid_;
+  boost::mutex lock_;
+};
+
+}
+
+struct PlanExecution::StateBounds
+{
+  void compute(const kinematic_state::KinematicState &state, double padding)
+  {
+    parts_.clear();
+    planning_scene_monitor::computeRobotBoundingBoxes(state, padding, parts_);
+    all_.setEmpty();
+    for (std::size_t i = 0 ; i < parts_.size() ; ++i)
+      all_.extend(parts_[i]);
+  }
+  
+  bool intersects(const std::vector<Eigen::AlignedBox3d> &regions) const
+  {
+    if (!planning_scene_monitor::intersectsAny(all_, regions))
+      return false;
+    for (std::size_t i = 0 ; i < parts_.size() ; ++i)
+      if (planning_scene_monitor::intersectsAny(parts_[i], regions))
+        return true;
+    return false;
+  }
+  
+  Eigen::AlignedBox3d all_;
+  std::vector<Eigen::AlignedBox3d> parts_;
+};
+
 }
 
 plan_execution::PlanExecution::PlanExecution(const planning_scene_monitor::PlanningSceneMonitorPtr &planning_scene_monitor, 
@@ -81,9 +171,16 @@ plan_execution::PlanExecution::PlanExecution(const planning_scene_monitor::Plann
   trajectory_monitor_.reset(new planning_scene_monitor::TrajectoryMonitor(planning_scene_monitor_->getStateMonitor()));
   
   default_max_replan_attempts_ = 5;
+  min_revalidation_interval_ = ros::WallDuration(0.02);
+  node_handle_.param("path_revalidation_padding", revalidation_padding_, 0.05);
 
   preempt_requested_ = false;
   new_scene_update_ = false;
+  execution_complete_ = true;
+  checked_geometry_version_ = 0;
+  
+  // the thread that checks the remaining path works on the check too
+  path_check_pool_.reset(new WorkerPool(std::max(boost::thread::hardware_concurrency(), 1u) - 1));
   
   // we want to be notified when new information is available
   planning_scene_monitor_->addUpdateCallback(boost::bind(&PlanExecution::planningSceneUpdatedCallback, this, _1));
@@ -99,13 +196,25 @@ plan_execution::PlanExecution::~PlanExecution(void)
 
 void plan_execution::PlanExecution::stop(void)
 {
+  boost::mutex::scoped_lock slock(monitor_lock_);
   preempt_requested_ = true;
+  monitor_condition_.notify_all();
+}
+
+void plan_execution::updatePlanningSceneSnapshot(ExecutableMotionPlan &plan)
+{
+  if (!plan.planning_scene_monitor_ || !plan.planning_scene_monitor_->isUsingSceneSnapshots())
+    return;
+  planning_scene::PlanningSceneConstPtr snapshot = plan.planning_scene_monitor_->getPlanningSceneSnapshot();
+  if (snapshot)
+    plan.planning_scene_ = planning_scene::PlanningScene::isEmpty(plan.planning_scene_diff_) ? snapshot : snapshot->diff(plan.planning_scene_diff_);
 }
 
 void plan_execution::PlanExecution::planAndExecute(ExecutableMotionPlan &plan, const Options &opt)
 {
   plan.planning_scene_monitor_ = planning_scene_monitor_;
   plan.planning_scene_ = planning_scene_monitor_->getPlanningScene();
+  plan.planning_scene_diff_ = moveit_msgs::PlanningScene();
   planAndExecuteHelper(plan, opt);
 }
 
@@ -116,6 +225,7 @@ void plan_execution::PlanExecution::planAndExecute(ExecutableMotionPlan &plan, c
   else
   {
     plan.planning_scene_monitor_ = planning_scene_monitor_;
+    plan.planning_scene_diff_ = scene_diff;
     {
       planning_scene_monitor::LockedPlanningSceneRO lscene(planning_scene_monitor_); // lock the scene so that it does not modify the world representation while diff() is called
       plan.planning_scene_ = lscene->diff(scene_diff);
@@ -129,7 +239,10 @@ void plan_execution::PlanExecution::planAndExecuteHelper(ExecutableMotionPlan &p
   moveit_msgs::MoveItErrorCodes result;
 
   // perform initial configuration steps & various checks
-  preempt_requested_ = false;
+  {
+    boost::mutex::scoped_lock slock(monitor_lock_);
+    preempt_requested_ = false;
+  }
   
   // run the actual motion plan & execution
   unsigned int max_replan_attempts = opt.replan_attempts_ > 0 ? opt.replan_attempts_ : default_max_replan_attempts_;
@@ -146,7 +259,12 @@ void plan_execution::PlanExecution::planAndExecuteHelper(ExecutableMotionPlan &p
     if (opt.before_plan_callback_)
       opt.before_plan_callback_();
     
-    new_scene_update_ = false; // we clear any scene updates to be evaluated because we are about to compute a new plan, which should consider most recent updates already
+    {
+      boost::mutex::scoped_lock slock(monitor_lock_);
+      new_scene_update_ = false; // we clear any scene updates to be evaluated because we are about to compute a new plan, which should consider most recent updates already
+      checked_geometry_version_ = planning_scene_monitor_->getGeometryVersion();
+    }
+    updatePlanningSceneSnapshot(plan);
 
     // if we never had a solved plan, or there is no specified way of fixing plans, just call the planner; otherwise, try to repair the plan we previously had;
     bool solved = (!previously_solved || !opt.repair_plan_callback_) ? opt.plan_callback_(plan) : opt.repair_plan_callback_(plan, trajectory_execution_manager_->getCurrentExpectedTrajectoryIndex());
@@ -200,23 +318,43 @@ void plan_execution::PlanExecution::planAndExecuteHelper(ExecutableMotionPlan &p
   ROS_DEBUG("PlanExecution terminating with error code %d", plan.error_code_.val);
 }
 
-bool plan_execution::PlanExecution::isRemainingPathValid(const ExecutableMotionPlan &plan)
+bool plan_execution::PlanExecution::isRemainingPathValid(const ExecutableMotionPlan &plan, const std::vector<Eigen::AlignedBox3d> *changed_regions,
+                                                         const std::vector<std::vector<StateBounds> > &bounds)
 {
   std::pair<int, int> expected = trajectory_execution_manager_->getCurrentExpectedTrajectoryIndex();
-  if (expected.first >= 0 && expected.second >= 0)
+  if (expected.first < 0 || expected.second < 0)
+    return true;
+  
+  // select the states to check, in execution order; a state is affected by a change if the robot may intersect the changed
+  // regions at that state or on its way to the next state
+  std::vector<const kinematic_state::KinematicState*> states;
+  for (std::size_t j = expected.first ; j < plan.planned_trajectory_states_.size() ; ++j)
   {
-    planning_scene_monitor::LockedPlanningSceneRO lscene(plan.planning_scene_monitor_); // lock the scene so that it does not modify the world representation while isStateValid() is called
-    
-    for (std::size_t j = expected.first ; j < plan.planned_trajectory_states_.size() ; ++j)
-      for (std::size_t i = (j == expected.first ? std::max(expected.second - 1, 0) : 0) ; i < plan.planned_trajectory_states_[j].size() ; ++i)
-        if (!plan.planning_scene_->isStateFeasible(*plan.planned_trajectory_states_[j][i], false) ||
-            plan.planning_scene_->isStateColliding(*plan.planned_trajectory_states_[j][i], plan.planning_group_, false))
-        {
-          // call the same functions again, in verbose mode, to show what issues have been detected
-          plan.planning_scene_->isStateFeasible(*plan.planned_trajectory_states_[j][i], true);
-          plan.planning_scene_->isStateColliding(*plan.planned_trajectory_states_[j][i], plan.planning_group_, true);
-          return false;
-        }
+    const std::vector<kinematic_state::KinematicStatePtr> &traj = plan.planned_trajectory_states_[j];
+    bool have_bounds = changed_regions && j < bounds.size() && bounds[j].size() == traj.size();
+    for (std::size_t i = (j == expected.first ? std::max(expected.second - 1, 0) : 0) ; i < traj.size() ; ++i)
+      if (!changed_regions || !have_bounds || bounds[j][i].intersects(*changed_regions) ||
+          (i + 1 < traj.size() && bounds[j][i + 1].intersects(*changed_regions)))
+        states.push_back(traj[i].get());
+  }
+  if (states.empty())
+    return true;
+  
+  planning_scene_monitor::LockedPlanningSceneRO lscene(plan.planning_scene_monitor_); // lock the scene so that it does not modify the world representation while isStateValid() is called
+  
+  // when snapshots are used, the scene the plan was computed for is not updated, so we check against the most recent snapshot
+  planning_scene::PlanningSceneConstPtr scene = plan.planning_scene_;
+  if (plan.planning_scene_monitor_ && plan.planning_scene_monitor_->isUsingSceneSnapshots())
+    scene = planning_scene::PlanningScene::isEmpty(plan.planning_scene_diff_) ? 
+      static_cast<const planning_scene::PlanningSceneConstPtr&>(lscene) : lscene->diff(plan.planning_scene_diff_);
+  
+  std::size_t first_invalid = RemainingPathCheck(scene, plan.planning_group_, states).run(*path_check_pool_);
+  if (first_invalid < states.size())
+  {
+    // call the same functions again, in verbose mode, to show what issues have been detected
+    scene->isStateFeasible(*states[first_invalid], true);
+    scene->isStateColliding(*states[first_invalid], plan.planning_group_, true);
+    return false;
   }
   return true;
 }
@@ -226,7 +364,8 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
   moveit_msgs::MoveItErrorCodes result;
   
   // try to execute the trajectory
-  execution_complete_ = true;
+  setExecutionComplete(true);
+  monitoring_statistics_ = MonitoringStatistics();
   
   if (!trajectory_execution_manager_)
   {
@@ -241,7 +380,7 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
     return result;
   }
   
-  execution_complete_ = false;
+  setExecutionComplete(false);
   
   // push the trajectories we have slated for execution to the trajectory execution manager
   for (std::size_t i = 0 ; i < plan.planned_trajectory_.size() ; ++i)
@@ -249,37 +388,84 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
     {
       trajectory_execution_manager_->clear();
       ROS_INFO_STREAM("Apparently trajectory initialization failed");
-      execution_complete_ = true;
+      setExecutionComplete(true);
       result.val = moveit_msgs::MoveItErrorCodes::CONTROL_FAILED;
       return result;
     }
   
+  // the space occupied by the robot along the path, used to skip the waypoints that are far from the changes of the scene
+  std::vector<std::vector<StateBounds> > bounds(plan.planned_trajectory_states_.size());
+  for (std::size_t j = 0 ; j < plan.planned_trajectory_states_.size() ; ++j)
+  {
+    bounds[j].resize(plan.planned_trajectory_states_[j].size());
+    for (std::size_t i = 0 ; i < bounds[j].size() ; ++i)
+      bounds[j][i].compute(*plan.planned_trajectory_states_[j][i], revalidation_padding_);
+  }
+  
   // start recording trajectory states
   trajectory_monitor_->startTrajectoryMonitor();
   
   // start a trajectory execution thread
   trajectory_execution_manager_->execute(boost::bind(&PlanExecution::doneWithTrajectoryExecution, this, _1));
   
-  // wait for path to be done, while checking that the path does not become invalid
-  static const ros::WallDuration d(0.01);
+  // wait for path to be done, while checking that the path does not become invalid;
+  // we wake up when execution completes, a preempt is requested or the scene changes
+  static const ros::WallDuration idle_wait(0.1); // the node handle is checked at least this often
   bool path_became_invalid = false;
-  while (node_handle_.ok() && !execution_complete_ && !preempt_requested_ && !path_became_invalid)
+  bool preempted = false;
+  ros::WallTime invalidating_update_time;
+  ros::WallTime last_check;
+  double total_latency = 0.0;
   {
-    d.sleep();
-    // check the path if there was an environment update in the meantime
-    if (new_scene_update_)
+    boost::unique_lock<boost::mutex> ulock(monitor_lock_);
+    while (node_handle_.ok() && !execution_complete_ && !preempt_requested_)
     {
+      if (!new_scene_update_)
+      {
+        monitor_condition_.timed_wait(ulock, idle_wait.toBoost());
+        continue;
+      }
+      
+      // scene changes that arrive faster than the revalidation rate are checked together
+      ros::WallTime now = ros::WallTime::now();
+      ros::WallTime next_check = last_check + min_revalidation_interval_;
+      if (now < next_check)
+      {
+        monitor_condition_.timed_wait(ulock, (next_check - now).toBoost());
+        continue;
+      }
+      
       new_scene_update_ = false;
-      if (!isRemainingPathValid(plan))
+      ros::WallTime update_time = scene_update_time_;
+      last_check = now;
+      ulock.unlock();
+      
+      // only the waypoints near the regions that changed since the last check need to be checked again;
+      // if the changes are not known, all the remaining waypoints are checked
+      std::vector<Eigen::AlignedBox3d> changed_regions;
+      bool regions_known = planning_scene_monitor_->getChangedRegions(checked_geometry_version_, changed_regions);
+      bool valid = regions_known && changed_regions.empty() ? true :
+        isRemainingPathValid(plan, regions_known ? &changed_regions : NULL, bounds);
+      double latency = (ros::WallTime::now() - update_time).toSec();
+      ulock.lock();
+      
+      monitoring_statistics_.revalidations_++;
+      monitoring_statistics_.max_latency_ = std::max(monitoring_statistics_.max_latency_, latency);
+      total_latency += latency;
+      if (!valid)
       {
         path_became_invalid = true;
+        invalidating_update_time = update_time;
         break;
       }
     }
+    preempted = preempt_requested_;
   }
+  if (monitoring_statistics_.revalidations_ > 0)
+    monitoring_statistics_.mean_latency_ = total_latency / (double)monitoring_statistics_.revalidations_;
   
   // stop execution if needed
-  if (preempt_requested_)
+  if (preempted)
   {
     ROS_INFO("Stopping execution due to preempt request");
     trajectory_execution_manager_->stopExecution();
@@ -289,6 +475,8 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
     {
       ROS_INFO("Stopping execution because the path to execute became invalid (probably the environment changed)");
       trajectory_execution_manager_->stopExecution();
+      monitoring_statistics_.stop_latency_ = (ros::WallTime::now() - invalidating_update_time).toSec();
+      ROS_INFO("Execution was stopped %lf seconds after the scene change that invalidated the path", monitoring_statistics_.stop_latency_);
     }
     else
       if (!execution_complete_)
@@ -300,6 +488,10 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
   // stop recording trajectory states
   trajectory_monitor_->stopTrajectoryMonitor();
   
+  if (monitoring_statistics_.revalidations_ > 0)
+    ROS_DEBUG("The remaining path was checked %u times during execution; scene change to end of check latency: %lf s average, %lf s maximum",
+              monitoring_statistics_.revalidations_, monitoring_statistics_.mean_latency_, monitoring_statistics_.max_latency_);
+  
   // decide return value 
   if (trajectory_execution_manager_->getLastExecutionStatus() == moveit_controller_manager::ExecutionStatus::SUCCEEDED)
     result.val = moveit_msgs::MoveItErrorCodes::SUCCESS;
@@ -309,7 +501,7 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
       result.val = moveit_msgs::MoveItErrorCodes::MOTION_PLAN_INVALIDATED_BY_ENVIRONMENT_CHANGE;
     else
     {
-      if (preempt_requested_)
+      if (preempted)
       {
         result.val = moveit_msgs::MoveItErrorCodes::PREEMPTED;
       }
@@ -328,10 +520,25 @@ moveit_msgs::MoveItErrorCodes plan_execution::PlanExecution::executeAndMonitor(c
 void plan_execution::PlanExecution::planningSceneUpdatedCallback(const planning_scene_monitor::PlanningSceneMonitor::SceneUpdateType update_type)
 {
   if (update_type & (planning_scene_monitor::PlanningSceneMonitor::UPDATE_GEOMETRY | planning_scene_monitor::PlanningSceneMonitor::UPDATE_TRANSFORMS))
-    new_scene_update_ = true;
+  {
+    boost::mutex::scoped_lock slock(monitor_lock_);
+    if (!new_scene_update_)
+    {
+      new_scene_update_ = true;
+      scene_update_time_ = ros::WallTime::now();
+    }
+    monitor_condition_.notify_all();
+  }
 }
 
 void plan_execution::PlanExecution::doneWithTrajectoryExecution(const moveit_controller_manager::ExecutionStatus &status)
 {
-  execution_complete_ = true;
+  setExecutionComplete(true);
+}
+
+void plan_execution::PlanExecution::setExecutionComplete(bool complete)
+{
+  boost::mutex::scoped_lock slock(monitor_lock_);
+  execution_complete_ = complete;
+  monitor_condition_.notify_all();
 }
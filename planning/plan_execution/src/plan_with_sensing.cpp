@@ -38,6 +38,8 @@
 #include <moveit/trajectory_processing/trajectory_tools.h>
 #include <moveit/collision_detection/collision_tools.h>
 #include <boost/algorithm/string/join.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
 
 #include <dynamic_reconfigure/server.h>
 #include <moveit_ros_planning/SenseForPlanDynamicReconfigureConfig.h>
@@ -64,12 +66,76 @@ private:
     owner_->setMaxCostSources(config.max_cost_sources);
     owner_->setMaxLookAttempts(config.max_look_attempts);
     owner_->setDiscardOverlappingCostSources(config.discard_overlapping_cost_sources);
+    owner_->setCostSourceStateDistance(config.cost_source_state_distance);
   }
   
   PlanWithSensing *owner_;
   dynamic_reconfigure::Server<SenseForPlanDynamicReconfigureConfig> dynamic_reconfigure_server_;
 };
 
+namespace
+{
+
+/// Computes the cost sources of a set of states in parallel. Each thread evaluates every n-th state and keeps the
+/// max_costs sources that come first in the order of std::set<CostSource> in a bounded heap of its own; the heaps are
+/// merged at the end.
+class CostSourceEvaluation
+{
+public:
+  
+  CostSourceEvaluation(const planning_scene::PlanningSceneConstPtr &scene, const std::string &group,
+                       const std::vector<const kinematic_state::KinematicState*> &states, std::size_t max_costs) :
+    scene_(scene), group_(group), states_(states), max_costs_(max_costs)
+  {
+  }
+  
+  void run(WorkerPool &pool, std::set<collision_detection::CostSource> &cost_sources)
+  {
+    std::size_t threads = std::min<std::size_t>(pool.getThreadCount() + 1, states_.size());
+    std::vector<std::vector<collision_detection::CostSource> > heaps(threads);
+    std::vector<WorkerPool::Job> jobs(threads);
+    for (std::size_t t = 0 ; t < threads ; ++t)
+      jobs[t] = boost::bind(&CostSourceEvaluation::worker, this, t, threads, &heaps[t]);
+    pool.run(jobs);
+    
+    cost_sources.clear();
+    for (std::size_t t = 0 ; t < threads ; ++t)
+      cost_sources.insert(heaps[t].begin(), heaps[t].end());
+    while (cost_sources.size() > max_costs_)
+      cost_sources.erase(--cost_sources.end());
+  }
+  
+private:
+  
+  void worker(std::size_t first, std::size_t step, std::vector<collision_detection::CostSource> *heap)
+  {
+    // the top of the heap is the source that comes last in set order, so it is the one dropped when the heap is full
+    std::set<collision_detection::CostSource> cost_sources_i;
+    for (std::size_t i = first ; i < states_.size() ; i += step)
+    {
+      cost_sources_i.clear();
+      scene_->getCostSources(*states_[i], max_costs_, group_, cost_sources_i);
+      for (std::set<collision_detection::CostSource>::const_iterator it = cost_sources_i.begin() ; it != cost_sources_i.end() ; ++it)
+      {
+        if (heap->size() >= max_costs_)
+        {
+          if (!(*it < heap->front()))
+            break; // the sources of this state come in set order, so the remaining ones would not be kept either
+          std::pop_heap(heap->begin(), heap->end());
+          heap->pop_back();
+        }
+        heap->push_back(*it);
+        std::push_heap(heap->begin(), heap->end());
+      }
+    }
+  }
+  
+  const planning_scene::PlanningSceneConstPtr &scene_;
+  const std::string &group_;
+  const std::vector<const kinematic_state::KinematicState*> &states_;
+  std::size_t max_costs_;
+};
+
 }
 
 plan_execution::PlanWithSensing::PlanWithSensing(const trajectory_execution_manager::TrajectoryExecutionManagerPtr& trajectory_execution) :
@@ -81,6 +147,10 @@ plan_execution::PlanWithSensing::PlanWithSensing(const trajectory_execution_mana
     
   discard_overlapping_cost_sources_ = 0.8;
   max_cost_sources_ = 100;
+  cost_source_state_distance_ = 0.0;
+  
+  // the thread that evaluates the cost sources works on the evaluation too
+  cost_source_pool_.reset(new WorkerPool(std::max(boost::thread::hardware_concurrency(), 1u) - 1));
   
   // by default we do not display path cost sources
   display_cost_sources_ = false;
@@ -166,24 +236,14 @@ bool plan_execution::PlanWithSensing::computePlan(ExecutableMotionPlan &plan, co
       return solved;
     
     // determine the sources of cost for this path
+    std::vector<const kinematic_state::KinematicState*> states;
+    selectCostSourceStates(plan, states);
     std::set<collision_detection::CostSource> cost_sources;
     {
       planning_scene_monitor::LockedPlanningSceneRO lscene(plan.planning_scene_monitor_); // it is ok if planning_scene_monitor_ is null; there just will be no locking done
-      for (std::size_t i = 0 ; i < plan.planned_trajectory_states_.size() ; ++i)
-      {
-        std::set<collision_detection::CostSource> cost_sources_i;
-        plan.planning_scene_->getCostSources(plan.planned_trajectory_states_[i], max_cost_sources_, plan.planning_group_, cost_sources_i, discard_overlapping_cost_sources_);
-        cost_sources.insert(cost_sources_i.begin(), cost_sources_i.end());
-        if (cost_sources.size() > max_cost_sources_)
-        {
-          std::set<collision_detection::CostSource> other;
-          other.swap(cost_sources);
-          std::size_t j = 0;
-          for (std::set<collision_detection::CostSource>::iterator it = other.begin() ; j < max_cost_sources_ ; ++it, ++j)
-            cost_sources.insert(*it);
-        }
-      }
+      CostSourceEvaluation(plan.planning_scene_, plan.planning_group_, states, max_cost_sources_).run(*cost_source_pool_, cost_sources);
     }
+    collision_detection::removeOverlapping(cost_sources, discard_overlapping_cost_sources_);
     
     // display the costs if needed
     if (display_cost_sources_)
@@ -220,7 +280,11 @@ bool plan_execution::PlanWithSensing::computePlan(ExecutableMotionPlan &plan, co
       look_around_failed = !looked_at_result;
       // if we are unable to look, let this loop continue into the next if statement
       if (just_looked_around)
+      {
+        // the sensor data we just acquired is only visible in a new snapshot of the scene (if snapshots are used)
+        updatePlanningSceneSnapshot(plan);
         continue;
+      }
     }
     
     if (cost > max_safe_path_cost)
@@ -235,6 +299,21 @@ bool plan_execution::PlanWithSensing::computePlan(ExecutableMotionPlan &plan, co
   return false;
 }
 
+void plan_execution::PlanWithSensing::selectCostSourceStates(const ExecutableMotionPlan &plan, std::vector<const kinematic_state::KinematicState*> &states) const
+{
+  // when subsampling, the first and last state of each trajectory are always kept
+  states.clear();
+  for (std::size_t i = 0 ; i < plan.planned_trajectory_states_.size() ; ++i)
+  {
+    const std::vector<kinematic_state::KinematicStatePtr> &traj = plan.planned_trajectory_states_[i];
+    for (std::size_t j = 0 ; j < traj.size() ; ++j)
+      if (cost_source_state_distance_ <= 0.0 || j == 0 || j + 1 == traj.size() ||
+          traj[j]->distance(*states.back()) >= cost_source_state_distance_)
+        states.push_back(traj[j].get());
+  }
+  ROS_DEBUG("Computing cost sources for %u states", (unsigned int)states.size());
+}
+
 bool plan_execution::PlanWithSensing::lookAt(const std::set<collision_detection::CostSource> &cost_sources, const std::string &frame_id)
 {  
   if (!sensor_manager_)
@@ -0,0 +1,113 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#include <moveit/plan_execution/worker_pool.h>
+#include <ros/console.h>
+
+plan_execution::WorkerPool::WorkerPool(unsigned int threads) :
+  thread_count_(threads), jobs_(NULL), next_job_(0), pending_jobs_(0), stop_(false)
+{
+  for (unsigned int i = 0 ; i < thread_count_ ; ++i)
+    threads_.create_thread(boost::bind(&WorkerPool::workerThread, this));
+}
+
+plan_execution::WorkerPool::~WorkerPool(void)
+{
+  {
+    boost::mutex::scoped_lock slock(lock_);
+    stop_ = true;
+  }
+  work_condition_.notify_all();
+  threads_.join_all();
+}
+
+void plan_execution::WorkerPool::run(const std::vector<Job> &jobs)
+{
+  if (jobs.empty())
+    return;
+  if (thread_count_ == 0 || jobs.size() == 1)
+  {
+    for (std::size_t i = 0 ; i < jobs.size() ; ++i)
+      jobs[i]();
+    return;
+  }
+  
+  boost::mutex::scoped_lock rlock(run_lock_);
+  boost::unique_lock<boost::mutex> ulock(lock_);
+  jobs_ = &jobs;
+  next_job_ = 0;
+  pending_jobs_ = jobs.size();
+  work_condition_.notify_all();
+  
+  runJobs(ulock);
+  while (pending_jobs_ > 0)
+    done_condition_.wait(ulock);
+  jobs_ = NULL;
+}
+
+void plan_execution::WorkerPool::runJobs(boost::unique_lock<boost::mutex> &ulock)
+{
+  while (jobs_ && next_job_ < jobs_->size())
+  {
+    const Job &job = (*jobs_)[next_job_++];
+    ulock.unlock();
+    // a job that throws still counts as done, otherwise run() would wait for it forever
+    try
+    {
+      job();
+    }
+    catch (std::exception &ex)
+    {
+      ROS_ERROR("Exception caught in worker pool job: %s", ex.what());
+    }
+    catch (...)
+    {
+      ROS_ERROR("Unknown exception caught in worker pool job");
+    }
+    ulock.lock();
+    if (--pending_jobs_ == 0)
+      done_condition_.notify_all();
+  }
+}
+
+void plan_execution::WorkerPool::workerThread(void)
+{
+  boost::unique_lock<boost::mutex> ulock(lock_);
+  while (!stop_)
+  {
+    runJobs(ulock);
+    if (!stop_)
+      work_condition_.wait(ulock);
+  }
+}
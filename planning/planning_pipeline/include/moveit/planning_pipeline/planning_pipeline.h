@@ -104,10 +104,54 @@ public:
   {
     return planner_instance_;
   }
+
+  /** \brief Instead of using the single loaded planning plugin, race multiple planners against each other. Each element of \e planners
+      is either the name of a planning plugin, or a string of the form plugin_name:planner_id. Every element gets its own planner instance, 
+      and generatePlan() runs all of them in parallel (one thread each) on the same planning scene. If \e deadline is 0, the first
+      solution found is returned and the remaining planners are terminated. Otherwise, solutions are collected until \e deadline
+      seconds pass (or all planners finish) and the shortest one (in joint space) is returned. Passing an empty vector disables racing. */
+  void setRacingPlanners(const std::vector<std::string> &planners, double deadline = 0.0);
+
+  /** \brief Get the names of the planners that are raced against each other (empty if racing is disabled) */
+  const std::vector<std::string>& getRacingPlannerNames(void) const
+  {
+    return racing_planner_names_;
+  }
+
+  /** \brief Get the time (seconds) to wait for solutions from raced planners; 0 means the first solution is used */
+  double getRacingDeadline(void) const
+  {
+    return racing_deadline_;
+  }
   
 private:
+
+  struct RacingPlanner
+  {
+    planning_interface::PlannerPtr planner_;
+    std::string planner_id_;
+  };
+  
+  struct PlannerRace;
   
   void configure(const kinematic_model::KinematicModelConstPtr& model);
+
+  bool solve(const planning_interface::PlannerPtr &planner,
+             const planning_scene::PlanningSceneConstPtr& planning_scene,
+             const moveit_msgs::MotionPlanRequest& req,
+             moveit_msgs::MotionPlanResponse& res,
+             std::vector<std::size_t> &adapter_added_state_index) const;
+  
+  bool solveRacing(const planning_scene::PlanningSceneConstPtr& planning_scene,
+                   const moveit_msgs::MotionPlanRequest& req,
+                   moveit_msgs::MotionPlanResponse& res,
+                   std::vector<std::size_t> &adapter_added_state_index) const;
+  
+  void runRacingPlanner(std::size_t index, PlannerRace *race,
+                        const planning_scene::PlanningSceneConstPtr& planning_scene,
+                        const moveit_msgs::MotionPlanRequest& req) const;
+  
+  kinematic_model::KinematicModelConstPtr kmodel_;
   
   ros::NodeHandle nh_;
 
@@ -126,6 +170,11 @@ private:
   boost::scoped_ptr<pluginlib::ClassLoader<planning_request_adapter::PlanningRequestAdapter> > adapter_plugin_loader_;
   boost::scoped_ptr<planning_request_adapter::PlanningRequestAdapterChain> adapter_chain_;
   std::vector<std::string> adapter_plugin_names_;
+
+  /// The planners to race against each other, if racing is enabled
+  std::vector<RacingPlanner> racing_planners_;
+  std::vector<std::string> racing_planner_names_;
+  double racing_deadline_;
   
   /// Flag indicating whether the reported plans should be checked once again, by the planning pipeline itself
   bool check_solution_paths_;
@@ -39,7 +39,52 @@
 #include <moveit_msgs/DisplayTrajectory.h>
 #include <visualization_msgs/MarkerArray.h>
 #include <boost/tokenizer.hpp>
+#include <boost/thread.hpp>
 #include <sstream>
+#include <cmath>
+
+namespace planning_pipeline
+{
+
+/// The shared state of the planners that race to solve the same motion planning request
+struct PlanningPipeline::PlannerRace
+{
+  PlannerRace(std::size_t count) : responses_(count), adapter_added_state_index_(count), solved_(count, false),
+                                   finished_(0), solved_count_(0)
+  {
+  }
+  
+  boost::mutex lock_;
+  boost::condition_variable condition_;
+  std::vector<moveit_msgs::MotionPlanResponse> responses_;
+  std::vector<std::vector<std::size_t> > adapter_added_state_index_;
+  std::vector<bool> solved_;
+  std::size_t finished_;
+  std::size_t solved_count_;
+};
+
+}
+
+namespace
+{
+double computeJointSpaceLength(const moveit_msgs::RobotTrajectory &trajectory)
+{
+  double length = 0.0;
+  const std::vector<trajectory_msgs::JointTrajectoryPoint> &points = trajectory.joint_trajectory.points;
+  for (std::size_t i = 1 ; i < points.size() ; ++i)
+  {
+    double d = 0.0;
+    std::size_t n = std::min(points[i].positions.size(), points[i - 1].positions.size());
+    for (std::size_t j = 0 ; j < n ; ++j)
+    {
+      double dj = points[i].positions[j] - points[i - 1].positions[j];
+      d += dj * dj;
+    }
+    length += sqrt(d);
+  }
+  return length;
+}
+}
 
 planning_pipeline::PlanningPipeline::PlanningPipeline(const kinematic_model::KinematicModelConstPtr& model, 
                                                       const std::string &planner_plugin_param_name,
@@ -60,6 +105,20 @@ planning_pipeline::PlanningPipeline::PlanningPipeline(const kinematic_model::Kin
   }
   
   configure(model);
+
+  // optionally, race multiple planners against each other
+  std::string racing;
+  if (nh_.getParam("racing_planners", racing))
+  {
+    std::vector<std::string> racing_planners;
+    boost::char_separator<char> sep(" ");
+    boost::tokenizer<boost::char_separator<char> > tok(racing, sep);
+    for(boost::tokenizer<boost::char_separator<char> >::iterator beg = tok.begin() ; beg != tok.end(); ++beg)
+      racing_planners.push_back(*beg);
+    double deadline = 0.0;
+    nh_.param("racing_deadline", deadline, 0.0);
+    setRacingPlanners(racing_planners, deadline);
+  }
 }
 
 planning_pipeline::PlanningPipeline::PlanningPipeline(const kinematic_model::KinematicModelConstPtr& model, 
@@ -72,6 +131,8 @@ planning_pipeline::PlanningPipeline::PlanningPipeline(const kinematic_model::Kin
 
 void planning_pipeline::PlanningPipeline::configure(const kinematic_model::KinematicModelConstPtr& model)
 {
+  kmodel_ = model;
+  racing_deadline_ = 0.0;
   check_solution_paths_ = false;          // this is set to true below
   publish_received_requests_ = false;
   display_computed_motion_plans_ = false; // this is set to true below
@@ -153,6 +214,52 @@ void planning_pipeline::PlanningPipeline::configure(const kinematic_model::Kinem
   checkSolutionPaths(true);
 }
 
+void planning_pipeline::PlanningPipeline::setRacingPlanners(const std::vector<std::string> &planners, double deadline)
+{
+  racing_planners_.clear();
+  racing_planner_names_.clear();
+  racing_deadline_ = deadline > 0.0 ? deadline : 0.0;
+  if (planners.empty())
+    return;
+  if (!planner_plugin_loader_)
+  {
+    ROS_ERROR("No planning plugin loader available. Cannot race planners.");
+    return;
+  }
+  
+  for (std::size_t i = 0 ; i < planners.size() ; ++i)
+  {
+    RacingPlanner rp;
+    std::string plugin_name = planners[i];
+    std::size_t colon = plugin_name.find(':');
+    if (colon != std::string::npos)
+    {
+      rp.planner_id_ = plugin_name.substr(colon + 1);
+      plugin_name = plugin_name.substr(0, colon);
+    }
+    // each raced planner needs its own instance, since instances are not safe to use from multiple threads at the same time
+    try
+    {
+      rp.planner_.reset(planner_plugin_loader_->createUnmanagedInstance(plugin_name));
+      rp.planner_->init(kmodel_);
+    }
+    catch(pluginlib::PluginlibException& ex)
+    {
+      ROS_ERROR_STREAM("Exception while loading planner '" << plugin_name << "' for racing: " << ex.what());
+      continue;
+    }
+    racing_planners_.push_back(rp);
+    racing_planner_names_.push_back(planners[i]);
+  }
+  
+  if (racing_planners_.size() < 2)
+    ROS_WARN("Racing planners is enabled, but only %u planner(s) could be loaded", (unsigned int)racing_planners_.size());
+  if (racing_deadline_ > 0.0)
+    ROS_INFO("Racing %u planners; using the shortest path found within %lf seconds", (unsigned int)racing_planners_.size(), racing_deadline_);
+  else
+    ROS_INFO("Racing %u planners; using the first path found", (unsigned int)racing_planners_.size());
+}
+
 void planning_pipeline::PlanningPipeline::displayComputedMotionPlans(bool flag)
 {
   if (display_computed_motion_plans_ && !flag)
@@ -201,39 +308,19 @@ bool planning_pipeline::PlanningPipeline::generatePlan(const planning_scene::Pla
     received_request_publisher_.publish(req);
   adapter_added_state_index.clear();
 
-  if (!planner_instance_)
-  {
-    ROS_ERROR("No planning plugin loaded. Cannot plan.");
-    return false;
-  }
-  
   bool solved = false;
-  try
+  if (racing_planners_.empty())
   {
-    if (adapter_chain_)
+    if (!planner_instance_)
     {
-      solved = adapter_chain_->adaptAndPlan(planner_instance_, planning_scene, req, res, adapter_added_state_index);
-      if (!adapter_added_state_index.empty())
-      {
-        std::stringstream ss;
-        for (std::size_t i = 0 ; i < adapter_added_state_index.size() ; ++i)
-          ss << adapter_added_state_index[i] << " ";
-        ROS_DEBUG("Planning adapters have added states at index positions: [ %s]", ss.str().c_str());
-      }
+      ROS_ERROR("No planning plugin loaded. Cannot plan.");
+      return false;
     }
-    else
-      solved = planner_instance_->solve(planning_scene, req, res);
-  }
-  catch(std::runtime_error &ex)
-  {
-    ROS_ERROR("Exception caught: '%s'", ex.what());
-    return false;
-  }
-  catch(...)
-  {
-    ROS_ERROR("Unknown exception thrown by planner");
-    return false;
+    solved = solve(planner_instance_, planning_scene, req, res, adapter_added_state_index);
   }
+  else
+    solved = solveRacing(planning_scene, req, res, adapter_added_state_index);
+  
   bool valid = true;
   
   if (solved)
@@ -330,8 +417,143 @@ bool planning_pipeline::PlanningPipeline::generatePlan(const planning_scene::Pla
   return solved && valid;
 }
 
+bool planning_pipeline::PlanningPipeline::solve(const planning_interface::PlannerPtr &planner,
+                                                const planning_scene::PlanningSceneConstPtr& planning_scene,
+                                                const moveit_msgs::MotionPlanRequest& req,
+                                                moveit_msgs::MotionPlanResponse& res,
+                                                std::vector<std::size_t> &adapter_added_state_index) const
+{
+  bool solved = false;
+  try
+  {
+    if (adapter_chain_)
+    {
+      solved = adapter_chain_->adaptAndPlan(planner, planning_scene, req, res, adapter_added_state_index);
+      if (!adapter_added_state_index.empty())
+      {
+        std::stringstream ss;
+        for (std::size_t i = 0 ; i < adapter_added_state_index.size() ; ++i)
+          ss << adapter_added_state_index[i] << " ";
+        ROS_DEBUG("Planning adapters have added states at index positions: [ %s]", ss.str().c_str());
+      }
+    }
+    else
+      solved = planner->solve(planning_scene, req, res);
+  }
+  catch(std::runtime_error &ex)
+  {
+    ROS_ERROR("Exception caught: '%s'", ex.what());
+    return false;
+  }
+  catch(...)
+  {
+    ROS_ERROR("Unknown exception thrown by planner");
+    return false;
+  }
+  return solved;
+}
+
+void planning_pipeline::PlanningPipeline::runRacingPlanner(std::size_t index, PlannerRace *race,
+                                                           const planning_scene::PlanningSceneConstPtr& planning_scene,
+                                                           const moveit_msgs::MotionPlanRequest& req) const
+{
+  moveit_msgs::MotionPlanResponse res;
+  std::vector<std::size_t> adapter_added_state_index;
+  bool solved;
+  if (racing_planners_[index].planner_id_.empty())
+    solved = solve(racing_planners_[index].planner_, planning_scene, req, res, adapter_added_state_index);
+  else
+  {
+    moveit_msgs::MotionPlanRequest req_i = req;
+    req_i.planner_id = racing_planners_[index].planner_id_;
+    solved = solve(racing_planners_[index].planner_, planning_scene, req_i, res, adapter_added_state_index);
+  }
+  solved = solved && res.error_code.val == moveit_msgs::MoveItErrorCodes::SUCCESS;
+  
+  {
+    boost::mutex::scoped_lock slock(race->lock_);
+    race->responses_[index] = res;
+    race->adapter_added_state_index_[index].swap(adapter_added_state_index);
+    race->solved_[index] = solved;
+    race->finished_++;
+    if (solved)
+      race->solved_count_++;
+  }
+  race->condition_.notify_all();
+}
+
+bool planning_pipeline::PlanningPipeline::solveRacing(const planning_scene::PlanningSceneConstPtr& planning_scene,
+                                                      const moveit_msgs::MotionPlanRequest& req,
+                                                      moveit_msgs::MotionPlanResponse& res,
+                                                      std::vector<std::size_t> &adapter_added_state_index) const
+{
+  PlannerRace race(racing_planners_.size());
+  boost::thread_group threads;
+  for (std::size_t i = 0 ; i < racing_planners_.size() ; ++i)
+    threads.create_thread(boost::bind(&PlanningPipeline::runRacingPlanner, this, i, &race, boost::cref(planning_scene), boost::cref(req)));
+  
+  // wait for the first solution, or, if a deadline is set, for the deadline to pass (or for all the planners to finish)
+  {
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds((long)(racing_deadline_ * 1000.0));
+    boost::mutex::scoped_lock slock(race.lock_);
+    while (race.finished_ < racing_planners_.size())
+    {
+      if (racing_deadline_ > 0.0)
+      {
+        if (boost::get_system_time() >= deadline && race.solved_count_ > 0)
+          break;
+        if (race.solved_count_ > 0)
+          race.condition_.timed_wait(slock, deadline);
+        else
+          race.condition_.wait(slock);
+      }
+      else
+      {
+        if (race.solved_count_ > 0)
+          break;
+        race.condition_.wait(slock);
+      }
+    }
+  }
+  
+  // stop the planners that are still running; this does not affect the planners that already finished
+  for (std::size_t i = 0 ; i < racing_planners_.size() ; ++i)
+    racing_planners_[i].planner_->terminate();
+  threads.join_all();
+  
+  // choose the shortest of the solutions found
+  int best = -1;
+  double best_length = 0.0;
+  for (std::size_t i = 0 ; i < racing_planners_.size() ; ++i)
+    if (race.solved_[i])
+    {
+      double length = computeJointSpaceLength(race.responses_[i].trajectory);
+      if (best < 0 || length < best_length)
+      {
+        best = i;
+        best_length = length;
+      }
+    }
+  
+  if (best < 0)
+  {
+    ROS_DEBUG("None of the %u raced planners found a solution", (unsigned int)racing_planners_.size());
+    // report the response of the first planner, so that the error code is meaningful
+    res = race.responses_[0];
+    adapter_added_state_index.swap(race.adapter_added_state_index_[0]);
+    return false;
+  }
+  ROS_DEBUG("Using solution from raced planner '%s' (%u of %u planners found solutions)", racing_planner_names_[best].c_str(),
+            (unsigned int)race.solved_count_, (unsigned int)racing_planners_.size());
+  res = race.responses_[best];
+  adapter_added_state_index.swap(race.adapter_added_state_index_[best]);
+  return true;
+}
+
 void planning_pipeline::PlanningPipeline::terminate(void) const
 {
   if (planner_instance_)
     planner_instance_->terminate();
+  for (std::size_t i = 0 ; i < racing_planners_.size() ; ++i)
+    racing_planners_[i].planner_->terminate();
 }
@@ -0,0 +1,59 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#ifndef MOVEIT_PLANNING_SCENE_MONITOR_BOUNDING_BOXES_
+#define MOVEIT_PLANNING_SCENE_MONITOR_BOUNDING_BOXES_
+
+#include <moveit/kinematic_state/kinematic_state.h>
+#include <geometric_shapes/shapes.h>
+#include <Eigen/Geometry>
+#include <vector>
+
+namespace planning_scene_monitor
+{
+
+/** @brief Compute an axis-aligned box that contains \e shape placed at \e pose. Shapes with no bounds (planes, octrees,
+    unknown types) get a box that contains everything. */
+Eigen::AlignedBox3d computeShapeBoundingBox(const shapes::Shape *shape, const Eigen::Affine3d &pose);
+
+/** @brief Compute the axis-aligned boxes that contain the collision geometry of the links and attached bodies of the robot
+    in \e state, enlarged by \e padding on every side. The boxes are appended to \e boxes. */
+void computeRobotBoundingBoxes(const kinematic_state::KinematicState &state, double padding, std::vector<Eigen::AlignedBox3d> &boxes);
+
+/** @brief Return true if \e box intersects any of \e regions */
+bool intersectsAny(const Eigen::AlignedBox3d &box, const std::vector<Eigen::AlignedBox3d> &regions);
+
+}
+
+#endif
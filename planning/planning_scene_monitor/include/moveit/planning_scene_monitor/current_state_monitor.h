@@ -44,6 +44,7 @@
 #include <boost/function.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 namespace planning_scene_monitor
 {
@@ -73,6 +74,12 @@ public:
    */
   void stopStateMonitor(void);
   
+  /** @brief Get the kinematic model the monitored state is for */
+  const kinematic_model::KinematicModelConstPtr& getKinematicModel(void) const
+  {
+    return kmodel_;
+  }
+  
   /** @brief Check if the state monitor is started */
   bool isActive(void) const;
   
@@ -118,6 +125,40 @@ public:
    *  @return Returns the map from joint names to joint state values*/
   std::map<std::string, double> getCurrentStateValues(void) const;
   
+  /** @brief Get the current values of the variables of the kinematic model, in the order of
+   *  kinematic_model::KinematicModel::getVariableNames(). This does not wait for the processing of incoming joint states.
+   *  @return The time stamp of the values (zero if no joint states were received yet) */
+  ros::Time getCurrentStateVector(std::vector<double> &values) const;
+  
+  /** @brief Get the state of the robot at time \e t, interpolated between the two closest recorded states.
+   *  If \e t is later than the most recent recorded state, the most recent state is returned. If \e t is older than
+   *  the history of recorded states, the oldest recorded state is returned and a warning is printed.
+   *  @return False if no state was recorded before or at \e t (e.g., \e t is older than the first state received) */
+  bool getStateAtTime(const ros::Time &t, kinematic_state::KinematicState &state) const;
+  
+  /** @brief Get the state of the robot at time \e t, as described for the other version of this function.
+   *  @return The state, or an empty pointer if the state is not known */
+  kinematic_state::KinematicStatePtr getStateAtTime(const ros::Time &t) const;
+  
+  /** @brief Wait until a state with a time stamp later than \e t is recorded, or until \e timeout passes
+   *  @return True if a state later than \e t is available */
+  bool waitForStateUpdate(const ros::Time &t, const ros::WallDuration &timeout) const;
+  
+  /** @brief Get the recorded states with time stamps later than \e t, oldest first. For each state, a row of
+   *  values (in the order of kinematic_model::KinematicModel::getVariableNames()) is appended to \e values
+   *  and its time stamp is appended to \e stamps.
+   *  @return The number of states appended */
+  std::size_t getStateHistory(const ros::Time &t, std::vector<double> &values, std::vector<ros::Time> &stamps) const;
+  
+  /** @brief Set the number of recorded states kept for time-indexed queries (default 1024) */
+  void setStateHistoryLength(std::size_t length);
+  
+  /** @brief Get the number of recorded states kept for time-indexed queries */
+  std::size_t getStateHistoryLength(void) const
+  {
+    return history_time_.size();
+  }
+  
   /** @brief Set a callback that will be called whenever the joint state is updated*/
   void setOnStateUpdateCallback(const JointStateUpdateCallback &callback);
   
@@ -141,21 +182,59 @@ public:
   
 private:
   
+  /** @brief For a particular order of joint names in joint_states messages, the index of each name in the
+   *  variables of the kinematic model (-1 for names the model does not know) */
+  struct JointStateLayout
+  {
+    std::vector<std::string> names;
+    std::vector<int>         index;
+  };
+  
   void jointStateCallback(const sensor_msgs::JointStateConstPtr &joint_state);
   bool isPassiveDOF(const std::string &dof) const;  
+  
+  /** @brief Get the layout for the names in a joint_states message, computing it if this order of names was not seen before */
+  const JointStateLayout& getJointStateLayout(const std::vector<std::string> &names);
+  
+  /** @brief Record \e state_values_ in the state history. Must be called with \e state_update_lock_ held */
+  void recordStateHistory(const ros::Time &stamp);
+  
+  /** @brief Get the values of the variables at time \e t from the history */
+  bool getStateVectorAtTime(const ros::Time &t, std::vector<double> &values) const;
 
   ros::NodeHandle                              nh_;
   boost::shared_ptr<tf::Transformer>           tf_;
   kinematic_model::KinematicModelConstPtr      kmodel_;
   kinematic_state::KinematicState              kstate_;
   kinematic_state::JointState                 *root_;
-  std::map<std::string, ros::Time>             joint_time_;
+  
+  /* the following vectors are indexed by the variables of the kinematic model (in the order of getVariableNames()) */
+  std::vector<double>                          state_values_;     /// the last received value of each variable
+  std::vector<ros::Time>                       variable_time_;    /// the time each variable was last updated
+  std::vector<bool>                            variable_known_;   /// true if the variable was ever updated
+  std::vector<bool>                            variable_passive_;
+  std::vector<bool>                            variable_wraps_;   /// true for continuous joints, whose values are not changed to fit in bounds
+  std::vector<double>                          variable_lower_;
+  std::vector<double>                          variable_upper_;
+  std::vector<int>                             root_variable_index_;
+  
+  std::vector<JointStateLayout>                layouts_;          /// the layouts of the joint_states messages seen so far
+  std::size_t                                  last_layout_;
   bool                                         state_monitor_started_;
   double                                       error_;
   ros::Subscriber                              joint_state_subscriber_;
   ros::Time                                    current_state_time_;
   
   mutable boost::mutex                         state_update_lock_;
+  
+  /* bounded ring of the most recent states (variable values and time stamps), kept separately from kstate_
+     so readers only hold history_lock_ while copying values and never wait for the update of kstate_ */
+  std::vector<double>                          history_values_;   /// history_time_.size() rows of kmodel_->getVariableCount() values each
+  std::vector<ros::Time>                       history_time_;
+  std::size_t                                  history_start_;    /// index of the oldest recorded state
+  std::size_t                                  history_count_;    /// number of recorded states
+  mutable boost::mutex                         history_lock_;
+  mutable boost::condition_variable            history_condition_;
   JointStateUpdateCallback                     on_state_update_callback_;
 };
 
@@ -0,0 +1,128 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#ifndef MOVEIT_PLANNING_SCENE_MONITOR_PLANNING_SCENE_CODEC_
+#define MOVEIT_PLANNING_SCENE_MONITOR_PLANNING_SCENE_CODEC_
+
+#include <moveit_msgs/PlanningScene.h>
+#include <boost/cstdint.hpp>
+#include <map>
+#include <set>
+
+namespace planning_scene_monitor
+{
+
+/** @class PlanningSceneEncoder
+    @brief Encodes a stream of planning scene messages into compact binary messages, to be decoded by a PlanningSceneDecoder.
+
+    Every mesh is identified by a hash of its content. The body of a mesh is sent only the first time the mesh is
+    encoded; afterwards only its identifier is sent. Octomap data is sent as the range of bytes that differs from the
+    previously sent octomap. The result can be additionally compressed with zlib.
+
+    The octomap delta is a byte-level diff of the serialized tree, not a diff of its cells: a change early in the
+    serialized data causes most of the tree to be sent again. Receivers that need cell-level updates of the octomap
+    should use the keyframe and update topics of the occupancy map monitor instead.
+
+    Every message carries its sequence number and the sequence number of the message it builds on. The first message
+    after reset() is a keyframe: it does not depend on earlier messages. A decoder rejects any other message that does
+    not build on the last message it decoded, so a lost message is detected instead of corrupting the decoded octomap
+    or meshes; the decoder then needs the encoder to be reset() and a complete scene to be encoded. */
+class PlanningSceneEncoder
+{
+public:
+
+  PlanningSceneEncoder(bool compress = true);
+
+  void setCompression(bool compress)
+  {
+    compress_ = compress;
+  }
+
+  bool getCompression(void) const
+  {
+    return compress_;
+  }
+
+  /** @brief Forget the meshes and octomap that were sent so far; the next encoded message is a keyframe */
+  void reset(void);
+
+  /** @brief Encode \e scene into \e data */
+  void encode(const moveit_msgs::PlanningScene &scene, std::vector<uint8_t> &data);
+
+private:
+
+  bool                 compress_;
+  uint32_t             sequence_; /// the sequence number of the last encoded message
+  bool                 keyframe_; /// true if the next message does not depend on the previous ones
+  std::set<uint64_t>   sent_meshes_;
+  std::vector<int8_t>  sent_octomap_;
+  bool                 have_octomap_;
+};
+
+/** @class PlanningSceneDecoder
+    @brief Decodes the messages produced by a PlanningSceneEncoder back into planning scene messages */
+class PlanningSceneDecoder
+{
+public:
+
+  PlanningSceneDecoder(void);
+
+  /** @brief Forget the meshes and octomap that were received so far; only a keyframe can be decoded next */
+  void reset(void);
+
+  /** @brief Decode \e data into \e scene. Return false if the data is malformed or does not build on the last decoded
+      message (a message was lost, or no keyframe was received yet); the state of the decoder is unchanged in that case. */
+  bool decode(const std::vector<uint8_t> &data, moveit_msgs::PlanningScene &scene);
+
+  /** @brief Return true if a message was rejected because it did not build on the last decoded message, and no
+      keyframe was decoded since; the encoder needs to be reset for decoding to resume */
+  bool needsKeyframe(void) const
+  {
+    return needs_keyframe_;
+  }
+
+private:
+
+  bool                                 synchronized_; /// true if a keyframe was decoded since the last reset
+  uint32_t                             sequence_; /// the sequence number of the last decoded message
+  bool                                 needs_keyframe_;
+
+  std::map<uint64_t, shape_msgs::Mesh> meshes_;
+  std::vector<int8_t>                  octomap_;
+  bool                                 have_octomap_;
+};
+
+}
+
+#endif
@@ -45,8 +45,13 @@
 #include <moveit/planning_models_loader/kinematic_model_loader.h>
 #include <moveit/occupancy_map_monitor/occupancy_map_monitor.h>
 #include <moveit/planning_scene_monitor/current_state_monitor.h>
+#include <moveit/planning_scene_monitor/planning_scene_codec.h>
+#include <std_msgs/UInt8MultiArray.h>
+#include <std_msgs/Empty.h>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <Eigen/Geometry>
+#include <deque>
 
 namespace planning_scene_monitor
 {
@@ -202,7 +207,10 @@ public:
   void monitorDiffs(bool flag);
 
   /** \brief Start publishing the maintained planning scene. The first message set out is a complete planning scene. 
-      Diffs are sent afterwards on updates specified by the \e event bitmask. For UPDATE_SCENE, the full scene is always sent. */
+      Diffs are sent afterwards on updates specified by the \e event bitmask. For UPDATE_SCENE, the full scene is always sent.
+      If the ~publish_compact_planning_scene parameter is true, the same messages are also published in compact form
+      (see PlanningSceneEncoder) on the topic with the "_compact" suffix; ~compress_planning_scene enables zlib compression
+      for that topic. */
   void startPublishingPlanningScene(SceneUpdateType event, const std::string &planning_scene_topic = "monitored_planning_scene");
 
   /** \brief Stop publishing the maintained planning scene. */
@@ -216,6 +224,21 @@ public:
   {
     return publish_planning_scene_frequency_;
   }
+
+  /** \brief Start publishing the state of the maintained scene at most at \e hz, independently of the planning scene
+      publishing. Each message is a sensor_msgs::JointState with no joint names; its positions are the values of all the
+      variables of the kinematic model, in the order of kinematic_model::KinematicModel::getVariableNames(). If already
+      publishing, only the frequency is changed. A frequency that is not positive is rejected and nothing changes. */
+  void startPublishingPackedState(double hz, const std::string &topic = "monitored_planning_scene_state");
+
+  /** \brief Stop publishing the state of the maintained scene */
+  void stopPublishingPackedState(void);
+
+  /** \brief Get the maximum frequency at which the state of the maintained scene is published (Hz) */
+  double getPackedStatePublishingFrequency(void) const
+  {
+    return publish_packed_state_frequency_;
+  }
   
   /** @brief Get the stored instance of the stored current state monitor
    *  @return An instance of the stored current state monitor*/
@@ -227,9 +250,19 @@ public:
   /** @brief Update the transforms for the frames that are not part of the kinematic model using tf.
    *  Examples of these frames are the "map" and "odom_combined" transforms. This function is automatically called when data that uses transforms is received.
    *  However, this function should also be called before starting a planning request, for example.
+   *  Only the tracked frames (see trackFrame()) are looked up, and the scene is updated only if one of their transforms changed.
    */
   void updateFrameTransforms(void);
 
+  /** @brief Update the transforms of all the frames known to tf that are not part of the kinematic model, not only the tracked ones.
+   *  This is meant for callers that do not know which frames they need (see trackFrame()); it is more expensive than updateFrameTransforms(). */
+  void updateAllFrameTransforms(void);
+
+  /** @brief Maintain the transform of \e frame in the planning scene when updateFrameTransforms() is called.
+   *  Frames referenced by the collision objects, attached objects, collision maps and worlds received by the monitor are tracked automatically;
+   *  frames referenced only by planning requests need to be added with this function before calling updateFrameTransforms(). */
+  void trackFrame(const std::string &frame);
+
   /** @brief Start the current state monitor
       @param joint_states_topic the topic to listen to for joint states
       @param attached_objects_topic the topic to listen to for attached collision objects */
@@ -262,17 +295,33 @@ public:
   }  
   
   /** @brief Start the scene monitor
-   *  @param scene_topic The name of the planning scene topic
+   *  @param scene_topic The name of the planning scene topic. If the name ends in "_compact", the topic is expected to
+   *  carry planning scenes in compact form, as published by startPublishingPlanningScene(). When a compact scene cannot
+   *  be decoded because a previous one was lost, a complete scene is requested on the topic with the "_keyframe_request" suffix
    */
   void startSceneMonitor(const std::string &scene_topic = "planning_scene");
 
   /** @brief Stop the scene monitor*/
   void stopSceneMonitor(void);
 
+  /** @brief Update the state of the maintained scene from the messages published by startPublishingPackedState() of
+   *  another monitor for the same robot
+   *  @param topic The name of the packed state topic
+   */
+  void startPackedStateMonitor(const std::string &topic = "monitored_planning_scene_state");
+
+  /** @brief Stop listening to packed states */
+  void stopPackedStateMonitor(void);
+
   /** @brief Start listening for objects in the world, the collision map and attached collision objects. Additionally, this function starts the OccupancyMapMonitor as well.
    *  @param collision_objects_topic The topic on which to listen for collision objects
    *  @param collision_map_topic The topic on which to listen for the collision map
-   *  @param planning_scene_world_topic The topic to listen to for world scene geometry */
+   *  @param planning_scene_world_topic The topic to listen to for world scene geometry
+   *
+   *  Messages on these topics are queued and applied to the scene by a separate thread, in the order they were received.
+   *  They are not ordered with respect to the planning scene topic of startSceneMonitor(): geometry received before a
+   *  complete planning scene may be applied after it. Publishers that mix the two should publish the geometry as part of
+   *  the planning scene instead. */
   void startWorldGeometryMonitor(const std::string &collision_objects_topic = "collision_object",
                                  const std::string &collision_map_topic = "collision_map",
                                  const std::string &planning_scene_world_topic = "planning_scene_world");
@@ -307,6 +356,33 @@ public:
   /** \brief Lock the scene from writing (only one thread can lock for writing and no other thread can lock for reading) */
   void unlockSceneWrite(void);
 
+  /** \brief When the flag passed in is true, LockedPlanningSceneRO no longer holds the scene (and octree) read lock while it is in use.
+      Instead, readers receive an immutable copy of the monitored scene (a snapshot; see getPlanningSceneSnapshot()), so long
+      running readers (e.g., planners) do not block the monitor from applying updates. Snapshots are disabled by default. */
+  void useSceneSnapshots(bool flag);
+
+  /** \brief Return true if readers are served snapshots of the monitored scene instead of holding the scene read lock */
+  bool isUsingSceneSnapshots(void) const
+  {
+    return use_scene_snapshots_;
+  }
+
+  /** \brief Get an immutable copy of the monitored scene that includes all updates processed so far. The returned scene
+      (including its octree, if any) is never modified by the monitor, so it can be used without locking. A full copy is made
+      at most once per scene update other than a robot state update; after state updates, the snapshot is a diff of the last
+      full copy that only holds the new robot state. Until the next update, all callers share the same snapshot. */
+  planning_scene::PlanningSceneConstPtr getPlanningSceneSnapshot(void);
+
+  /** \brief Get the version of the geometry of the monitored scene; it is incremented every time the world geometry
+      or the attached bodies of the scene change */
+  unsigned long getGeometryVersion(void) const;
+
+  /** \brief Get the axis-aligned boxes that contain the geometry that changed since geometry version \e version, and set
+      \e version to the current geometry version. Returns false if the changed regions are not known (some change was not
+      localized, e.g., a full scene was received, or \e version is too old to be kept in the change history); in that case
+      the whole scene should be assumed to have changed. */
+  bool getChangedRegions(unsigned long &version, std::vector<Eigen::AlignedBox3d> &regions) const;
+
 protected:
   
   /** @brief Initialize the planning scene monitor
@@ -322,6 +398,12 @@ protected:
   /** @brief Callback for a new planning scene msg*/
   void newPlanningSceneCallback(const moveit_msgs::PlanningSceneConstPtr &scene);
 
+  /** @brief Callback for a new state in packed form*/
+  void packedStateCallback(const sensor_msgs::JointStateConstPtr &state);
+
+  /** @brief Callback for a new planning scene msg in compact form*/
+  void newCompactPlanningSceneCallback(const std_msgs::UInt8MultiArrayConstPtr &data);
+
   /** @brief Callback for a new collision object msg*/
   void collisionObjectCallback(const moveit_msgs::CollisionObjectConstPtr &obj);
 
@@ -333,11 +415,24 @@ protected:
 
   /** @brief Callback for octomap updates */
   void octomapUpdateCallback(void);
+
+  /** @brief Get the state of the robot to be used by the octomap monitor for sensor data stamped at \e stamp.
+      Data older than the recorded state history gets the oldest recorded state. Returns an empty pointer if the
+      state at that time is not known. */
+  kinematic_state::KinematicStateConstPtr getSensorState(const ros::Time &stamp) const;
   
   /** @brief Callback for a new attached object msg*/
   void attachObjectCallback(const moveit_msgs::AttachedCollisionObjectConstPtr &obj);
   
-  void getUpdatedFrameTransforms(const kinematic_model::KinematicModelConstPtr &kmodel, std::vector<geometry_msgs::TransformStamped> &transforms);
+  /** @brief Update the transforms of the tracked frames, or of all the frames known to tf if \e all_frames is true */
+  void updateFrameTransformsHelper(bool all_frames);
+
+  /** @brief Look up the tracked frames (or all the frames, if \e all_frames is true) in tf and fill \e transforms with the ones that changed since they were last looked up */
+  void getUpdatedFrameTransforms(const kinematic_model::KinematicModelConstPtr &kmodel, std::vector<geometry_msgs::TransformStamped> &transforms,
+                                 bool all_frames);
+
+  /** @brief Track the frames referenced by a world geometry message */
+  void trackFrames(const moveit_msgs::PlanningSceneWorld &world);
   
   /// The name of this scene monitor
   std::string                           monitor_name_;
@@ -347,6 +442,18 @@ protected:
   planning_scene::PlanningScenePtr      parent_scene_; /// if diffs are monitored, this is the pointer to the parent scene
   boost::shared_mutex                   scene_update_mutex_; /// mutex for stored scene
 
+  // variables for serving snapshots of the maintained scene
+  bool                                  use_scene_snapshots_;
+  bool                                  octomap_in_scene_; /// true if the maintained scene references the octree of octomap_monitor_
+  planning_scene::PlanningSceneConstPtr scene_snapshot_;
+  planning_scene::PlanningSceneConstPtr scene_snapshot_base_; /// the full copy of the scene scene_snapshot_ is a diff of (or scene_snapshot_ itself)
+  unsigned long                         scene_version_; /// incremented every time the maintained scene is updated, except for robot state updates
+  unsigned long                         scene_state_version_; /// incremented every time the robot state of the maintained scene is updated
+  unsigned long                         scene_snapshot_version_; /// the value of scene_version_ scene_snapshot_base_ corresponds to
+  unsigned long                         scene_snapshot_state_version_; /// the value of scene_state_version_ scene_snapshot_ corresponds to
+  boost::mutex                          scene_snapshot_lock_; /// protects the snapshot pointer and the version counters; never held for long
+  boost::mutex                          scene_snapshot_build_lock_; /// ensures only one thread copies the scene at a time
+
   ros::NodeHandle                       nh_;
   ros::NodeHandle                       root_nh_;
   boost::shared_ptr<tf::Transformer>    tf_;
@@ -363,15 +470,32 @@ protected:
   
   // variables for planning scene publishing
   ros::Publisher                        planning_scene_publisher_;
+  ros::Publisher                        compact_planning_scene_publisher_;
+  PlanningSceneEncoder                  scene_encoder_; /// only used by the scene publishing thread
+  volatile bool                         reset_scene_encoder_; /// set when a new subscriber needs a self-contained compact scene
+  ros::Subscriber                       compact_keyframe_request_subscriber_;
+  PlanningSceneDecoder                  scene_decoder_;
+  ros::Publisher                        compact_keyframe_request_publisher_; /// used by the decoder to ask for a complete compact scene
+  ros::WallTime                         last_keyframe_request_;
   boost::scoped_ptr<boost::thread>      publish_planning_scene_;
   double                                publish_planning_scene_frequency_;
   SceneUpdateType                       publish_update_types_;
   SceneUpdateType                       new_scene_update_;
   boost::condition_variable_any         new_scene_update_condition_;
   
+  // variables for publishing the state of the maintained scene as packed joint vectors
+  ros::Publisher                        packed_state_publisher_;
+  boost::scoped_ptr<boost::thread>      publish_packed_state_;
+  bool                                  publish_packed_state_running_; /// set while the packed state publishing thread should run; protected by packed_state_lock_
+  double                                publish_packed_state_frequency_;
+  bool                                  packed_state_update_; /// true if the state changed since it was last published
+  boost::mutex                          packed_state_lock_;
+  boost::condition_variable             packed_state_condition_;
+
   // subscribe to various sources of data
   ros::Subscriber                       planning_scene_subscriber_;
   ros::Subscriber                       planning_scene_world_subscriber_;
+  ros::Subscriber                       packed_state_subscriber_;
 
   boost::scoped_ptr<message_filters::Subscriber<moveit_msgs::CollisionObject> > collision_object_subscriber_; 
   boost::scoped_ptr<tf::MessageFilter<moveit_msgs::CollisionObject> >           collision_object_filter_;
@@ -400,13 +524,94 @@ protected:
 
   planning_models_loader::KinematicModelLoaderPtr kinematics_loader_;
 
+  /** @brief The last transform obtained from tf for a frame the scene depends on */
+  struct TrackedFrame
+  {
+    TrackedFrame(void) : known(false)
+    {
+    }
+    
+    bool          known;
+    ros::Time     stamp;
+    tf::Transform transform;
+  };
+  
+  std::map<std::string, TrackedFrame>   tracked_frames_;
+  boost::mutex                          tracked_frames_lock_;
+
+  /** @brief A world geometry message waiting to be applied to the scene; exactly one of the pointers is set */
+  struct WorldUpdate
+  {
+    moveit_msgs::CollisionObjectConstPtr         object;
+    moveit_msgs::AttachedCollisionObjectConstPtr attached_object;
+    moveit_msgs::CollisionMapConstPtr            map;
+  };
+
+  // world geometry messages are queued by the callbacks and applied in batches by a worker thread
+  std::deque<WorldUpdate>               world_updates_;
+  boost::mutex                          world_updates_lock_;
+  boost::condition_variable             world_updates_condition_;
+  boost::scoped_ptr<boost::thread>      world_update_thread_;
+  bool                                  world_update_thread_running_;
+
+  // the number of state updates waiting for the scene lock; batched geometry updates release the lock while this is
+  // not zero, and wait on the condition for it to drop to zero before taking the lock again, since the lock is not fair
+  unsigned int                          state_updates_pending_;
+  boost::mutex                          state_updates_pending_lock_;
+  boost::condition_variable             state_updates_pending_condition_;
+
+  /** @brief The regions of space affected by one change of the scene geometry */
+  struct GeometryChange
+  {
+    unsigned long                    version;
+    std::vector<Eigen::AlignedBox3d> regions;
+    bool                             known; /// false if the change could not be localized
+  };
+
+  // recent changes of the scene geometry, oldest first
+  std::deque<GeometryChange>            geometry_changes_;
+  unsigned long                         geometry_version_;
+  mutable boost::mutex                  geometry_changes_lock_;
+
 private:
 
+  /** @brief Add a world geometry message to the queue processed by the world update thread */
+  void queueWorldUpdate(const WorldUpdate &update);
+
+  /** @brief Increment the geometry version and remember the regions that changed; NULL means the change is not localized */
+  void recordGeometryChange(const std::vector<Eigen::AlignedBox3d> *regions);
+
+  /** @brief Apply a batch of world geometry messages to the scene, in the order they were received */
+  void processWorldUpdates(const std::deque<WorldUpdate> &updates);
+
+  /** @brief Return true if a state update is waiting for the scene lock */
+  bool isStateUpdatePending(void);
+
+  void worldUpdateThread(void);
+  void startWorldUpdateThread(void);
+  void stopWorldUpdateThread(void);
+
   /** @brief This function is called every time there is a change to the planning scene */
   void processSceneUpdateEvent(SceneUpdateType update_type);
   
   /** @brief */
   void scenePublishingThread(void);
+
+  /** @brief Encode \e msg and publish it on the compact planning scene topic, if anyone listens */
+  void publishCompactPlanningScene(const moveit_msgs::PlanningScene &msg, bool reset_encoder);
+  
+  void onCompactSceneSubscriberConnect(const ros::SingleSubscriberPublisher &pub);
+  
+  /** @brief Callback for subscribers of the compact scene that could not decode it and need a complete scene */
+  void compactKeyframeRequestCallback(const std_msgs::EmptyConstPtr &msg);
+  
+  /** @brief Make the publishing thread send the next compact scene as a complete, self-contained scene */
+  void resetSceneEncoder(void);
+
+  void packedStatePublishingThread(void);
+
+  /** @brief Return true if \e update_type contains updates sent by the planning scene publishing thread */
+  bool isPublishedUpdate(SceneUpdateType update_type) const;
   
   void onStateUpdate(const sensor_msgs::JointStateConstPtr &joint_state);
 
@@ -435,17 +640,17 @@ public:
   
   operator bool() const
   {
-    return planning_scene_monitor_ && planning_scene_monitor_->getPlanningScene();
+    return snapshot_ || (planning_scene_monitor_ && planning_scene_monitor_->getPlanningScene());
   }
 
   operator const planning_scene::PlanningSceneConstPtr&() const
   {
-    return const_cast<const PlanningSceneMonitor*>(planning_scene_monitor_.get())->getPlanningScene();
+    return snapshot_ ? snapshot_ : const_cast<const PlanningSceneMonitor*>(planning_scene_monitor_.get())->getPlanningScene();
   }
 
   const planning_scene::PlanningSceneConstPtr& operator->() const
   {
-    return const_cast<const PlanningSceneMonitor*>(planning_scene_monitor_.get())->getPlanningScene();
+    return snapshot_ ? snapshot_ : const_cast<const PlanningSceneMonitor*>(planning_scene_monitor_.get())->getPlanningScene();
   }
 
 protected:
@@ -459,7 +664,13 @@ protected:
   void initialize(bool read_only)
   {
     if (planning_scene_monitor_)
-      lock_.reset(new SingleUnlock(planning_scene_monitor_.get(), read_only));
+    {
+      // readers of a monitor that serves snapshots get their own immutable copy of the scene, so no locking is needed
+      if (read_only && planning_scene_monitor_->isUsingSceneSnapshots())
+        snapshot_ = planning_scene_monitor_->getPlanningSceneSnapshot();
+      else
+        lock_.reset(new SingleUnlock(planning_scene_monitor_.get(), read_only));
+    }
   }
   
   // we use this struct so that lock/unlock are called only once 
@@ -487,6 +698,7 @@ protected:
   
   PlanningSceneMonitorPtr planning_scene_monitor_;
   boost::shared_ptr<SingleUnlock> lock_;
+  planning_scene::PlanningSceneConstPtr snapshot_;
 };
 
 class LockedPlanningSceneRW : public LockedPlanningSceneRO
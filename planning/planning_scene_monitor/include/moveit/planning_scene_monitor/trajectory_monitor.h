@@ -47,12 +47,15 @@ namespace planning_scene_monitor
 typedef boost::function<void(const kinematic_state::KinematicStateConstPtr &state, const ros::Time &stamp)> TrajectoryStateAddedCallback;
 
 /** @class TrajectoryMonitor
-    @brief Monitors the joint_states topic and tf to record the trajectory of the robot. */
+    @brief Monitors the joint_states topic and tf to record the trajectory of the robot. States are recorded as they
+    are received by the current state monitor, at most at the sampling frequency. The values of each recorded state
+    are stored as a row of doubles (in the order of kinematic_model::KinematicModel::getVariableNames()). */
 class TrajectoryMonitor
 {
 public:
   
   /** @brief Constructor.
+   *  @param sampling_frequency The maximum rate at which states are recorded. If 0, every state update is recorded.
    */
   TrajectoryMonitor(const CurrentStateMonitorConstPtr &state_monitor, double sampling_frequency = 5.0);
   
@@ -73,18 +76,22 @@ public:
   
   void setSamplingFrequency(double sampling_frequency);
   
-  /// Return the current maintained trajectory. This function is not thread safe (hence NOT const), because the trajectory could be modified.
-  const std::vector<kinematic_state::KinematicStateConstPtr>& getTrajectoryStates(void)
-  {
-    return trajectory_states_;
-  }
-
-  /// Return the time stamps for the current maintained trajectory. This function is not thread safe (hence NOT const), because the trajectory could be modified.
-  const std::vector<ros::Time>& getTrajectoryStamps(void)
-  {
-    return trajectory_stamps_;
-  }
+  /// Return the number of recorded states
+  std::size_t getSampleCount(void) const;
+  
+  /// Get the values of the variables for recorded state \e index
+  void getSample(std::size_t index, std::vector<double> &values) const;
+  
+  /** @brief Return the states of the current maintained trajectory.
+      @deprecated The states are no longer stored, so they are constructed on every call; use getSampleCount() and getSample() instead. */
+  std::vector<kinematic_state::KinematicStateConstPtr> getTrajectoryStates(void) const;
+  
+  /// Return the time stamps for the current maintained trajectory. A copy is returned, since the trajectory could be modified.
+  std::vector<ros::Time> getTrajectoryStamps(void) const;
 
+  /** @brief Get the recorded trajectory. If all the joints of the model have one variable, the joint trajectory is filled
+      directly from the recorded values. Otherwise (e.g., for floating or planar joints), a kinematic state is constructed for
+      every recorded sample and the trajectory is computed from those states, which is slower. */
   void getTrajectory(moveit_msgs::RobotTrajectory &trajectory);
   
   void setOnStateAddCallback(const TrajectoryStateAddedCallback &callback)
@@ -96,11 +103,20 @@ private:
   
   void recordStates(void);
   
+  /// Append a state (a row of variable values) to the recorded trajectory
+  void addSample(std::vector<double>::const_iterator values, const ros::Time &stamp);
+  
+  /// Get a pointer to the values of recorded state \e index
+  const double* getSampleValues(std::size_t index) const;
+  
   CurrentStateMonitorConstPtr current_state_monitor_;
   double sampling_frequency_;
+  std::size_t variable_count_;
 
-  std::vector<kinematic_state::KinematicStateConstPtr> trajectory_states_;
+  /* the recorded values are kept in chunks of SAMPLES_PER_CHUNK rows, so recording never copies previous samples */
+  std::vector<boost::shared_ptr<std::vector<double> > > trajectory_chunks_;
   std::vector<ros::Time> trajectory_stamps_;
+  mutable boost::mutex trajectory_lock_;
 
   boost::scoped_ptr<boost::thread> record_states_thread_;
   TrajectoryStateAddedCallback state_add_callback_;
@@ -0,0 +1,104 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#include <moveit/planning_scene_monitor/bounding_boxes.h>
+#include <geometric_shapes/shape_operations.h>
+#include <limits>
+
+Eigen::AlignedBox3d planning_scene_monitor::computeShapeBoundingBox(const shapes::Shape *shape, const Eigen::Affine3d &pose)
+{
+  Eigen::AlignedBox3d box;
+  if (!shape)
+    return box;
+  switch (shape->type)
+  {
+  case shapes::MESH:
+    {
+      const shapes::Mesh *mesh = static_cast<const shapes::Mesh*>(shape);
+      for (unsigned int i = 0 ; i < mesh->vertex_count ; ++i)
+        box.extend(pose * Eigen::Vector3d(mesh->vertices[3 * i], mesh->vertices[3 * i + 1], mesh->vertices[3 * i + 2]));
+    }
+    break;
+  case shapes::SPHERE:
+  case shapes::BOX:
+  case shapes::CYLINDER:
+  case shapes::CONE:
+    {
+      // these shapes are centered at their origin, so the box is the rotated extents around the translation
+      Eigen::Vector3d half = pose.rotation().cwiseAbs() * (shapes::computeShapeExtents(shape) / 2.0);
+      box.extend(pose.translation() - half);
+      box.extend(pose.translation() + half);
+    }
+    break;
+  default:
+    box.extend(Eigen::Vector3d::Constant(-std::numeric_limits<double>::max()));
+    box.extend(Eigen::Vector3d::Constant(std::numeric_limits<double>::max()));
+  }
+  return box;
+}
+
+void planning_scene_monitor::computeRobotBoundingBoxes(const kinematic_state::KinematicState &state, double padding, std::vector<Eigen::AlignedBox3d> &boxes)
+{
+  Eigen::Vector3d pad = Eigen::Vector3d::Constant(padding);
+  const std::vector<std::string> &links = state.getKinematicModel()->getLinkModelNames();
+  for (std::size_t i = 0 ; i < links.size() ; ++i)
+  {
+    const kinematic_state::LinkState *ls = state.getLinkState(links[i]);
+    if (!ls || !ls->getLinkModel()->getShape())
+      continue;
+    Eigen::AlignedBox3d box = computeShapeBoundingBox(ls->getLinkModel()->getShape().get(), ls->getGlobalCollisionBodyTransform());
+    boxes.push_back(Eigen::AlignedBox3d(box.min() - pad, box.max() + pad));
+  }
+
+  std::vector<const kinematic_state::AttachedBody*> attached_bodies;
+  state.getAttachedBodies(attached_bodies);
+  for (std::size_t i = 0 ; i < attached_bodies.size() ; ++i)
+  {
+    const std::vector<shapes::ShapeConstPtr> &shapes = attached_bodies[i]->getShapes();
+    const EigenSTL::vector_Affine3d &poses = attached_bodies[i]->getGlobalCollisionBodyTransforms();
+    for (std::size_t j = 0 ; j < shapes.size() ; ++j)
+    {
+      Eigen::AlignedBox3d box = computeShapeBoundingBox(shapes[j].get(), poses[j]);
+      boxes.push_back(Eigen::AlignedBox3d(box.min() - pad, box.max() + pad));
+    }
+  }
+}
+
+bool planning_scene_monitor::intersectsAny(const Eigen::AlignedBox3d &box, const std::vector<Eigen::AlignedBox3d> &regions)
+{
+  for (std::size_t i = 0 ; i < regions.size() ; ++i)
+    if (box.intersects(regions[i]))
+      return true;
+  return false;
+}
@@ -37,11 +37,49 @@
 #include <moveit/planning_scene_monitor/current_state_monitor.h>
 #include <tf_conversions/tf_eigen.h>
 #include <limits>
+#include <algorithm>
+#include <cmath>
 
 planning_scene_monitor::CurrentStateMonitor::CurrentStateMonitor(const kinematic_model::KinematicModelConstPtr &kmodel, const boost::shared_ptr<tf::Transformer> &tf) :
-  tf_(tf), kmodel_(kmodel), kstate_(kmodel), root_(kstate_.getJointState(kmodel->getRoot()->getName())), state_monitor_started_(false), error_(std::numeric_limits<float>::epsilon())
+  tf_(tf), kmodel_(kmodel), kstate_(kmodel), root_(kstate_.getJointState(kmodel->getRoot()->getName())), last_layout_(0), state_monitor_started_(false), error_(std::numeric_limits<float>::epsilon()),
+  history_start_(0), history_count_(0)
 {
   kstate_.setToDefaultValues();
+  kstate_.getStateValues(state_values_);
+  setStateHistoryLength(1024);
+  
+  // flatten the information needed for each variable when processing joint states
+  const std::vector<std::string> &dof = kmodel_->getVariableNames();
+  const std::map<std::string, std::pair<double, double> > &bounds = kmodel_->getAllVariableBounds();
+  variable_time_.resize(dof.size());
+  variable_known_.resize(dof.size(), false);
+  variable_passive_.resize(dof.size(), false);
+  variable_wraps_.resize(dof.size(), false);
+  variable_lower_.resize(dof.size(), -std::numeric_limits<double>::infinity());
+  variable_upper_.resize(dof.size(), std::numeric_limits<double>::infinity());
+  for (std::size_t i = 0 ; i < dof.size() ; ++i)
+  {
+    variable_passive_[i] = isPassiveDOF(dof[i]);
+    
+    // continuous joints wrap, so we don't modify them (even if they are outside bounds!)
+    const kinematic_model::JointModel* jm = kmodel_->hasJointModel(dof[i]) ? kmodel_->getJointModel(dof[i]) : NULL;
+    if (jm && jm->getType() == kinematic_model::JointModel::REVOLUTE)
+      variable_wraps_[i] = static_cast<const kinematic_model::RevoluteJointModel*>(jm)->isContinuous();
+    
+    std::map<std::string, std::pair<double, double> >::const_iterator bi = bounds.find(dof[i]);
+    if (bi != bounds.end())
+    {
+      variable_lower_[i] = bi->second.first;
+      variable_upper_[i] = bi->second.second;
+    }
+  }
+  
+  const std::vector<std::string> &root_vars = root_->getJointModel()->getVariableNames();
+  for (std::size_t j = 0 ; j < root_vars.size() ; ++j)
+  {
+    std::vector<std::string>::const_iterator it = std::find(dof.begin(), dof.end(), root_vars[j]);
+    root_variable_index_.push_back(it == dof.end() ? -1 : it - dof.begin());
+  }
 }
 
 planning_scene_monitor::CurrentStateMonitor::~CurrentStateMonitor(void)
@@ -77,6 +115,174 @@ std::map<std::string, double> planning_scene_monitor::CurrentStateMonitor::getCu
   return m;
 }
 
+ros::Time planning_scene_monitor::CurrentStateMonitor::getCurrentStateVector(std::vector<double> &values) const
+{
+  {
+    boost::mutex::scoped_lock hlock(history_lock_);
+    if (history_count_ > 0)
+    {
+      std::size_t n = state_values_.size();
+      std::size_t last = (history_start_ + history_count_ - 1) % history_time_.size();
+      values.assign(history_values_.begin() + last * n, history_values_.begin() + (last + 1) * n);
+      return history_time_[last];
+    }
+  }
+  
+  // nothing was received yet; these are the default values
+  boost::mutex::scoped_lock slock(state_update_lock_);
+  values = state_values_;
+  return ros::Time();
+}
+
+void planning_scene_monitor::CurrentStateMonitor::setStateHistoryLength(std::size_t length)
+{
+  boost::mutex::scoped_lock slock(history_lock_);
+  length = std::max<std::size_t>(length, 1);
+  history_values_.resize(length * state_values_.size());
+  history_time_.resize(length);
+  history_start_ = 0;
+  history_count_ = 0;
+}
+
+void planning_scene_monitor::CurrentStateMonitor::recordStateHistory(const ros::Time &stamp)
+{
+  boost::mutex::scoped_lock slock(history_lock_);
+  const std::size_t cap = history_time_.size();
+  const std::size_t n = state_values_.size();
+  std::size_t slot;
+  if (history_count_ > 0 && stamp <= history_time_[(history_start_ + history_count_ - 1) % cap])
+    // out of order (e.g., joint states from multiple publishers); the newest record gets the merged values, so times stay sorted
+    slot = (history_start_ + history_count_ - 1) % cap;
+  else
+  {
+    if (history_count_ < cap)
+      slot = (history_start_ + history_count_++) % cap;
+    else
+    {
+      // the ring is full, overwrite the oldest record
+      slot = history_start_;
+      history_start_ = (history_start_ + 1) % cap;
+    }
+    history_time_[slot] = stamp;
+  }
+  std::copy(state_values_.begin(), state_values_.end(), history_values_.begin() + slot * n);
+  history_condition_.notify_all();
+}
+
+bool planning_scene_monitor::CurrentStateMonitor::waitForStateUpdate(const ros::Time &t, const ros::WallDuration &timeout) const
+{
+  boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(timeout.toNSec() / 1000);
+  boost::mutex::scoped_lock hlock(history_lock_);
+  while (history_count_ == 0 || history_time_[(history_start_ + history_count_ - 1) % history_time_.size()] <= t)
+    if (!history_condition_.timed_wait(hlock, deadline))
+      return history_count_ > 0 && history_time_[(history_start_ + history_count_ - 1) % history_time_.size()] > t;
+  return true;
+}
+
+std::size_t planning_scene_monitor::CurrentStateMonitor::getStateHistory(const ros::Time &t, std::vector<double> &values, std::vector<ros::Time> &stamps) const
+{
+  boost::mutex::scoped_lock hlock(history_lock_);
+  const std::size_t cap = history_time_.size();
+  const std::size_t n = state_values_.size();
+  
+  // records are sorted by time; find the first one later than t, searching from the most recent one
+  std::size_t first = history_count_;
+  while (first > 0 && history_time_[(history_start_ + first - 1) % cap] > t)
+    --first;
+  
+  for (std::size_t i = first ; i < history_count_ ; ++i)
+  {
+    std::size_t slot = (history_start_ + i) % cap;
+    values.insert(values.end(), history_values_.begin() + slot * n, history_values_.begin() + (slot + 1) * n);
+    stamps.push_back(history_time_[slot]);
+  }
+  return history_count_ - first;
+}
+
+bool planning_scene_monitor::CurrentStateMonitor::getStateVectorAtTime(const ros::Time &t, std::vector<double> &values) const
+{
+  boost::mutex::scoped_lock slock(history_lock_);
+  if (history_count_ == 0)
+    return false;
+  const std::size_t cap = history_time_.size();
+  const std::size_t n = state_values_.size();
+  
+  // binary search for the first record later than t
+  std::size_t lo = 0, hi = history_count_;
+  while (lo < hi)
+  {
+    std::size_t mid = (lo + hi) / 2;
+    if (history_time_[(history_start_ + mid) % cap] <= t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+  {
+    // no state was recorded at all before t
+    if (history_count_ < cap)
+      return false;
+    // the state at t was recorded but has been dropped from the ring; the oldest record is the closest one kept
+    ROS_WARN_THROTTLE(1.0, "Requested robot state at time %.3lf is older than the recorded history (oldest state is at %.3lf); using the oldest state",
+                      t.toSec(), history_time_[history_start_].toSec());
+    std::vector<double>::const_iterator oldest = history_values_.begin() + history_start_ * n;
+    values.assign(oldest, oldest + n);
+    return true;
+  }
+  
+  std::size_t before = (history_start_ + lo - 1) % cap;
+  std::vector<double>::const_iterator a = history_values_.begin() + before * n;
+  if (lo == history_count_)
+  {
+    values.assign(a, a + n);
+    return true;
+  }
+  
+  std::size_t after = (history_start_ + lo) % cap;
+  std::vector<double>::const_iterator b = history_values_.begin() + after * n;
+  double alpha = (t - history_time_[before]).toSec() / (history_time_[after] - history_time_[before]).toSec();
+  values.resize(n);
+  for (std::size_t i = 0 ; i < n ; ++i)
+  {
+    double d = b[i] - a[i];
+    // continuous joints move along the shortest arc
+    if (variable_wraps_[i])
+    {
+      d = fmod(d + M_PI, 2.0 * M_PI);
+      if (d < 0.0)
+        d += 2.0 * M_PI;
+      d -= M_PI;
+    }
+    values[i] = a[i] + alpha * d;
+  }
+  
+  // the root transform (e.g., a quaternion for floating joints) is not interpolated; the closest record is used
+  const std::vector<double>::const_iterator &closest = alpha < 0.5 ? a : b;
+  for (std::size_t j = 0 ; j < root_variable_index_.size() ; ++j)
+    if (root_variable_index_[j] >= 0)
+      values[root_variable_index_[j]] = closest[root_variable_index_[j]];
+  return true;
+}
+
+bool planning_scene_monitor::CurrentStateMonitor::getStateAtTime(const ros::Time &t, kinematic_state::KinematicState &state) const
+{
+  std::vector<double> values;
+  if (!getStateVectorAtTime(t, values))
+    return false;
+  state.setStateValues(values);
+  return true;
+}
+
+kinematic_state::KinematicStatePtr planning_scene_monitor::CurrentStateMonitor::getStateAtTime(const ros::Time &t) const
+{
+  std::vector<double> values;
+  if (!getStateVectorAtTime(t, values))
+    return kinematic_state::KinematicStatePtr();
+  kinematic_state::KinematicStatePtr state(new kinematic_state::KinematicState(kmodel_));
+  state->setStateValues(values);
+  return state;
+}
+
 void planning_scene_monitor::CurrentStateMonitor::setOnStateUpdateCallback(const JointStateUpdateCallback &callback)
 {
   on_state_update_callback_ = callback;
@@ -86,7 +292,12 @@ void planning_scene_monitor::CurrentStateMonitor::startStateMonitor(const std::s
 {
   if (!state_monitor_started_ && kmodel_)
   {
-    joint_time_.clear();
+    {
+      boost::mutex::scoped_lock slock(state_update_lock_);
+      std::fill(variable_known_.begin(), variable_known_.end(), false);
+      boost::mutex::scoped_lock hlock(history_lock_);
+      history_start_ = history_count_ = 0;
+    }
     if (joint_states_topic.empty())
       ROS_ERROR("The joint states topic cannot be an empty string");
     else
@@ -147,13 +358,10 @@ bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(void) const
   const std::vector<std::string> &dof = kmodel_->getVariableNames();
   boost::mutex::scoped_lock slock(state_update_lock_);
   for (std::size_t i = 0 ; i < dof.size() ; ++i)
-    if (joint_time_.find(dof[i]) == joint_time_.end())
+    if (!variable_known_[i] && !variable_passive_[i])
     {
-      if (!isPassiveDOF(dof[i]))
-      {
-        ROS_DEBUG("Joint variable '%s' has never been updated", dof[i].c_str());
-        result = false;
-      }
+      ROS_DEBUG("Joint variable '%s' has never been updated", dof[i].c_str());
+      result = false;
     }
   return result;
 }
@@ -164,44 +372,21 @@ bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(std::vector<
   const std::vector<std::string> &dof = kmodel_->getVariableNames();
   boost::mutex::scoped_lock slock(state_update_lock_);
   for (std::size_t i = 0 ; i < dof.size() ; ++i)
-    if (joint_time_.find(dof[i]) == joint_time_.end())   
-      if (!isPassiveDOF(dof[i]))
-      {
-        ROS_DEBUG("Joint variable '%s' has never been updated", dof[i].c_str());
-        missing_states.push_back(dof[i]);
-        result = false;
-      }
-  return result;
-}
-
-bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(const ros::Duration &age) const
-{
-  bool result = true;
-  const std::vector<std::string> &dof = kmodel_->getVariableNames();
-  ros::Time now = ros::Time::now();
-  ros::Time old = now - age;
-  boost::mutex::scoped_lock slock(state_update_lock_);
-  for (std::size_t i = 0 ; i < dof.size() ; ++i)
-  {
-    if (isPassiveDOF(dof[i]))
-      continue;
-    std::map<std::string, ros::Time>::const_iterator it = joint_time_.find(dof[i]);    
-    if (it == joint_time_.end())
+    if (!variable_known_[i] && !variable_passive_[i])
     {
       ROS_DEBUG("Joint variable '%s' has never been updated", dof[i].c_str());
+      missing_states.push_back(dof[i]);
       result = false;
     }
-    else
-      if (it->second < old)
-      {
-        ROS_DEBUG("Joint variable '%s' was last updated %0.3lf seconds ago (older than the allowed %0.3lf seconds)",
-                  dof[i].c_str(), (now - it->second).toSec(), age.toSec());
-        result = false;
-      }
-  }
   return result;
 }
 
+bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(const ros::Duration &age) const
+{
+  std::vector<std::string> missing_states;
+  return haveCompleteState(age, missing_states);
+}
+
 bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(const ros::Duration &age,
                                                                     std::vector<std::string> &missing_states) const
 {
@@ -212,20 +397,19 @@ bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(const ros::D
   boost::mutex::scoped_lock slock(state_update_lock_);
   for (std::size_t i = 0 ; i < dof.size() ; ++i)
   {  
-    if (isPassiveDOF(dof[i]))
+    if (variable_passive_[i])
       continue;
-    std::map<std::string, ros::Time>::const_iterator it = joint_time_.find(dof[i]);
-    if (it == joint_time_.end())
+    if (!variable_known_[i])
     {
       ROS_DEBUG("Joint variable '%s' has never been updated", dof[i].c_str());
       missing_states.push_back(dof[i]);
       result = false;
     }
     else
-      if (it->second < old)
+      if (variable_time_[i] < old)
       {
         ROS_DEBUG("Joint variable '%s' was last updated %0.3lf seconds ago (older than the allowed %0.3lf seconds)",
-                  dof[i].c_str(), (now - it->second).toSec(), age.toSec());
+                  dof[i].c_str(), (now - variable_time_[i]).toSec(), age.toSec());
         missing_states.push_back(dof[i]);
         result = false;
       }
@@ -233,6 +417,35 @@ bool planning_scene_monitor::CurrentStateMonitor::haveCompleteState(const ros::D
   return result;
 }
 
+const planning_scene_monitor::CurrentStateMonitor::JointStateLayout&
+planning_scene_monitor::CurrentStateMonitor::getJointStateLayout(const std::vector<std::string> &names)
+{
+  // publishers almost always use the same order of names, so the last used layout is checked first
+  if (last_layout_ < layouts_.size() && layouts_[last_layout_].names == names)
+    return layouts_[last_layout_];
+  for (std::size_t i = 0 ; i < layouts_.size() ; ++i)
+    if (layouts_[i].names == names)
+    {
+      last_layout_ = i;
+      return layouts_[i];
+    }
+  
+  const std::vector<std::string> &dof = kmodel_->getVariableNames();
+  JointStateLayout layout;
+  layout.names = names;
+  layout.index.resize(names.size(), -1);
+  for (std::size_t i = 0 ; i < names.size() ; ++i)
+  {
+    std::vector<std::string>::const_iterator it = std::find(dof.begin(), dof.end(), names[i]);
+    if (it != dof.end())
+      layout.index[i] = it - dof.begin();
+  }
+  ROS_DEBUG("Learned joint state layout with %u names (%u layouts known)", (unsigned int)names.size(), (unsigned int)layouts_.size() + 1);
+  layouts_.push_back(layout);
+  last_layout_ = layouts_.size() - 1;
+  return layouts_.back();
+}
+
 void planning_scene_monitor::CurrentStateMonitor::jointStateCallback(const sensor_msgs::JointStateConstPtr &joint_state)
 {
   if (joint_state->name.size() != joint_state->position.size())
@@ -241,35 +454,15 @@ void planning_scene_monitor::CurrentStateMonitor::jointStateCallback(const senso
     return;
   }
   
-  // read the received values, and update their time stamps
-  std::size_t n = joint_state->name.size();
-  std::map<std::string, double> joint_state_map;
-  const std::map<std::string, std::pair<double, double> > &bounds = kmodel_->getAllVariableBounds();
-  for (std::size_t i = 0 ; i < n ; ++i)
-  {    
-    joint_state_map[joint_state->name[i]] = joint_state->position[i];
-    joint_time_[joint_state->name[i]] = joint_state->header.stamp;
-    
-    // continuous joints wrap, so we don't modify them (even if they are outside bounds!)
-    const kinematic_model::JointModel* jm = kmodel_->getJointModel(joint_state->name[i]);
-    if (jm && jm->getType() == kinematic_model::JointModel::REVOLUTE)
-      if (static_cast<const kinematic_model::RevoluteJointModel*>(jm)->isContinuous())
-        continue;
-    
-    std::map<std::string, std::pair<double, double> >::const_iterator bi = bounds.find(joint_state->name[i]);
-    // if the read variable is 'almost' within bounds (up to error_ difference), then consider it to be within bounds
-    if (bi != bounds.end())
-    {
-      if (joint_state->position[i] < bi->second.first && joint_state->position[i] >= bi->second.first - error_)
-        joint_state_map[joint_state->name[i]] = bi->second.first;
-      else
-        if (joint_state->position[i] > bi->second.second && joint_state->position[i] <= bi->second.second + error_)
-          joint_state_map[joint_state->name[i]] = bi->second.second;
-    }
-  }
-  bool set_map_values = true;
+  // read the received values directly into the state vector, using the cached index of each name
+  const JointStateLayout &layout = getJointStateLayout(joint_state->name);
+  const std::size_t n = joint_state->name.size();
+  const ros::Time &stamp = joint_state->header.stamp;
   
   // read root transform, if needed
+  bool have_root_transform = false;
+  Eigen::Affine3d root_transf;
+  ros::Time root_time;
   if (tf_ && (root_->getType() == kinematic_model::JointModel::PLANAR ||
               root_->getType() == kinematic_model::JointModel::FLOATING))
   {
@@ -277,15 +470,14 @@ void planning_scene_monitor::CurrentStateMonitor::jointStateCallback(const senso
     const std::string &parent_frame = kmodel_->getModelFrame();
     
     std::string err;
-    ros::Time tm;
     tf::StampedTransform transf;
-    bool ok = false;
-    if (tf_->getLatestCommonTime(parent_frame, child_frame, tm, &err) == tf::NO_ERROR)
+    if (tf_->getLatestCommonTime(parent_frame, child_frame, root_time, &err) == tf::NO_ERROR)
     {
       try
       {
-        tf_->lookupTransform(parent_frame, child_frame, tm, transf);
-        ok = true;
+        tf_->lookupTransform(parent_frame, child_frame, root_time, transf);
+        tf::transformTFToEigen(transf, root_transf);
+        have_root_transform = true;
       }
       catch(tf::TransformException& ex)
       {
@@ -294,26 +486,47 @@ void planning_scene_monitor::CurrentStateMonitor::jointStateCallback(const senso
     }
     else
       ROS_DEBUG_THROTTLE(1, "Unable to lookup transform from %s to %s: no common time.", parent_frame.c_str(), child_frame.c_str());
-    if (ok)
-    {
-      const std::vector<std::string> &vars = root_->getJointModel()->getVariableNames();
-      for (std::size_t j = 0; j < vars.size() ; ++j)
-        joint_time_[vars[j]] = tm;
-      set_map_values = false;
-      Eigen::Affine3d eigen_transf;
-      tf::transformTFToEigen(transf, eigen_transf);
-      boost::mutex::scoped_lock slock(state_update_lock_);
-      root_->setVariableValues(eigen_transf);
-      kstate_.setStateValues(joint_state_map); 
-      current_state_time_ = joint_state->header.stamp;
-    }
   }
   
-  if (set_map_values)
   {
     boost::mutex::scoped_lock slock(state_update_lock_);
-    kstate_.setStateValues(joint_state_map);
-    current_state_time_ = joint_state->header.stamp;
+    for (std::size_t i = 0 ; i < n ; ++i)
+    {
+      int k = layout.index[i];
+      if (k < 0)
+        continue;
+      double v = joint_state->position[i];
+      
+      // if the read variable is 'almost' within bounds (up to error_ difference), then consider it to be within bounds
+      if (!variable_wraps_[k])
+      {
+        if (v < variable_lower_[k] && v >= variable_lower_[k] - error_)
+          v = variable_lower_[k];
+        else
+          if (v > variable_upper_[k] && v <= variable_upper_[k] + error_)
+            v = variable_upper_[k];
+      }
+      state_values_[k] = v;
+      variable_time_[k] = stamp;
+      variable_known_[k] = true;
+    }
+    
+    if (have_root_transform)
+    {
+      root_->setVariableValues(root_transf);
+      const std::vector<double> &root_values = root_->getVariableValues();
+      for (std::size_t j = 0 ; j < root_variable_index_.size() && j < root_values.size() ; ++j)
+        if (root_variable_index_[j] >= 0)
+        {
+          state_values_[root_variable_index_[j]] = root_values[j];
+          variable_time_[root_variable_index_[j]] = root_time;
+          variable_known_[root_variable_index_[j]] = true;
+        }
+    }
+    
+    recordStateHistory(stamp);
+    kstate_.setStateValues(state_values_);
+    current_state_time_ = stamp;
   }
   
   // callback, if needed
@@ -0,0 +1,445 @@
+/*********************************************************************
+* Software License Agreement (BSD License)
+*
+*  Copyright (c) 2012, Willow Garage, Inc.
+*  All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*   * Redistributions of source code must retain the above copyright
+*     notice, this list of conditions and the following disclaimer.
+*   * Redistributions in binary form must reproduce the above
+*     copyright notice, this list of conditions and the following
+*     disclaimer in the documentation and/or other materials provided
+*     with the distribution.
+*   * Neither the name of the Willow Garage nor the names of its
+*     contributors may be used to endorse or promote products derived
+*     from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+*  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+*  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+*  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+*  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+*  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+*  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+*  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+*  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+*  POSSIBILITY OF SUCH DAMAGE.
+*********************************************************************/
+
+#include <moveit/planning_scene_monitor/planning_scene_codec.h>
+#include <ros/serialization.h>
+#include <ros/console.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cstring>
+
+// Layout of an encoded message:
+//   uint8  format version
+//   uint8  flags (FLAG_COMPRESSED, FLAG_KEYFRAME)
+//   uint32 sequence number of the message
+//   uint32 sequence number of the message this one builds on (ignored for keyframes)
+//   uint32 size of the uncompressed payload
+//   the payload, zlib compressed if FLAG_COMPRESSED is set
+//
+// Layout of the payload:
+//   uint32 size of the serialized message, followed by the serialized moveit_msgs::PlanningScene
+//   uint32 number of meshes in the message, followed by (uint64 mesh id, uint8 body included) for each of them
+//   uint8  octomap mode; for OCTOMAP_DELTA, uint32 prefix and uint32 suffix lengths taken from the previous octomap
+//
+// The octomap delta only skips the bytes at the start and at the end of the serialized tree that did not change; the
+// serialization of an octree is depth first, so a change in one cell usually shifts all the bytes that follow it.
+//
+// Values are stored in host byte order, like the ROS serialization itself.
+
+namespace planning_scene_monitor
+{
+namespace
+{
+
+static const uint8_t FORMAT_VERSION = 2;
+static const uint8_t FLAG_COMPRESSED = 1;
+static const uint8_t FLAG_KEYFRAME = 2;
+static const uint8_t OCTOMAP_AS_IS = 0;
+static const uint8_t OCTOMAP_DELTA = 1;
+static const std::size_t HEADER_SIZE = 2 + 3 * sizeof(uint32_t);
+static const uint32_t MAX_PAYLOAD_SIZE = 1 << 29;
+
+template<typename T>
+void append(std::vector<uint8_t> &buffer, const T &value)
+{
+  std::size_t offset = buffer.size();
+  buffer.resize(offset + sizeof(T));
+  memcpy(&buffer[offset], &value, sizeof(T));
+}
+
+class Reader
+{
+public:
+
+  Reader(const uint8_t *data, std::size_t size) : data_(data), size_(size), pos_(0)
+  {
+  }
+
+  template<typename T>
+  bool read(T &value)
+  {
+    if (pos_ + sizeof(T) > size_)
+      return false;
+    memcpy(&value, data_ + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  const uint8_t* skip(std::size_t bytes)
+  {
+    if (pos_ + bytes > size_)
+      return NULL;
+    const uint8_t *r = data_ + pos_;
+    pos_ += bytes;
+    return r;
+  }
+
+private:
+  const uint8_t *data_;
+  std::size_t    size_;
+  std::size_t    pos_;
+};
+
+// all the meshes in a scene message, in a fixed order known to both the encoder and the decoder
+void getMeshes(moveit_msgs::PlanningScene &scene, std::vector<shape_msgs::Mesh*> &meshes)
+{
+  for (std::size_t i = 0 ; i < scene.world.collision_objects.size() ; ++i)
+    for (std::size_t j = 0 ; j < scene.world.collision_objects[i].meshes.size() ; ++j)
+      meshes.push_back(&scene.world.collision_objects[i].meshes[j]);
+  for (std::size_t i = 0 ; i < scene.robot_state.attached_collision_objects.size() ; ++i)
+    for (std::size_t j = 0 ; j < scene.robot_state.attached_collision_objects[i].object.meshes.size() ; ++j)
+      meshes.push_back(&scene.robot_state.attached_collision_objects[i].object.meshes[j]);
+}
+
+// FNV-1a over the content of the mesh
+uint64_t hashMesh(const shape_msgs::Mesh &mesh)
+{
+  uint64_t h = 14695981039346656037ULL;
+  std::vector<uint8_t> bytes;
+  append(bytes, (uint32_t)mesh.vertices.size());
+  append(bytes, (uint32_t)mesh.triangles.size());
+  for (std::size_t i = 0 ; i < mesh.vertices.size() ; ++i)
+  {
+    append(bytes, mesh.vertices[i].x);
+    append(bytes, mesh.vertices[i].y);
+    append(bytes, mesh.vertices[i].z);
+  }
+  for (std::size_t i = 0 ; i < mesh.triangles.size() ; ++i)
+    for (int k = 0 ; k < 3 ; ++k)
+      append(bytes, mesh.triangles[i].vertex_indices[k]);
+  for (std::size_t i = 0 ; i < bytes.size() ; ++i)
+  {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+bool isEmpty(const shape_msgs::Mesh &mesh)
+{
+  return mesh.vertices.empty() && mesh.triangles.empty();
+}
+
+}
+}
+
+planning_scene_monitor::PlanningSceneEncoder::PlanningSceneEncoder(bool compress) :
+  compress_(compress), sequence_(0), keyframe_(true), have_octomap_(false)
+{
+}
+
+void planning_scene_monitor::PlanningSceneEncoder::reset(void)
+{
+  keyframe_ = true;
+  sent_meshes_.clear();
+  sent_octomap_.clear();
+  have_octomap_ = false;
+}
+
+void planning_scene_monitor::PlanningSceneEncoder::encode(const moveit_msgs::PlanningScene &scene, std::vector<uint8_t> &data)
+{
+  moveit_msgs::PlanningScene msg(scene);
+
+  // replace the meshes the decoder already has by their ids
+  std::vector<shape_msgs::Mesh*> meshes;
+  getMeshes(msg, meshes);
+  std::vector<uint8_t> mesh_table;
+  std::set<uint64_t> present;
+  for (std::size_t i = 0 ; i < meshes.size() ; ++i)
+  {
+    uint64_t id = hashMesh(*meshes[i]);
+    bool send_body = isEmpty(*meshes[i]) || sent_meshes_.find(id) == sent_meshes_.end();
+    if (send_body)
+      sent_meshes_.insert(id);
+    else
+      *meshes[i] = shape_msgs::Mesh();
+    present.insert(id);
+    append(mesh_table, id);
+    append(mesh_table, (uint8_t)(send_body ? 1 : 0));
+  }
+  // a complete scene defines the set of meshes both ends keep; the decoder does the same
+  if (!msg.is_diff)
+    sent_meshes_.swap(present);
+
+  // send only the bytes of the octomap that differ from the previously sent one
+  uint8_t octomap_mode = OCTOMAP_AS_IS;
+  uint32_t prefix = 0, suffix = 0;
+  std::vector<int8_t> &octomap = msg.world.octomap.octomap.data;
+  if (!octomap.empty())
+  {
+    if (have_octomap_)
+    {
+      std::size_t n = std::min(octomap.size(), sent_octomap_.size());
+      while (prefix < n && octomap[prefix] == sent_octomap_[prefix])
+        ++prefix;
+      while (suffix < n - prefix && octomap[octomap.size() - 1 - suffix] == sent_octomap_[sent_octomap_.size() - 1 - suffix])
+        ++suffix;
+      octomap_mode = OCTOMAP_DELTA;
+    }
+    sent_octomap_ = octomap;
+    have_octomap_ = true;
+    if (octomap_mode == OCTOMAP_DELTA)
+      octomap = std::vector<int8_t>(sent_octomap_.begin() + prefix, sent_octomap_.end() - suffix);
+  }
+
+  // assemble the payload
+  std::vector<uint8_t> payload;
+  uint32_t msg_size = ros::serialization::serializationLength(msg);
+  append(payload, msg_size);
+  std::size_t offset = payload.size();
+  payload.resize(offset + msg_size);
+  ros::serialization::OStream stream(&payload[offset], msg_size);
+  ros::serialization::serialize(stream, msg);
+  append(payload, (uint32_t)meshes.size());
+  payload.insert(payload.end(), mesh_table.begin(), mesh_table.end());
+  append(payload, octomap_mode);
+  if (octomap_mode == OCTOMAP_DELTA)
+  {
+    append(payload, prefix);
+    append(payload, suffix);
+  }
+
+  uint8_t flags = keyframe_ ? FLAG_KEYFRAME : 0;
+  keyframe_ = false;
+  uint32_t base = sequence_++;
+  std::vector<uint8_t> compressed;
+  if (compress_)
+  {
+    uLongf compressed_size = compressBound(payload.size());
+    compressed.resize(compressed_size);
+    if (compress2(&compressed[0], &compressed_size, &payload[0], payload.size(), Z_DEFAULT_COMPRESSION) == Z_OK &&
+        compressed_size < payload.size())
+    {
+      compressed.resize(compressed_size);
+      flags |= FLAG_COMPRESSED;
+    }
+  }
+  const std::vector<uint8_t> &body = (flags & FLAG_COMPRESSED) ? compressed : payload;
+  
+  data.clear();
+  data.reserve(HEADER_SIZE + body.size());
+  append(data, FORMAT_VERSION);
+  append(data, flags);
+  append(data, sequence_);
+  append(data, base);
+  append(data, (uint32_t)payload.size());
+  data.insert(data.end(), body.begin(), body.end());
+}
+
+planning_scene_monitor::PlanningSceneDecoder::PlanningSceneDecoder(void) :
+  synchronized_(false), sequence_(0), needs_keyframe_(false), have_octomap_(false)
+{
+}
+
+void planning_scene_monitor::PlanningSceneDecoder::reset(void)
+{
+  synchronized_ = false;
+  needs_keyframe_ = false;
+  meshes_.clear();
+  octomap_.clear();
+  have_octomap_ = false;
+}
+
+bool planning_scene_monitor::PlanningSceneDecoder::decode(const std::vector<uint8_t> &data, moveit_msgs::PlanningScene &scene)
+{
+  Reader header(data.empty() ? NULL : &data[0], data.size());
+  uint8_t version, flags;
+  uint32_t sequence, base, payload_size;
+  if (!header.read(version))
+  {
+    ROS_ERROR("Encoded planning scene is truncated");
+    return false;
+  }
+  if (version != FORMAT_VERSION)
+  {
+    ROS_ERROR("Unsupported encoding version for planning scene: %u", (unsigned int)version);
+    return false;
+  }
+  if (!header.read(flags) || !header.read(sequence) || !header.read(base) || !header.read(payload_size))
+  {
+    ROS_ERROR("Encoded planning scene is truncated");
+    return false;
+  }
+  
+  // the meshes and the octomap of anything but a keyframe are relative to the message with sequence number base
+  bool keyframe = flags & FLAG_KEYFRAME;
+  if (!keyframe && (!synchronized_ || base != sequence_))
+  {
+    if (!needs_keyframe_)
+    {
+      if (synchronized_)
+        ROS_WARN("Encoded planning scene %u builds on scene %u, but the last decoded scene is %u. Waiting for a complete scene.",
+                 sequence, base, sequence_);
+      else
+        ROS_WARN("Encoded planning scene %u is not a complete scene. Waiting for a complete scene.", sequence);
+    }
+    needs_keyframe_ = true;
+    return false;
+  }
+  if (payload_size > MAX_PAYLOAD_SIZE)
+  {
+    ROS_ERROR("Encoded planning scene claims an unreasonable size (%u bytes)", payload_size);
+    return false;
+  }
+
+  std::vector<uint8_t> uncompressed;
+  const uint8_t *payload = data.empty() ? NULL : &data[0] + HEADER_SIZE;
+  if (flags & FLAG_COMPRESSED)
+  {
+    uncompressed.resize(payload_size);
+    uLongf size = payload_size;
+    if (payload_size == 0 || uncompress(&uncompressed[0], &size, payload, data.size() - HEADER_SIZE) != Z_OK || size != payload_size)
+    {
+      ROS_ERROR("Unable to decompress planning scene");
+      return false;
+    }
+    payload = &uncompressed[0];
+  }
+  else
+    if (data.size() - HEADER_SIZE != payload_size)
+    {
+      ROS_ERROR("Encoded planning scene is truncated");
+      return false;
+    }
+
+  Reader reader(payload, payload_size);
+  uint32_t msg_size;
+  const uint8_t *msg_data = NULL;
+  if (!reader.read(msg_size) || !(msg_data = reader.skip(msg_size)))
+  {
+    ROS_ERROR("Encoded planning scene is truncated");
+    return false;
+  }
+  moveit_msgs::PlanningScene msg;
+  try
+  {
+    ros::serialization::IStream stream(const_cast<uint8_t*>(msg_data), msg_size);
+    ros::serialization::deserialize(stream, msg);
+  }
+  catch (ros::Exception &ex)
+  {
+    ROS_ERROR("Unable to deserialize planning scene: %s", ex.what());
+    return false;
+  }
+
+  // a keyframe does not depend on what was decoded before
+  std::map<uint64_t, shape_msgs::Mesh> no_meshes;
+  const std::map<uint64_t, shape_msgs::Mesh> &known_meshes = keyframe ? no_meshes : meshes_;
+  bool have_octomap = have_octomap_ && !keyframe;
+
+  // read the mesh table and check all referenced meshes are known before changing anything
+  std::vector<shape_msgs::Mesh*> meshes;
+  getMeshes(msg, meshes);
+  uint32_t mesh_count;
+  if (!reader.read(mesh_count) || mesh_count != meshes.size())
+  {
+    ROS_ERROR("Encoded planning scene has an inconsistent mesh table");
+    return false;
+  }
+  std::vector<uint64_t> ids(mesh_count);
+  std::vector<uint8_t> has_body(mesh_count);
+  std::set<uint64_t> received;
+  for (uint32_t i = 0 ; i < mesh_count ; ++i)
+  {
+    if (!reader.read(ids[i]) || !reader.read(has_body[i]))
+    {
+      ROS_ERROR("Encoded planning scene is truncated");
+      return false;
+    }
+    if (has_body[i])
+      received.insert(ids[i]);
+    else
+      if (received.find(ids[i]) == received.end() && known_meshes.find(ids[i]) == known_meshes.end())
+      {
+        ROS_ERROR("Encoded planning scene references an unknown mesh");
+        return false;
+      }
+  }
+
+  uint8_t octomap_mode;
+  uint32_t prefix = 0, suffix = 0;
+  if (!reader.read(octomap_mode) || (octomap_mode == OCTOMAP_DELTA && (!reader.read(prefix) || !reader.read(suffix))))
+  {
+    ROS_ERROR("Encoded planning scene is truncated");
+    return false;
+  }
+  if (octomap_mode == OCTOMAP_DELTA && (!have_octomap || (std::size_t)prefix + suffix > octomap_.size()))
+  {
+    ROS_ERROR("Encoded planning scene references an unknown octomap");
+    return false;
+  }
+
+  // everything is consistent; restore the meshes and the octomap
+  if (keyframe)
+  {
+    meshes_.clear();
+    octomap_.clear();
+    have_octomap_ = false;
+  }
+  for (uint32_t i = 0 ; i < mesh_count ; ++i)
+    if (has_body[i])
+      meshes_[ids[i]] = *meshes[i];
+    else
+      *meshes[i] = meshes_[ids[i]];
+  // a complete scene defines the set of meshes both ends keep
+  if (!msg.is_diff)
+  {
+    std::set<uint64_t> present(ids.begin(), ids.end());
+    for (std::map<uint64_t, shape_msgs::Mesh>::iterator it = meshes_.begin() ; it != meshes_.end() ; )
+      if (present.find(it->first) == present.end())
+        meshes_.erase(it++);
+      else
+        ++it;
+  }
+
+  std::vector<int8_t> &octomap = msg.world.octomap.octomap.data;
+  if (octomap_mode == OCTOMAP_DELTA)
+  {
+    std::vector<int8_t> full(octomap_.begin(), octomap_.begin() + prefix);
+    full.insert(full.end(), octomap.begin(), octomap.end());
+    full.insert(full.end(), octomap_.end() - suffix, octomap_.end());
+    octomap.swap(full);
+  }
+  if (!octomap.empty())
+  {
+    octomap_ = octomap;
+    have_octomap_ = true;
+  }
+  
+  synchronized_ = true;
+  needs_keyframe_ = false;
+  sequence_ = sequence;
+  scene = msg;
+  return true;
+}
@@ -36,6 +36,7 @@
 
 #include <moveit/planning_scene_monitor/planning_scene_monitor.h>
 #include <moveit/planning_models_loader/kinematic_model_loader.h>
+#include <moveit/planning_scene_monitor/bounding_boxes.h>
 
 #include <dynamic_reconfigure/server.h>
 #include <moveit_ros_planning/PlanningSceneMonitorDynamicReconfigureConfig.h>
@@ -45,6 +46,48 @@ namespace planning_scene_monitor
 
 using namespace moveit_ros_planning;
 
+namespace
+{
+
+void getWorldObjects(const collision_detection::CollisionWorld &world,
+                     std::map<std::string, collision_detection::CollisionWorld::ObjectConstPtr> &objects)
+{
+  std::vector<std::string> ids = world.getObjectIds();
+  for (std::size_t i = 0 ; i < ids.size() ; ++i)
+    objects[ids[i]] = world.getObject(ids[i]);
+}
+
+void addObjectRegions(const collision_detection::CollisionWorld::ObjectConstPtr &obj, std::vector<Eigen::AlignedBox3d> &regions)
+{
+  for (std::size_t i = 0 ; i < obj->shapes_.size() ; ++i)
+    regions.push_back(computeShapeBoundingBox(obj->shapes_[i].get(), obj->shape_poses_[i]));
+}
+
+/// the regions of the objects that were added, removed or changed; changed objects contribute both their old and new geometry
+void computeChangedObjectRegions(const std::map<std::string, collision_detection::CollisionWorld::ObjectConstPtr> &before,
+                                 const std::map<std::string, collision_detection::CollisionWorld::ObjectConstPtr> &after,
+                                 std::vector<Eigen::AlignedBox3d> &regions)
+{
+  typedef std::map<std::string, collision_detection::CollisionWorld::ObjectConstPtr>::const_iterator Iterator;
+  for (Iterator it = after.begin() ; it != after.end() ; ++it)
+  {
+    Iterator jt = before.find(it->first);
+    if (jt == before.end())
+      addObjectRegions(it->second, regions);
+    else
+      if (jt->second != it->second)
+      {
+        addObjectRegions(jt->second, regions);
+        addObjectRegions(it->second, regions);
+      }
+  }
+  for (Iterator jt = before.begin() ; jt != before.end() ; ++jt)
+    if (after.find(jt->first) == after.end())
+      addObjectRegions(jt->second, regions);
+}
+
+}
+
 class PlanningSceneMonitor::DynamicReconfigureImpl
 { 
 public:
@@ -89,6 +132,10 @@ private:
     }
     else
       owner_->stopPublishingPlanningScene();
+    if (config.publish_packed_state)
+      owner_->startPublishingPackedState(config.publish_packed_state_hz);
+    else
+      owner_->stopPublishingPackedState();
   }
   
   PlanningSceneMonitor *owner_;
@@ -129,9 +176,12 @@ planning_scene_monitor::PlanningSceneMonitor::PlanningSceneMonitor(const plannin
 planning_scene_monitor::PlanningSceneMonitor::~PlanningSceneMonitor(void)
 {
   stopPublishingPlanningScene();
+  stopPublishingPackedState();
+  stopPackedStateMonitor();
   stopStateMonitor();
   stopWorldGeometryMonitor();
   stopSceneMonitor();
+  stopWorldUpdateThread();
   delete reconfigure_impl_;
   current_state_monitor_.reset();
   scene_const_.reset();
@@ -171,6 +221,23 @@ void planning_scene_monitor::PlanningSceneMonitor::initialize(const planning_sce
   
   publish_planning_scene_frequency_ = 2.0;
   new_scene_update_ = UPDATE_NONE;
+  publish_packed_state_frequency_ = 30.0;
+  packed_state_update_ = false;
+  publish_packed_state_running_ = false;
+
+  use_scene_snapshots_ = false;
+  octomap_in_scene_ = false;
+  scene_version_ = 0;
+  scene_state_version_ = 0;
+  scene_snapshot_version_ = 0;
+  scene_snapshot_state_version_ = 0;
+  geometry_version_ = 0;
+  reset_scene_encoder_ = false;
+
+  world_update_thread_running_ = false;
+  state_updates_pending_ = 0;
+  if (scene_)
+    startWorldUpdateThread();
   
   last_update_time_ = ros::Time::now();
   last_state_update_ = ros::WallTime::now();
@@ -229,6 +296,8 @@ void planning_scene_monitor::PlanningSceneMonitor::stopPublishingPlanningScene(v
     copy->join();
     monitorDiffs(false);
     planning_scene_publisher_.shutdown(); 
+    compact_planning_scene_publisher_.shutdown();
+    compact_keyframe_request_subscriber_.shutdown();
     ROS_INFO("Stopped publishing maintained planning scene.");
   }
 }
@@ -240,6 +309,21 @@ void planning_scene_monitor::PlanningSceneMonitor::startPublishingPlanningScene(
   {
     planning_scene_publisher_ = nh_.advertise<moveit_msgs::PlanningScene>(planning_scene_topic, 100, false);
     ROS_INFO("Publishing maintained planning scene on '%s'", planning_scene_topic.c_str());
+    bool compact = false;
+    bool compress = true;
+    nh_.param("publish_compact_planning_scene", compact, false);
+    nh_.param("compress_planning_scene", compress, true);
+    if (compact)
+    {
+      scene_encoder_.setCompression(compress);
+      scene_encoder_.reset();
+      reset_scene_encoder_ = false;
+      compact_planning_scene_publisher_ = nh_.advertise<std_msgs::UInt8MultiArray>(planning_scene_topic + "_compact", 100,
+                                                                                   boost::bind(&PlanningSceneMonitor::onCompactSceneSubscriberConnect, this, _1));
+      compact_keyframe_request_subscriber_ = nh_.subscribe(planning_scene_topic + "_compact_keyframe_request", 10,
+                                                           &PlanningSceneMonitor::compactKeyframeRequestCallback, this);
+      ROS_INFO("Publishing maintained planning scene in compact form on '%s_compact'%s", planning_scene_topic.c_str(), compress ? " (compressed)" : "");
+    }
     monitorDiffs(true);
     publish_planning_scene_.reset(new boost::thread(boost::bind(&PlanningSceneMonitor::scenePublishingThread, this)));
   }
@@ -253,22 +337,30 @@ void planning_scene_monitor::PlanningSceneMonitor::scenePublishingThread(void)
   moveit_msgs::PlanningScene msg;
   scene_->getPlanningSceneMsg(msg);
   planning_scene_publisher_.publish(msg);
+  publishCompactPlanningScene(msg, true);
   ROS_DEBUG("Published the full planning scene: '%s'", msg.name.c_str());
   
   bool have_diff = false;
   bool have_full = false;
+  bool reset_encoder = false;
   do 
   {
     have_diff = false;
     have_full = false;
+    reset_encoder = false;
     ros::Rate rate(publish_planning_scene_frequency_);
     {
       boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
-      while (new_scene_update_ == UPDATE_NONE && publish_planning_scene_)
+      // updates that are not published (e.g., state updates when only geometry is published) do not wake this thread;
+      // they are included in the next diff that is sent
+      while (!isPublishedUpdate(new_scene_update_) && !reset_scene_encoder_ && publish_planning_scene_)
         new_scene_update_condition_.wait(ulock);
-      if (new_scene_update_ != UPDATE_NONE)
+      if (isPublishedUpdate(new_scene_update_) || reset_scene_encoder_)
       {
-        if (new_scene_update_ == UPDATE_SCENE)
+        // a new subscriber to the compact scene needs a complete scene to start from
+        reset_encoder = reset_scene_encoder_;
+        reset_scene_encoder_ = false;
+        if ((new_scene_update_ & UPDATE_SCENE) == UPDATE_SCENE || reset_encoder)
         {
           rate.reset();
           scene_->pushDiffs(parent_scene_);
@@ -291,6 +383,7 @@ void planning_scene_monitor::PlanningSceneMonitor::scenePublishingThread(void)
     if (have_diff)
     {
       planning_scene_publisher_.publish(msg);
+      publishCompactPlanningScene(msg, false);
       //ROS_DEBUG("Published planning scene diff: '%s'", msg.name.c_str());
       rate.sleep(); 
     } 
@@ -298,6 +391,7 @@ void planning_scene_monitor::PlanningSceneMonitor::scenePublishingThread(void)
       if (have_full)
       {
         planning_scene_publisher_.publish(msg);
+        publishCompactPlanningScene(msg, reset_encoder);
         ROS_DEBUG("Published complete planning scene: '%s'", msg.name.c_str());
         rate.sleep(); 
       }
@@ -305,6 +399,109 @@ void planning_scene_monitor::PlanningSceneMonitor::scenePublishingThread(void)
   while (publish_planning_scene_);
 }
 
+bool planning_scene_monitor::PlanningSceneMonitor::isPublishedUpdate(SceneUpdateType update_type) const
+{
+  return (update_type & UPDATE_SCENE) == UPDATE_SCENE || (update_type & publish_update_types_);
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::startPublishingPackedState(double hz, const std::string &topic)
+{
+  // ros::Rate cannot sleep for a non-positive frequency
+  if (hz <= std::numeric_limits<double>::epsilon())
+  {
+    ROS_ERROR("Cannot publish the state of the maintained planning scene at %lf Hz; the frequency must be positive", hz);
+    return;
+  }
+  publish_packed_state_frequency_ = hz;
+  boost::mutex::scoped_lock lock(packed_state_lock_);
+  if (!publish_packed_state_running_ && scene_)
+  {
+    packed_state_publisher_ = nh_.advertise<sensor_msgs::JointState>(topic, 100, false);
+    ROS_INFO("Publishing the state of the maintained planning scene on '%s' at %lf Hz", topic.c_str(), hz);
+    packed_state_update_ = true;
+    // the thread waits for the lock, so it only starts once the flag and the pointer are set
+    publish_packed_state_running_ = true;
+    publish_packed_state_.reset(new boost::thread(boost::bind(&PlanningSceneMonitor::packedStatePublishingThread, this)));
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::stopPublishingPackedState(void)
+{
+  boost::scoped_ptr<boost::thread> copy;
+  {
+    boost::mutex::scoped_lock lock(packed_state_lock_);
+    publish_packed_state_running_ = false;
+    copy.swap(publish_packed_state_);
+    packed_state_condition_.notify_all();
+  }
+  if (copy)
+  {
+    copy->join();
+    packed_state_publisher_.shutdown();
+    ROS_INFO("Stopped publishing the state of the maintained planning scene.");
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::packedStatePublishingThread(void)
+{
+  ROS_DEBUG("Started packed state publishing thread ...");
+  
+  sensor_msgs::JointState msg;
+  while (true)
+  {
+    {
+      boost::mutex::scoped_lock lock(packed_state_lock_);
+      while (!packed_state_update_ && publish_packed_state_running_)
+        packed_state_condition_.wait(lock);
+      if (!publish_packed_state_running_)
+        break;
+      packed_state_update_ = false;
+    }
+    ros::Rate rate(publish_packed_state_frequency_);
+    {
+      boost::shared_lock<boost::shared_mutex> slock(scene_update_mutex_);
+      scene_->getCurrentState().getStateValues(msg.position);
+      msg.header.stamp = last_update_time_;
+    }
+    packed_state_publisher_.publish(msg);
+    rate.sleep();
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::publishCompactPlanningScene(const moveit_msgs::PlanningScene &msg, bool reset_encoder)
+{
+  // the encoder is only advanced when someone listens; new subscribers cause a reset anyway
+  if (!compact_planning_scene_publisher_ || compact_planning_scene_publisher_.getNumSubscribers() == 0)
+    return;
+  if (reset_encoder)
+    scene_encoder_.reset();
+  std_msgs::UInt8MultiArray data;
+  scene_encoder_.encode(msg, data.data);
+  compact_planning_scene_publisher_.publish(data);
+  ROS_DEBUG("Published compact planning scene (%u bytes)", (unsigned int)data.data.size());
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::onCompactSceneSubscriberConnect(const ros::SingleSubscriberPublisher &pub)
+{
+  resetSceneEncoder();
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::compactKeyframeRequestCallback(const std_msgs::EmptyConstPtr &msg)
+{
+  ROS_DEBUG("A subscriber of the compact planning scene requested a complete scene");
+  resetSceneEncoder();
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::resetSceneEncoder(void)
+{
+  // the scene did not change, so no update event is raised; the publishing thread only needs to send a complete scene
+  {
+    boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
+    reset_scene_encoder_ = true;
+  }
+  new_scene_update_condition_.notify_all();
+}
+
 const kinematic_model::KinematicModelConstPtr& planning_scene_monitor::PlanningSceneMonitor::getKinematicModel(void) const
 {
   if (scene_)
@@ -330,6 +527,8 @@ void planning_scene_monitor::PlanningSceneMonitor::getMonitoredTopics(std::vecto
     topics.push_back(collision_map_subscriber_->getTopic());
   if (planning_scene_world_subscriber_)
     topics.push_back(planning_scene_world_subscriber_.getTopic());
+  if (packed_state_subscriber_)
+    topics.push_back(packed_state_subscriber_.getTopic());
 }
 
 namespace
@@ -356,8 +555,24 @@ bool planning_scene_monitor::PlanningSceneMonitor::updatesScene(const planning_s
 
 void planning_scene_monitor::PlanningSceneMonitor::processSceneUpdateEvent(SceneUpdateType update_type)
 {
+  if (update_type != UPDATE_NONE)
+  {
+    // invalidate the current snapshot (if any); a new one is built on demand, and if only the robot state
+    // changed, the new one is a diff of the last full copy of the scene
+    boost::mutex::scoped_lock slock(scene_snapshot_lock_);
+    if (update_type & ~UPDATE_STATE)
+      scene_version_++;
+    if (update_type & UPDATE_STATE)
+      scene_state_version_++;
+  }
   for (std::size_t i = 0 ; i < update_callbacks_.size() ; ++i)
     update_callbacks_[i](update_type);
+  if (update_type & UPDATE_STATE)
+  {
+    boost::mutex::scoped_lock lock(packed_state_lock_);
+    packed_state_update_ = true;
+    packed_state_condition_.notify_one();
+  }
   new_scene_update_ = (SceneUpdateType) ((int)new_scene_update_ | (int)update_type);
   new_scene_update_condition_.notify_all();
 }
@@ -383,6 +598,15 @@ void planning_scene_monitor::PlanningSceneMonitor::newPlanningSceneCallback(cons
         scene_const_ = scene_;
       }
     }
+    // a complete scene brings its own transforms, so the tracked frames need to be looked up again
+    if (!scene->is_diff)
+    {
+      boost::mutex::scoped_lock lock(tracked_frames_lock_);
+      for (std::map<std::string, TrackedFrame>::iterator it = tracked_frames_.begin() ; it != tracked_frames_.end() ; ++it)
+        it->second.known = false;
+    }
+    trackFrames(scene->world);
+    
     // if we have a diff, try to more accuratelly determine the update type
     if (scene->is_diff)
     {
@@ -401,21 +625,65 @@ void planning_scene_monitor::PlanningSceneMonitor::newPlanningSceneCallback(cons
           upd = (SceneUpdateType) ((int)upd | (int)UPDATE_STATE);
       }
     }
+    // scene messages may replace any part of the geometry, so the regions they change are not computed
+    if (upd & UPDATE_GEOMETRY)
+      recordGeometryChange(NULL);
     processSceneUpdateEvent(upd);
   }
 }
 
+void planning_scene_monitor::PlanningSceneMonitor::packedStateCallback(const sensor_msgs::JointStateConstPtr &state)
+{
+  if (scene_)
+  {
+    std::size_t expected = scene_->getKinematicModel()->getVariableNames().size();
+    if (state->position.size() != expected)
+    {
+      ROS_WARN_THROTTLE(1, "Received a packed state with %u values instead of the expected %u",
+                        (unsigned int)state->position.size(), (unsigned int)expected);
+      return;
+    }
+    {
+      boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
+      last_update_time_ = ros::Time::now();
+      scene_->getCurrentState().setStateValues(state->position);
+    }
+    processSceneUpdateEvent(UPDATE_STATE);
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::newCompactPlanningSceneCallback(const std_msgs::UInt8MultiArrayConstPtr &data)
+{
+  moveit_msgs::PlanningScenePtr scene(new moveit_msgs::PlanningScene());
+  if (scene_decoder_.decode(data->data, *scene))
+    newPlanningSceneCallback(scene);
+  else
+    if (scene_decoder_.needsKeyframe())
+    {
+      // a compact scene was lost; ask for a complete one (again, if the previous request was not answered in time)
+      ros::WallTime now = ros::WallTime::now();
+      if (now - last_keyframe_request_ >= ros::WallDuration(1.0))
+      {
+        last_keyframe_request_ = now;
+        compact_keyframe_request_publisher_.publish(std_msgs::Empty());
+      }
+    }
+}
+
 void planning_scene_monitor::PlanningSceneMonitor::newPlanningSceneWorldCallback(const moveit_msgs::PlanningSceneWorldConstPtr &world)
 {
   if (scene_)
   {
+    trackFrames(*world);
     updateFrameTransforms();
     {
       boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
       last_update_time_ = ros::Time::now();  
       scene_->getCollisionWorld()->clearObjects();
       scene_->processPlanningSceneWorldMsg(*world);
+      octomap_in_scene_ = false;
     }  
+    recordGeometryChange(NULL);
     processSceneUpdateEvent(UPDATE_SCENE);
   }
 }
@@ -424,41 +692,153 @@ void planning_scene_monitor::PlanningSceneMonitor::collisionObjectCallback(const
 {
   if (scene_)
   {
-    {
-      boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
-      last_update_time_ = ros::Time::now();
-      scene_->processCollisionObjectMsg(*obj);
-    }
-    processSceneUpdateEvent(UPDATE_GEOMETRY);
+    WorldUpdate update;
+    update.object = obj;
+    queueWorldUpdate(update);
   }
 }
 
 void planning_scene_monitor::PlanningSceneMonitor::attachObjectCallback(const moveit_msgs::AttachedCollisionObjectConstPtr &obj)
 {
   if (scene_)
-  {    
-    updateFrameTransforms();
-    {
-      boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
-      last_update_time_ = ros::Time::now();
-      scene_->processAttachedCollisionObjectMsg(*obj);
-    }
-    processSceneUpdateEvent(UPDATE_GEOMETRY);
+  {
+    WorldUpdate update;
+    update.attached_object = obj;
+    queueWorldUpdate(update);
   }
 }
 
 void planning_scene_monitor::PlanningSceneMonitor::collisionMapCallback(const moveit_msgs::CollisionMapConstPtr &map)
 {
   if (scene_)
-  {  
-    updateFrameTransforms();
+  {
+    WorldUpdate update;
+    update.map = map;
+    queueWorldUpdate(update);
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::queueWorldUpdate(const WorldUpdate &update)
+{
+  boost::mutex::scoped_lock lock(world_updates_lock_);
+  world_updates_.push_back(update);
+  world_updates_condition_.notify_one();
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::startWorldUpdateThread(void)
+{
+  if (!world_update_thread_)
+  {
+    world_update_thread_running_ = true;
+    world_update_thread_.reset(new boost::thread(boost::bind(&PlanningSceneMonitor::worldUpdateThread, this)));
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::stopWorldUpdateThread(void)
+{
+  if (world_update_thread_)
+  {
     {
-      boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
-      last_update_time_ = ros::Time::now();
-      scene_->processCollisionMapMsg(*map);
+      boost::mutex::scoped_lock lock(world_updates_lock_);
+      world_update_thread_running_ = false;
+      world_updates_condition_.notify_all();
+    }
+    world_update_thread_->join();
+    world_update_thread_.reset();
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::worldUpdateThread(void)
+{
+  while (true)
+  {
+    std::deque<WorldUpdate> updates;
+    {
+      boost::mutex::scoped_lock lock(world_updates_lock_);
+      while (world_updates_.empty() && world_update_thread_running_)
+        world_updates_condition_.wait(lock);
+      if (world_updates_.empty())
+        break;
+      // take everything that accumulated while the previous batch was being applied
+      updates.swap(world_updates_);
+    }
+    processWorldUpdates(updates);
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::processWorldUpdates(const std::deque<WorldUpdate> &updates)
+{
+  // the lock is not held for longer than this when a batch is large, so readers are not starved
+  static const ros::WallDuration MAX_LOCK_DURATION(0.02);
+  
+  // a single transform refresh serves all the messages of the batch
+  for (std::size_t i = 0 ; i < updates.size() ; ++i)
+    if (updates[i].object)
+      trackFrame(updates[i].object->header.frame_id);
+    else
+      if (updates[i].attached_object)
+        trackFrame(updates[i].attached_object->object.header.frame_id);
+      else
+        if (updates[i].map)
+          trackFrame(updates[i].map->header.frame_id);
+  updateFrameTransforms();
+  
+  // the objects of the world are copied on write, so the objects changed by the batch are the ones whose pointer changed
+  std::map<std::string, collision_detection::CollisionWorld::ObjectConstPtr> objects_before, objects_after;
+  bool regions_known = true;
+  
+  std::size_t i = 0;
+  while (i < updates.size())
+  {
+    {
+      // let the waiting state updates take the lock first; retaking it right away could win over them again
+      boost::mutex::scoped_lock slock(state_updates_pending_lock_);
+      while (state_updates_pending_ > 0)
+        state_updates_pending_condition_.wait(slock);
+    }
+    boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
+    last_update_time_ = ros::Time::now();
+    ros::WallTime start = ros::WallTime::now();
+    if (i == 0)
+      getWorldObjects(*scene_->getCollisionWorld(), objects_before);
+    do
+    {
+      const WorldUpdate &update = updates[i++];
+      if (update.object)
+        scene_->processCollisionObjectMsg(*update.object);
+      else
+        if (update.attached_object)
+        {
+          scene_->processAttachedCollisionObjectMsg(*update.attached_object);
+          // attaching or detaching changes the robot, not only the world
+          regions_known = false;
+        }
+        else
+          if (update.map)
+            scene_->processCollisionMapMsg(*update.map);
     }
-    processSceneUpdateEvent(UPDATE_GEOMETRY);
+    // state updates take priority: let them in between messages rather than after the whole batch
+    while (i < updates.size() && !isStateUpdatePending() && ros::WallTime::now() - start < MAX_LOCK_DURATION);
+    if (i == updates.size() && regions_known)
+      getWorldObjects(*scene_->getCollisionWorld(), objects_after);
+  }
+  
+  ROS_DEBUG("Applied %u world geometry updates to the planning scene", (unsigned int)updates.size());
+  if (regions_known)
+  {
+    std::vector<Eigen::AlignedBox3d> regions;
+    computeChangedObjectRegions(objects_before, objects_after, regions);
+    recordGeometryChange(&regions);
   }
+  else
+    recordGeometryChange(NULL);
+  processSceneUpdateEvent(UPDATE_GEOMETRY);
+}
+
+bool planning_scene_monitor::PlanningSceneMonitor::isStateUpdatePending(void)
+{
+  boost::mutex::scoped_lock slock(state_updates_pending_lock_);
+  return state_updates_pending_ > 0;
 }
 
 void planning_scene_monitor::PlanningSceneMonitor::lockSceneRead(void)
@@ -489,6 +869,134 @@ void planning_scene_monitor::PlanningSceneMonitor::unlockSceneWrite(void)
     octomap_monitor_->unlockOcTreeWrite();
 }
 
+void planning_scene_monitor::PlanningSceneMonitor::useSceneSnapshots(bool flag)
+{
+  boost::mutex::scoped_lock slock(scene_snapshot_lock_);
+  use_scene_snapshots_ = flag;
+  scene_snapshot_.reset();
+  scene_snapshot_base_.reset();
+  if (flag)
+    ROS_INFO("Readers of the maintained planning scene are now served scene snapshots");
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::recordGeometryChange(const std::vector<Eigen::AlignedBox3d> *regions)
+{
+  // enough history for readers that check for changes at a lower rate than the scene is updated
+  static const std::size_t MAX_GEOMETRY_CHANGES = 64;
+  
+  boost::mutex::scoped_lock slock(geometry_changes_lock_);
+  GeometryChange change;
+  change.version = ++geometry_version_;
+  change.known = regions != NULL;
+  if (regions)
+    change.regions = *regions;
+  geometry_changes_.push_back(change);
+  if (geometry_changes_.size() > MAX_GEOMETRY_CHANGES)
+    geometry_changes_.pop_front();
+}
+
+unsigned long planning_scene_monitor::PlanningSceneMonitor::getGeometryVersion(void) const
+{
+  boost::mutex::scoped_lock slock(geometry_changes_lock_);
+  return geometry_version_;
+}
+
+bool planning_scene_monitor::PlanningSceneMonitor::getChangedRegions(unsigned long &version, std::vector<Eigen::AlignedBox3d> &regions) const
+{
+  boost::mutex::scoped_lock slock(geometry_changes_lock_);
+  regions.clear();
+  bool known = true;
+  if (version < geometry_version_)
+  {
+    // the changes after version must all be in the history
+    if (geometry_changes_.empty() || geometry_changes_.front().version > version + 1)
+      known = false;
+    for (std::size_t i = 0 ; known && i < geometry_changes_.size() ; ++i)
+      if (geometry_changes_[i].version > version)
+      {
+        if (geometry_changes_[i].known)
+          regions.insert(regions.end(), geometry_changes_[i].regions.begin(), geometry_changes_[i].regions.end());
+        else
+          known = false;
+      }
+  }
+  version = geometry_version_;
+  if (!known)
+    regions.clear();
+  return known;
+}
+
+planning_scene::PlanningSceneConstPtr planning_scene_monitor::PlanningSceneMonitor::getPlanningSceneSnapshot(void)
+{
+  {
+    boost::mutex::scoped_lock slock(scene_snapshot_lock_);
+    if (scene_snapshot_ && scene_snapshot_version_ == scene_version_ && scene_snapshot_state_version_ == scene_state_version_)
+      return scene_snapshot_;
+  }
+  
+  // if multiple readers ask for a new snapshot at the same time, only one of them builds it
+  boost::mutex::scoped_lock block(scene_snapshot_build_lock_);
+  unsigned long version, state_version;
+  planning_scene::PlanningSceneConstPtr base;
+  {
+    boost::mutex::scoped_lock slock(scene_snapshot_lock_);
+    if (scene_snapshot_ && scene_snapshot_version_ == scene_version_ && scene_snapshot_state_version_ == scene_state_version_)
+      return scene_snapshot_;
+    version = scene_version_;
+    state_version = scene_state_version_;
+    if (scene_snapshot_base_ && scene_snapshot_version_ == version)
+      base = scene_snapshot_base_;
+  }
+  
+  if (!scene_)
+    return planning_scene::PlanningSceneConstPtr();
+  
+  planning_scene::PlanningScenePtr snapshot;
+  if (base)
+  {
+    // only the robot state changed since the last full copy, so the new snapshot shares everything else with that copy
+    snapshot = base->diff();
+    boost::shared_lock<boost::shared_mutex> ulock(scene_update_mutex_);
+    snapshot->getCurrentState() = scene_->getCurrentState();
+  }
+  else
+  {
+    // writers are blocked only while the copy is made
+    boost::shared_lock<boost::shared_mutex> ulock(scene_update_mutex_);
+    snapshot = scene_->diff();
+    snapshot->decoupleParent();
+    
+    // the maintained scene shares the octree with the octomap monitor, so the snapshot needs its own copy
+    if (octomap_monitor_ && octomap_in_scene_)
+    {
+      occupancy_map_monitor::OccMapTreePtr tree;
+      octomap_monitor_->lockOcTreeRead();
+      try
+      {
+        tree.reset(new occupancy_map_monitor::OccMapTree(*octomap_monitor_->getOcTreePtr()));
+      }
+      catch(...)
+      {
+        octomap_monitor_->unlockOcTreeRead(); // unlock and rethrow
+        throw;
+      }
+      octomap_monitor_->unlockOcTreeRead();
+      snapshot->processOctomapPtr(tree, Eigen::Affine3d::Identity());
+    }
+    base = snapshot;
+  }
+  
+  {
+    boost::mutex::scoped_lock slock(scene_snapshot_lock_);
+    // the versions may have been incremented while copying; the snapshot is then simply rebuilt by the next reader
+    scene_snapshot_ = snapshot;
+    scene_snapshot_base_ = base;
+    scene_snapshot_version_ = version;
+    scene_snapshot_state_version_ = state_version;
+  }
+  return snapshot;
+}
+
 void planning_scene_monitor::PlanningSceneMonitor::startSceneMonitor(const std::string &scene_topic)
 {
   stopSceneMonitor();
@@ -497,7 +1005,15 @@ void planning_scene_monitor::PlanningSceneMonitor::startSceneMonitor(const std::
   // listen for planning scene updates; these messages include transforms, so no need for filters
   if (!scene_topic.empty())
   {
-    planning_scene_subscriber_ = root_nh_.subscribe(scene_topic, 100, &PlanningSceneMonitor::newPlanningSceneCallback, this);
+    static const std::string COMPACT_SUFFIX = "_compact";
+    if (scene_topic.size() > COMPACT_SUFFIX.size() && scene_topic.compare(scene_topic.size() - COMPACT_SUFFIX.size(), COMPACT_SUFFIX.size(), COMPACT_SUFFIX) == 0)
+    {
+      scene_decoder_.reset();
+      compact_keyframe_request_publisher_ = root_nh_.advertise<std_msgs::Empty>(scene_topic + "_keyframe_request", 10);
+      planning_scene_subscriber_ = root_nh_.subscribe(scene_topic, 100, &PlanningSceneMonitor::newCompactPlanningSceneCallback, this);
+    }
+    else
+      planning_scene_subscriber_ = root_nh_.subscribe(scene_topic, 100, &PlanningSceneMonitor::newPlanningSceneCallback, this);
     ROS_INFO("Listening to '%s'", scene_topic.c_str());
   }
 }
@@ -508,6 +1024,26 @@ void planning_scene_monitor::PlanningSceneMonitor::stopSceneMonitor(void)
   {
     ROS_INFO("Stopping scene monitor");
     planning_scene_subscriber_.shutdown();
+    compact_keyframe_request_publisher_.shutdown();
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::startPackedStateMonitor(const std::string &topic)
+{
+  stopPackedStateMonitor();
+  if (!topic.empty())
+  {
+    packed_state_subscriber_ = root_nh_.subscribe(topic, 100, &PlanningSceneMonitor::packedStateCallback, this);
+    ROS_INFO("Listening to '%s' for packed states", topic.c_str());
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::stopPackedStateMonitor(void)
+{
+  if (packed_state_subscriber_)
+  {
+    ROS_INFO("Stopping packed state monitor");
+    packed_state_subscriber_.shutdown();
   }
 }
 
@@ -564,6 +1100,7 @@ void planning_scene_monitor::PlanningSceneMonitor::startWorldGeometryMonitor(con
     opt.map_frame = scene_->getPlanningFrame();
     octomap_monitor_.reset(new occupancy_map_monitor::OccupancyMapMonitor(opt, tf_));
     octomap_monitor_->setUpdateCallback(boost::bind(&PlanningSceneMonitor::octomapUpdateCallback, this));
+    octomap_monitor_->setKinematicStateFunction(boost::bind(&PlanningSceneMonitor::getSensorState, this, _1));
   }
   
   octomap_monitor_->startMonitor();
@@ -642,6 +1179,7 @@ void planning_scene_monitor::PlanningSceneMonitor::octomapUpdateCallback(void)
     try
     {
       scene_->processOctomapPtr(octomap_monitor_->getOcTreePtr(), Eigen::Affine3d::Identity());
+      octomap_in_scene_ = true;
       octomap_monitor_->unlockOcTreeWrite();
     }
     catch(...)
@@ -650,9 +1188,18 @@ void planning_scene_monitor::PlanningSceneMonitor::octomapUpdateCallback(void)
       throw;
     }    
   }
+  // this is called by the octomap monitor right after the update, so the changed regions are those of this update
+  recordGeometryChange(&octomap_monitor_->getLastUpdateRegions());
   processSceneUpdateEvent(UPDATE_GEOMETRY);
 }
 
+kinematic_state::KinematicStateConstPtr planning_scene_monitor::PlanningSceneMonitor::getSensorState(const ros::Time &stamp) const
+{
+  if (current_state_monitor_ && current_state_monitor_->isActive() && current_state_monitor_->haveCompleteState())
+    return current_state_monitor_->getStateAtTime(stamp);
+  return kinematic_state::KinematicStateConstPtr();
+}
+
 void planning_scene_monitor::PlanningSceneMonitor::setStateUpdateFrequency(double hz)
 {
   if (hz > std::numeric_limits<double>::epsilon())
@@ -680,9 +1227,18 @@ void planning_scene_monitor::PlanningSceneMonitor::updateSceneWithCurrentState(v
       ROS_WARN("The complete state of the robot is not yet known.  Missing %s", missing_str.c_str());
     }
     
+    const std::map<std::string, double> &v = current_state_monitor_->getCurrentStateValues();
     {
+      {
+        boost::mutex::scoped_lock slock(state_updates_pending_lock_);
+        state_updates_pending_++;
+      }
       boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
-      const std::map<std::string, double> &v = current_state_monitor_->getCurrentStateValues();
+      {
+        boost::mutex::scoped_lock slock(state_updates_pending_lock_);
+        if (--state_updates_pending_ == 0)
+          state_updates_pending_condition_.notify_all();
+      }
       scene_->getCurrentState().setStateValues(v);
       last_update_time_ = ros::Time::now();
     }
@@ -709,44 +1265,99 @@ void planning_scene_monitor::PlanningSceneMonitor::setPlanningScenePublishingFre
   ROS_DEBUG("Maximum frquency for publishing a planning scene is now %lf Hz", publish_planning_scene_frequency_);
 }
 
-void planning_scene_monitor::PlanningSceneMonitor::getUpdatedFrameTransforms(const kinematic_model::KinematicModelConstPtr &kmodel, std::vector<geometry_msgs::TransformStamped> &transforms)
+void planning_scene_monitor::PlanningSceneMonitor::trackFrame(const std::string &frame)
+{
+  std::string name = !frame.empty() && frame[0] == '/' ? frame.substr(1) : frame;
+  if (name.empty() || !scene_)
+    return;
+  const kinematic_model::KinematicModelConstPtr &kmodel = scene_->getKinematicModel();
+  if (name == kmodel->getModelFrame() || kmodel->hasLinkModel(name))
+    return;
+  boost::mutex::scoped_lock lock(tracked_frames_lock_);
+  if (tracked_frames_.find(name) == tracked_frames_.end())
+  {
+    tracked_frames_[name] = TrackedFrame();
+    ROS_DEBUG("Tracking transform of frame '%s'", name.c_str());
+  }
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::trackFrames(const moveit_msgs::PlanningSceneWorld &world)
+{
+  for (std::size_t i = 0 ; i < world.collision_objects.size() ; ++i)
+    trackFrame(world.collision_objects[i].header.frame_id);
+  trackFrame(world.collision_map.header.frame_id);
+  trackFrame(world.octomap.header.frame_id);
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::getUpdatedFrameTransforms(const kinematic_model::KinematicModelConstPtr &kmodel, std::vector<geometry_msgs::TransformStamped> &transforms,
+                                                                             bool all_frames)
 {
   if (!tf_)
     return;
   const std::string &target = kmodel->getModelFrame();
   
-  std::vector<std::string> all_frame_names;
-  tf_->getFrameStrings(all_frame_names);
-  for (std::size_t i = 0 ; i < all_frame_names.size() ; ++i)
+  // the frames known to tf that are not tracked are looked up without being added to the tracked frames
+  std::map<std::string, TrackedFrame> untracked_frames;
+  
+  // the lock is held for the whole refresh so that concurrent callers do not interleave their updates of the cache
+  boost::mutex::scoped_lock lock(tracked_frames_lock_);
+  if (all_frames)
   {
-    if (!all_frame_names[i].empty() && all_frame_names[i][0] == '/')
-      all_frame_names[i].erase(all_frame_names[i].begin());
-    
-    if (all_frame_names[i] == target || kmodel->hasLinkModel(all_frame_names[i]))
-      continue;
-    
+    std::vector<std::string> all_frame_names;
+    tf_->getFrameStrings(all_frame_names);
+    for (std::size_t i = 0 ; i < all_frame_names.size() ; ++i)
+    {
+      std::string name = !all_frame_names[i].empty() && all_frame_names[i][0] == '/' ? all_frame_names[i].substr(1) : all_frame_names[i];
+      if (!name.empty() && name != target && !kmodel->hasLinkModel(name) && tracked_frames_.find(name) == tracked_frames_.end())
+        untracked_frames[name] = TrackedFrame();
+    }
+  }
+  
+  std::vector<std::pair<const std::string*, TrackedFrame*> > frames;
+  for (std::map<std::string, TrackedFrame>::iterator it = tracked_frames_.begin() ; it != tracked_frames_.end() ; ++it)
+    frames.push_back(std::make_pair(&it->first, &it->second));
+  for (std::map<std::string, TrackedFrame>::iterator it = untracked_frames.begin() ; it != untracked_frames.end() ; ++it)
+    frames.push_back(std::make_pair(&it->first, &it->second));
+  
+  for (std::size_t k = 0 ; k < frames.size() ; ++k)
+  {
+    const std::string &name = *frames[k].first;
+    TrackedFrame &frame = *frames[k].second;
     ros::Time stamp;
     std::string err_string;
-    if (tf_->getLatestCommonTime(target, all_frame_names[i], stamp, &err_string) != tf::NO_ERROR)
+    if (tf_->getLatestCommonTime(target, name, stamp, &err_string) != tf::NO_ERROR)
     {
-      ROS_WARN_STREAM("No transform available between frame '" << all_frame_names[i] << "' and planning frame '" <<
+      ROS_WARN_STREAM("No transform available between frame '" << name << "' and planning frame '" <<
                       target << "' (" << err_string << ")");
       continue;
     }
     
+    // no new tf data for this frame since the last time it was looked up
+    if (frame.known && frame.stamp == stamp)
+      continue;
+    
     tf::StampedTransform t;
     try
     {
-      tf_->lookupTransform(target, all_frame_names[i], stamp, t);
+      tf_->lookupTransform(target, name, stamp, t);
     }
     catch (tf::TransformException& ex)
     {
-      ROS_WARN_STREAM("Unable to transform object from frame '" << all_frame_names[i] << "' to planning frame '" <<
+      ROS_WARN_STREAM("Unable to transform object from frame '" << name << "' to planning frame '" <<
                       target << "' (" << ex.what() << ")");
       continue;
     }
+    
+    // frames that are republished without moving (e.g., static transforms) do not need to update the scene
+    bool moved = !frame.known || frame.transform.getOrigin() != t.getOrigin() || frame.transform.getRotation() != t.getRotation();
+    frame.known = true;
+    frame.stamp = stamp;
+    if (!moved)
+      continue;
+    frame.transform = t;
+    
     geometry_msgs::TransformStamped f;
-    f.header.frame_id = all_frame_names[i];
+    f.header.frame_id = name;
     f.child_frame_id = target;
     f.transform.translation.x = t.getOrigin().x();
     f.transform.translation.y = t.getOrigin().y();
@@ -761,6 +1372,16 @@ void planning_scene_monitor::PlanningSceneMonitor::getUpdatedFrameTransforms(con
 }
 
 void planning_scene_monitor::PlanningSceneMonitor::updateFrameTransforms(void)
+{
+  updateFrameTransformsHelper(false);
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::updateAllFrameTransforms(void)
+{
+  updateFrameTransformsHelper(true);
+}
+
+void planning_scene_monitor::PlanningSceneMonitor::updateFrameTransformsHelper(bool all_frames)
 {
   if (!tf_)
     return;
@@ -768,7 +1389,9 @@ void planning_scene_monitor::PlanningSceneMonitor::updateFrameTransforms(void)
   if (scene_)
   {
     std::vector<geometry_msgs::TransformStamped> transforms;
-    getUpdatedFrameTransforms(scene_->getKinematicModel(), transforms);
+    getUpdatedFrameTransforms(scene_->getKinematicModel(), transforms, all_frames);
+    if (transforms.empty())
+      return;
     {
       boost::unique_lock<boost::shared_mutex> ulock(scene_update_mutex_);
       scene_->getTransforms()->setTransforms(transforms);
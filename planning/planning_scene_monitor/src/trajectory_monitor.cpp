@@ -38,10 +38,18 @@
 #include <moveit/trajectory_processing/trajectory_tools.h>
 #include <ros/rate.h>
 #include <limits>
+#include <algorithm>
+
+namespace planning_scene_monitor
+{
+static const std::size_t SAMPLES_PER_CHUNK = 256;
+}
 
 planning_scene_monitor::TrajectoryMonitor::TrajectoryMonitor(const CurrentStateMonitorConstPtr &state_monitor, double sampling_frequency) :
-  current_state_monitor_(state_monitor), sampling_frequency_(5.0)
+  current_state_monitor_(state_monitor), sampling_frequency_(5.0), variable_count_(0)
 {
+  if (current_state_monitor_)
+    variable_count_ = current_state_monitor_->getKinematicModel()->getVariableNames().size();
   setSamplingFrequency(sampling_frequency);
 }
 
@@ -52,8 +60,8 @@ planning_scene_monitor::TrajectoryMonitor::~TrajectoryMonitor(void)
 
 void planning_scene_monitor::TrajectoryMonitor::setSamplingFrequency(double sampling_frequency)
 {
-  if (sampling_frequency <= std::numeric_limits<double>::epsilon())
-    ROS_ERROR("The sampling frequency for trajectory states should be positive");
+  if (sampling_frequency < 0.0)
+    ROS_ERROR("The sampling frequency for trajectory states should be positive (or 0, to record all states)");
   else
     sampling_frequency_ = sampling_frequency;
 }
@@ -88,33 +96,165 @@ void planning_scene_monitor::TrajectoryMonitor::clearTrajectory(void)
   bool restart = isActive();
   if (restart)
     stopTrajectoryMonitor();
-  trajectory_states_.clear();
-  trajectory_stamps_.clear();
+  {
+    boost::mutex::scoped_lock slock(trajectory_lock_);
+    trajectory_chunks_.clear();
+    trajectory_stamps_.clear();
+  }
   if (restart)
     startTrajectoryMonitor();
 }
 
+std::size_t planning_scene_monitor::TrajectoryMonitor::getSampleCount(void) const
+{
+  boost::mutex::scoped_lock slock(trajectory_lock_);
+  return trajectory_stamps_.size();
+}
+
+const double* planning_scene_monitor::TrajectoryMonitor::getSampleValues(std::size_t index) const
+{
+  return &(*trajectory_chunks_[index / SAMPLES_PER_CHUNK])[(index % SAMPLES_PER_CHUNK) * variable_count_];
+}
+
+void planning_scene_monitor::TrajectoryMonitor::getSample(std::size_t index, std::vector<double> &values) const
+{
+  boost::mutex::scoped_lock slock(trajectory_lock_);
+  const double *v = getSampleValues(index);
+  values.assign(v, v + variable_count_);
+}
+
+std::vector<kinematic_state::KinematicStateConstPtr> planning_scene_monitor::TrajectoryMonitor::getTrajectoryStates(void) const
+{
+  boost::mutex::scoped_lock slock(trajectory_lock_);
+  std::vector<kinematic_state::KinematicStateConstPtr> states(trajectory_stamps_.size());
+  for (std::size_t i = 0 ; i < trajectory_stamps_.size() ; ++i)
+  {
+    const double *v = getSampleValues(i);
+    kinematic_state::KinematicStatePtr state(new kinematic_state::KinematicState(current_state_monitor_->getKinematicModel()));
+    state->setStateValues(std::vector<double>(v, v + variable_count_));
+    states[i] = state;
+  }
+  return states;
+}
+
+std::vector<ros::Time> planning_scene_monitor::TrajectoryMonitor::getTrajectoryStamps(void) const
+{
+  boost::mutex::scoped_lock slock(trajectory_lock_);
+  return trajectory_stamps_;
+}
+
+void planning_scene_monitor::TrajectoryMonitor::addSample(std::vector<double>::const_iterator values, const ros::Time &stamp)
+{
+  {
+    boost::mutex::scoped_lock slock(trajectory_lock_);
+    if (trajectory_stamps_.size() % SAMPLES_PER_CHUNK == 0)
+    {
+      trajectory_chunks_.push_back(boost::shared_ptr<std::vector<double> >(new std::vector<double>()));
+      trajectory_chunks_.back()->reserve(SAMPLES_PER_CHUNK * variable_count_);
+    }
+    trajectory_chunks_.back()->insert(trajectory_chunks_.back()->end(), values, values + variable_count_);
+    trajectory_stamps_.push_back(stamp);
+  }
+  
+  // a state is only constructed if someone wants to see it
+  if (state_add_callback_)
+  {
+    kinematic_state::KinematicStatePtr state(new kinematic_state::KinematicState(current_state_monitor_->getKinematicModel()));
+    state->setStateValues(std::vector<double>(values, values + variable_count_));
+    state_add_callback_(state, stamp);
+  }
+}
+
 void planning_scene_monitor::TrajectoryMonitor::recordStates(void)
 {
   if (!current_state_monitor_)
     return;
   
-  ros::Rate rate(sampling_frequency_);
+  ros::Duration min_period(sampling_frequency_ > std::numeric_limits<double>::epsilon() ? 1.0 / sampling_frequency_ : 0.0);
+  
+  // the trajectory starts with the current state
+  std::vector<double> values;
+  std::vector<ros::Time> stamps;
+  ros::Time last = current_state_monitor_->getCurrentStateVector(values);
+  addSample(values.begin(), last);
+  ros::Time last_recorded = last;
+  
+  // then, states are recorded as they are received (but not more often than the sampling frequency)
   while (record_states_thread_)
   {
-    rate.sleep();
-    std::pair<kinematic_state::KinematicStatePtr, ros::Time> state = current_state_monitor_->getCurrentStateAndTime();
-    trajectory_states_.push_back(state.first);
-    trajectory_stamps_.push_back(state.second);
-    if (state_add_callback_)
-      state_add_callback_(trajectory_states_.back(), trajectory_stamps_.back());
+    if (!current_state_monitor_->waitForStateUpdate(last, ros::WallDuration(0.1)))
+      continue;
+    values.clear();
+    stamps.clear();
+    current_state_monitor_->getStateHistory(last, values, stamps);
+    for (std::size_t i = 0 ; i < stamps.size() ; ++i)
+      if (stamps[i] - last_recorded >= min_period)
+      {
+        addSample(values.begin() + i * variable_count_, stamps[i]);
+        last_recorded = stamps[i];
+      }
+    if (!stamps.empty())
+      last = stamps.back();
   }
 }
 
 void planning_scene_monitor::TrajectoryMonitor::getTrajectory(moveit_msgs::RobotTrajectory &trajectory)
 {
-  std::vector<ros::Duration> durations(trajectory_stamps_.size(), ros::Duration(0.0));
-  for (std::size_t i = 1 ; i < trajectory_stamps_.size() ; ++i)
-    durations[i] = trajectory_stamps_[i] - trajectory_stamps_[i - 1];
-  trajectory_processing::convertToRobotTrajectory(trajectory, trajectory_states_, durations);
+  boost::mutex::scoped_lock slock(trajectory_lock_);
+  const kinematic_model::KinematicModelConstPtr &kmodel = current_state_monitor_->getKinematicModel();
+  
+  // find the joints that have exactly one variable; if there are others (e.g., floating or planar joints),
+  // we rely on the conversion from kinematic states, which is not specialized for the recorded values
+  const std::vector<std::string> &variable_names = kmodel->getVariableNames();
+  const std::vector<const kinematic_model::JointModel*> &jmodels = kmodel->getJointModels();
+  std::vector<std::size_t> index;
+  std::vector<std::string> names;
+  bool single_variable_only = true;
+  for (std::size_t i = 0 ; i < jmodels.size() ; ++i)
+  {
+    if (jmodels[i]->getVariableCount() == 1)
+    {
+      std::size_t k = std::find(variable_names.begin(), variable_names.end(), jmodels[i]->getName()) - variable_names.begin();
+      if (k < variable_names.size())
+      {
+        index.push_back(k);
+        names.push_back(jmodels[i]->getName());
+        continue;
+      }
+    }
+    if (jmodels[i]->getVariableCount() > 0)
+      single_variable_only = false;
+  }
+  
+  if (!single_variable_only)
+  {
+    std::vector<kinematic_state::KinematicStateConstPtr> states(trajectory_stamps_.size());
+    std::vector<ros::Duration> durations(trajectory_stamps_.size(), ros::Duration(0.0));
+    for (std::size_t i = 0 ; i < trajectory_stamps_.size() ; ++i)
+    {
+      const double *v = getSampleValues(i);
+      kinematic_state::KinematicStatePtr state(new kinematic_state::KinematicState(kmodel));
+      state->setStateValues(std::vector<double>(v, v + variable_count_));
+      states[i] = state;
+      if (i > 0)
+        durations[i] = trajectory_stamps_[i] - trajectory_stamps_[i - 1];
+    }
+    trajectory_processing::convertToRobotTrajectory(trajectory, states, durations);
+    return;
+  }
+  
+  // fill in the joint trajectory directly from the recorded values
+  trajectory = moveit_msgs::RobotTrajectory();
+  trajectory.joint_trajectory.header.frame_id = kmodel->getModelFrame();
+  trajectory.joint_trajectory.joint_names = names;
+  trajectory.joint_trajectory.points.resize(trajectory_stamps_.size());
+  for (std::size_t i = 0 ; i < trajectory_stamps_.size() ; ++i)
+  {
+    const double *v = getSampleValues(i);
+    trajectory_msgs::JointTrajectoryPoint &point = trajectory.joint_trajectory.points[i];
+    point.positions.resize(index.size());
+    for (std::size_t j = 0 ; j < index.size() ; ++j)
+      point.positions[j] = v[index[j]];
+    point.time_from_start = trajectory_stamps_[i] - trajectory_stamps_[0];
+  }
 }
@@ -46,6 +46,7 @@
 #include <boost/thread.hpp>
 #include <pluginlib/class_loader.h>
 #include <boost/scoped_ptr.hpp>
+#include <boost/dynamic_bitset.hpp>
 
 namespace trajectory_execution_manager
 {
@@ -63,11 +64,21 @@ public:
   /// Data structure that represents information necessary to execute a trajectory
   struct TrajectoryExecutionContext
   {
+    TrajectoryExecutionContext(void) : splice_(false)
+    {
+    }
+    
     /// The controllers to use for executing the different trajectory parts; 
     std::vector<std::string> controllers_;
     
     // The trajectory to execute, split in different parts (by joints), each set of joints corresponding to one controller
     std::vector<moveit_msgs::RobotTrajectory> trajectory_parts_;
+
+    /// If true, the trajectory parts are spliced into the ones the controllers are executing, at splice_time_ (see pushAndSplice())
+    bool splice_;
+    
+    /// The time at which the trajectory parts start; zero means the end of the trajectories the controllers are executing
+    ros::Time splice_time_;
   };
   
   /// Load the controller manager plugin, start listening for events on a topic.
@@ -160,6 +171,19 @@ public:
   /// is given to the already loaded ones. If no controller is specified, a default is used. This call is non-blocking.
   bool pushAndExecute(const sensor_msgs::JointState &state, const std::vector<std::string> &controllers);
 
+  /// Add a trajectory to the ones being executed by pushAndExecute(), without stopping the robot. The trajectory starts at \e splice_time, and its
+  /// time_from_start values are relative to that time; points that were previously sent for execution at \e splice_time or later are replaced.
+  /// Only the new trajectory is sent to the controllers, with its header stamp set to \e splice_time, so controllers must splice trajectories
+  /// based on their start time. If \e splice_time is zero, the trajectory is appended at the end of the trajectory that is executing
+  /// (see getStreamEndTime()); if nothing is executing, it starts right away. The first point of the trajectory must match the state the executing
+  /// trajectory reaches at \e splice_time, within the ~allowed_splice_deviation parameter. Only single-dof joint trajectories can be spliced.
+  /// Optionally specify a set of controllers to consider using for the trajectory. This call is non-blocking.
+  bool pushAndSplice(const moveit_msgs::RobotTrajectory &trajectory, const ros::Time &splice_time = ros::Time(),
+                     const std::vector<std::string> &controllers = std::vector<std::string>());
+  
+  /// Get the time at which the trajectories sent to the controllers in continuous mode end, or zero if no trajectory was sent
+  ros::Time getStreamEndTime(void) const;
+
   /// Wait until the execution is complete. This applies for executions started by either execute() or pushAndExecute()
   moveit_controller_manager::ExecutionStatus waitForExecution(void);
   
@@ -186,6 +210,12 @@ private:
     std::set<std::string> overlapping_controllers_;
     moveit_controller_manager::MoveItControllerManager::ControllerState state_;
     ros::Time last_update_;
+
+    /// The position of this controller in controllers_by_index_
+    std::size_t index_;
+
+    /// The joints of this controller, as a mask over joint_names_
+    boost::dynamic_bitset<> joint_mask_;
     
     bool operator<(ControllerInformation &other) const
     {
@@ -201,17 +231,32 @@ private:
 
   bool configure(TrajectoryExecutionContext &context, const moveit_msgs::RobotTrajectory &trajectory, const std::vector<std::string> &controllers);
   
+  /// Configure \e context for \e trajectory and queue it for execution by continuousExecutionThread(); \e context is deleted on failure
+  bool pushContinuous(TrajectoryExecutionContext *context, const moveit_msgs::RobotTrajectory &trajectory, const std::vector<std::string> &controllers);
+  
+  /// Compute the start time of the parts of \e context and check they continue the streamed trajectories; called before the parts are sent
+  bool prepareSplice(TrajectoryExecutionContext &context);
+  
+  /// Record the parts of \e context as sent to the controllers through \e handles, after they were successfully sent
+  void updateStreams(const TrajectoryExecutionContext &context, const std::vector<moveit_controller_manager::MoveItControllerHandlePtr> &handles);
+  
   void updateControllersState(const ros::Duration &age);
   void updateControllerState(const std::string &controller, const ros::Duration &age);
   void updateControllerState(ControllerInformation &ci, const ros::Duration &age);
 
   bool distributeTrajectory(const moveit_msgs::RobotTrajectory &trajectory, const std::vector<std::string> &controllers, std::vector<moveit_msgs::RobotTrajectory> &parts);
   
-  bool findControllers(const std::set<std::string> &actuated_joints, std::size_t controller_count, const std::vector<std::string> &available_controllers, std::vector<std::string> &selected_controllers);
-  bool checkControllerCombination(std::vector<std::string> &controllers, const std::set<std::string> &actuated_joints);
-  void generateControllerCombination(std::size_t start_index, std::size_t controller_count, const std::vector<std::string> &available_controllers, 
-                                     std::vector<std::string> &selected_controllers, std::vector< std::vector<std::string> > &selected_options,
-                                     const std::set<std::string> &actuated_joints);
+  /// Compute the mask of \e joints over joint_names_; return false if some of the joints are not operated by any known controller
+  bool getJointMask(const std::set<std::string> &joints, boost::dynamic_bitset<> &mask) const;
+  /// Compute the mask of \e controllers over controllers_by_index_; unknown controllers are ignored
+  void getControllerMask(const std::vector<std::string> &controllers, boost::dynamic_bitset<> &mask) const;
+  void getControllerNames(const std::vector<std::size_t> &controllers, std::vector<std::string> &names) const;
+
+  bool findControllers(const boost::dynamic_bitset<> &actuated_joints, std::size_t controller_count, const boost::dynamic_bitset<> &available_controllers, std::vector<std::string> &selected_controllers);
+  bool checkControllerCombination(const std::vector<std::size_t> &selected, const boost::dynamic_bitset<> &combined_joints, const boost::dynamic_bitset<> &actuated_joints) const;
+  void generateControllerCombination(std::size_t start_index, std::size_t controller_count, const std::vector<std::size_t> &available_controllers, 
+                                     std::vector<std::size_t> &selected_controllers, const boost::dynamic_bitset<> &combined_joints,
+                                     std::vector< std::vector<std::size_t> > &selected_options, const boost::dynamic_bitset<> &actuated_joints);
   bool selectControllers(const std::set<std::string> &actuated_joints, const std::vector<std::string> &available_controllers, std::vector<std::string> &selected_controllers);
   
   void executeThread(const ExecutionCompleteCallback &callback, bool auto_clear);
@@ -230,6 +275,24 @@ private:
   
   std::map<std::string, ControllerInformation> known_controllers_;
   bool manage_controllers_;
+
+  // the joints operated by the known controllers, sorted by name, and the index of each of them in this list
+  std::vector<std::string> joint_names_;
+  std::map<std::string, std::size_t> joint_index_;
+  
+  // the known controllers, in the order of their names
+  std::vector<ControllerInformation*> controllers_by_index_;
+
+  // the combinations of disjoint controllers that cover a set of joints, for each number of controllers; these only depend on
+  // the joints of the controllers, so they are computed when first needed and kept until the controller information is reloaded
+  struct ControllerCombinations
+  {
+    std::vector<bool> computed_;
+    std::vector< std::vector< std::vector<std::size_t> > > options_;
+  };
+  
+  // the key is the pair (mask of actuated joints, mask of available controllers)
+  std::map<std::pair<boost::dynamic_bitset<>, boost::dynamic_bitset<> >, ControllerCombinations> controller_combinations_;
   
   // thread used to execute trajectories using the execute() command
   boost::scoped_ptr<boost::thread> execution_thread_;
@@ -257,6 +320,22 @@ private:
   std::vector<TrajectoryExecutionContext*> trajectories_;
   std::deque<TrajectoryExecutionContext*> continuous_execution_queue_;
   
+  // the trajectory sent to a controller in continuous mode, with the pieces spliced into it so far
+  struct StreamedTrajectory
+  {
+    /// The time the trajectory started at; the times of the points are relative to this
+    ros::Time start_;
+    trajectory_msgs::JointTrajectory trajectory_;
+    
+    /// The handle the trajectory was sent through; the stream is dropped once this is no longer running
+    moveit_controller_manager::MoveItControllerHandlePtr handle_;
+  };
+  
+  // the streamed trajectories, by controller name
+  std::map<std::string, StreamedTrajectory> streams_;
+  mutable boost::mutex streams_mutex_;
+  double allowed_splice_deviation_;
+  
   boost::scoped_ptr<pluginlib::ClassLoader<moveit_controller_manager::MoveItControllerManager> > controller_manager_loader_;
   moveit_controller_manager::MoveItControllerManagerPtr controller_manager_;
 
@@ -35,6 +35,7 @@
 /* Author: Ioan Sucan */
 
 #include <moveit/trajectory_execution_manager/trajectory_execution_manager.h>
+#include <cmath>
 
 namespace trajectory_execution_manager
 {
@@ -67,6 +68,7 @@ void TrajectoryExecutionManager::initialize(void)
   current_context_ = -1;
   last_execution_status_ = moveit_controller_manager::ExecutionStatus::SUCCEEDED;
   run_continuous_execution_thread_ = true;
+  node_handle_.param("allowed_splice_deviation", allowed_splice_deviation_, 0.01);
   
   // load the controller manager plugin
   try
@@ -247,8 +249,31 @@ bool TrajectoryExecutionManager::pushAndExecute(const moveit_msgs::RobotTrajecto
     ROS_ERROR("Cannot push & execute a new trajectory while another is being executed");
     return false;
   }
+  return pushContinuous(new TrajectoryExecutionContext(), trajectory, controllers);
+}
 
+bool TrajectoryExecutionManager::pushAndSplice(const moveit_msgs::RobotTrajectory &trajectory, const ros::Time &splice_time, const std::vector<std::string> &controllers)
+{
+  if (!execution_complete_)
+  {
+    ROS_ERROR("Cannot push & splice a new trajectory while another is being executed");
+    return false;
+  }
+  if (!trajectory.multi_dof_joint_trajectory.points.empty())
+  {
+    ROS_ERROR("Only single-dof joint trajectories can be spliced");
+    last_execution_status_ = moveit_controller_manager::ExecutionStatus::ABORTED;
+    return false;
+  }
+  
   TrajectoryExecutionContext *context = new TrajectoryExecutionContext();
+  context->splice_ = true;
+  context->splice_time_ = splice_time;
+  return pushContinuous(context, trajectory, controllers);
+}
+
+bool TrajectoryExecutionManager::pushContinuous(TrajectoryExecutionContext *context, const moveit_msgs::RobotTrajectory &trajectory, const std::vector<std::string> &controllers)
+{
   if (configure(*context, trajectory, controllers))
   {
     {
@@ -287,6 +312,10 @@ void TrajectoryExecutionManager::continuousExecutionThread(void)
         if ((*uit)->getLastExecutionStatus() == moveit_controller_manager::ExecutionStatus::RUNNING)
           (*uit)->cancelExecution();
       used_handles.clear();
+      {
+        boost::mutex::scoped_lock slock(streams_mutex_);
+        streams_.clear();
+      }
       while (!continuous_execution_queue_.empty())
       {
         TrajectoryExecutionContext *context = continuous_execution_queue_.front();
@@ -315,6 +344,13 @@ void TrajectoryExecutionManager::continuousExecutionThread(void)
       while (uit != used_handles.end())
         if ((*uit)->getLastExecutionStatus() != moveit_controller_manager::ExecutionStatus::RUNNING)
         {
+          // the controller finished, so there is nothing streamed to it left to splice into
+          {
+            boost::mutex::scoped_lock slock(streams_mutex_);
+            std::map<std::string, StreamedTrajectory>::iterator sit = streams_.find((*uit)->getName());
+            if (sit != streams_.end() && sit->second.handle_ == *uit)
+              streams_.erase(sit);
+          }
           std::set<moveit_controller_manager::MoveItControllerHandlePtr>::iterator toErase = uit;
           ++uit;
           used_handles.erase(toErase);
@@ -356,6 +392,13 @@ void TrajectoryExecutionManager::continuousExecutionThread(void)
           break;
         }
         
+        // find out where the trajectory parts start, if they are to be spliced into the executing ones
+        if (!handles.empty() && context->splice_ && !prepareSplice(*context))
+        {
+          last_execution_status_ = moveit_controller_manager::ExecutionStatus::ABORTED;
+          handles.clear();
+        }
+        
         // push all trajectories to all controllers simultaneously
         if (!handles.empty())
           for (std::size_t i = 0 ; i < context->trajectory_parts_.size() ; ++i)
@@ -388,6 +431,8 @@ void TrajectoryExecutionManager::continuousExecutionThread(void)
               break;
             }
           }
+        if (!handles.empty())
+          updateStreams(*context, handles);
         delete context;
         
         // remember which handles we used
@@ -404,13 +449,169 @@ void TrajectoryExecutionManager::continuousExecutionThread(void)
   }
 }
 
+namespace
+{
+// the positions of a trajectory at \e time, interpolating linearly between points; the trajectory must have points
+void getPositionsAt(const trajectory_msgs::JointTrajectory &trajectory, const ros::Duration &time, std::vector<double> &positions)
+{
+  const std::vector<trajectory_msgs::JointTrajectoryPoint> &points = trajectory.points;
+  std::size_t i = 0;
+  while (i < points.size() && points[i].time_from_start < time)
+    ++i;
+  if (i == 0)
+    positions = points.front().positions;
+  else
+    if (i == points.size() || points[i].positions.size() != points[i - 1].positions.size())
+      positions = points[i - 1].positions;
+    else
+    {
+      const trajectory_msgs::JointTrajectoryPoint &a = points[i - 1];
+      const trajectory_msgs::JointTrajectoryPoint &b = points[i];
+      double span = (b.time_from_start - a.time_from_start).toSec();
+      double t = span > 0.0 ? (time - a.time_from_start).toSec() / span : 1.0;
+      positions.resize(a.positions.size());
+      for (std::size_t j = 0 ; j < positions.size() ; ++j)
+        positions[j] = a.positions[j] + t * (b.positions[j] - a.positions[j]);
+    }
+}
+}
+
+bool TrajectoryExecutionManager::prepareSplice(TrajectoryExecutionContext &context)
+{
+  boost::mutex::scoped_lock slock(streams_mutex_);
+  ros::Time now = ros::Time::now();
+  
+  ros::Time splice_time = context.splice_time_;
+  if (splice_time.isZero())
+  {
+    // append at the end of the streamed trajectories, or start right away if they are done
+    splice_time = now;
+    for (std::size_t i = 0 ; i < context.controllers_.size() ; ++i)
+    {
+      std::map<std::string, StreamedTrajectory>::const_iterator it = streams_.find(context.controllers_[i]);
+      if (it != streams_.end() && !it->second.trajectory_.points.empty())
+      {
+        ros::Time end = it->second.start_ + it->second.trajectory_.points.back().time_from_start;
+        if (end > splice_time)
+          splice_time = end;
+      }
+    }
+  }
+  else
+    if (splice_time < now)
+    {
+      ROS_ERROR("Cannot splice a trajectory %lf seconds in the past", (now - splice_time).toSec());
+      return false;
+    }
+  
+  for (std::size_t i = 0 ; i < context.trajectory_parts_.size() ; ++i)
+  {
+    trajectory_msgs::JointTrajectory &part = context.trajectory_parts_[i].joint_trajectory;
+    part.header.stamp = splice_time;
+    
+    // nothing was streamed to this controller, so there is nothing to continue
+    std::map<std::string, StreamedTrajectory>::const_iterator it = streams_.find(context.controllers_[i]);
+    if (it == streams_.end() || it->second.trajectory_.points.empty() || part.points.empty())
+      continue;
+    
+    const StreamedTrajectory &stream = it->second;
+    if (stream.trajectory_.joint_names != part.joint_names)
+    {
+      ROS_ERROR("The trajectory for controller '%s' does not actuate the same joints as the one being executed, so it cannot be spliced",
+                context.controllers_[i].c_str());
+      return false;
+    }
+    
+    std::vector<double> expected;
+    getPositionsAt(stream.trajectory_, splice_time - stream.start_, expected);
+    const std::vector<double> &start = part.points.front().positions;
+    if (expected.size() == start.size())
+      for (std::size_t j = 0 ; j < start.size() ; ++j)
+        if (fabs(expected[j] - start[j]) > allowed_splice_deviation_)
+        {
+          ROS_ERROR("Joint '%s' is expected to be at %lf at the splice time, but the spliced trajectory starts at %lf",
+                    part.joint_names[j].c_str(), expected[j], start[j]);
+          return false;
+        }
+  }
+  return true;
+}
+
+void TrajectoryExecutionManager::updateStreams(const TrajectoryExecutionContext &context, const std::vector<moveit_controller_manager::MoveItControllerHandlePtr> &handles)
+{
+  boost::mutex::scoped_lock slock(streams_mutex_);
+  ros::Time now = ros::Time::now();
+  for (std::size_t i = 0 ; i < context.trajectory_parts_.size() ; ++i)
+  {
+    const trajectory_msgs::JointTrajectory &part = context.trajectory_parts_[i].joint_trajectory;
+    if (part.points.empty())
+    {
+      streams_.erase(context.controllers_[i]);
+      continue;
+    }
+    
+    // controllers start trajectories with no stamp right away
+    ros::Time start = part.header.stamp.isZero() ? now : part.header.stamp;
+    StreamedTrajectory &stream = streams_[context.controllers_[i]];
+    stream.handle_ = handles[i];
+    std::vector<trajectory_msgs::JointTrajectoryPoint> &points = stream.trajectory_.points;
+    if (context.splice_ && !points.empty())
+    {
+      // the points at the splice time and later were replaced by the controller
+      ros::Duration offset = start - stream.start_;
+      std::size_t keep = 0;
+      while (keep < points.size() && points[keep].time_from_start < offset)
+        ++keep;
+      points.resize(keep);
+      for (std::size_t j = 0 ; j < part.points.size() ; ++j)
+      {
+        points.push_back(part.points[j]);
+        points.back().time_from_start += offset;
+      }
+      
+      // forget the points that were executed already, except the last one, which is needed for interpolation
+      ros::Duration elapsed = now - stream.start_;
+      std::size_t executed = 0;
+      while (executed + 1 < points.size() && points[executed + 1].time_from_start < elapsed)
+        ++executed;
+      points.erase(points.begin(), points.begin() + executed);
+    }
+    else
+    {
+      stream.start_ = start;
+      stream.trajectory_ = part;
+    }
+  }
+}
+
+ros::Time TrajectoryExecutionManager::getStreamEndTime(void) const
+{
+  boost::mutex::scoped_lock slock(streams_mutex_);
+  ros::Time end;
+  for (std::map<std::string, StreamedTrajectory>::const_iterator it = streams_.begin() ; it != streams_.end() ; ++it)
+    // streams of controllers that are done are stale, even if continuousExecutionThread() did not drop them yet
+    if (!it->second.trajectory_.points.empty() && it->second.handle_ &&
+        it->second.handle_->getLastExecutionStatus() == moveit_controller_manager::ExecutionStatus::RUNNING)
+    {
+      ros::Time e = it->second.start_ + it->second.trajectory_.points.back().time_from_start;
+      if (e > end)
+        end = e;
+    }
+  return end;
+}
+
 void TrajectoryExecutionManager::reloadControllerInformation(void)
 {
   known_controllers_.clear();
+  joint_names_.clear();
+  joint_index_.clear();
+  controllers_by_index_.clear();
+  controller_combinations_.clear();
   if (controller_manager_)
   {
     std::vector<std::string> names;
     controller_manager_->getControllersList(names);
+    std::set<std::string> all_joints;
     for (std::size_t i = 0 ; i < names.size() ; ++i)
     {
       std::vector<std::string> joints;
@@ -419,25 +620,66 @@ void TrajectoryExecutionManager::reloadControllerInformation(void)
       ci.name_ = names[i];
       ci.joints_.insert(joints.begin(), joints.end());
       known_controllers_[ci.name_] = ci;
+      all_joints.insert(joints.begin(), joints.end());
     }
-
+    
+    // index the joints in the order of their names, so the order of the bits in a mask is the order of the joint names
+    joint_names_.assign(all_joints.begin(), all_joints.end());
+    for (std::size_t i = 0 ; i < joint_names_.size() ; ++i)
+      joint_index_[joint_names_[i]] = i;
+    
     for (std::map<std::string, ControllerInformation>::iterator it = known_controllers_.begin() ; it != known_controllers_.end() ; ++it)
-      for (std::map<std::string, ControllerInformation>::iterator jt = known_controllers_.begin() ; jt != known_controllers_.end() ; ++jt)
-        if (it != jt)
+    {
+      it->second.index_ = controllers_by_index_.size();
+      controllers_by_index_.push_back(&it->second);
+      it->second.joint_mask_.resize(joint_names_.size());
+      for (std::set<std::string>::const_iterator jt = it->second.joints_.begin() ; jt != it->second.joints_.end() ; ++jt)
+        it->second.joint_mask_.set(joint_index_[*jt]);
+    }
+    
+    for (std::size_t i = 0 ; i < controllers_by_index_.size() ; ++i)
+      for (std::size_t j = i + 1 ; j < controllers_by_index_.size() ; ++j)
+        if (controllers_by_index_[i]->joint_mask_.intersects(controllers_by_index_[j]->joint_mask_))
         {
-          std::vector<std::string> intersect;
-          std::set_intersection(it->second.joints_.begin(), it->second.joints_.end(),
-                                jt->second.joints_.begin(), jt->second.joints_.end(),
-                                std::back_inserter(intersect)); 
-          if (!intersect.empty())
-          {
-            it->second.overlapping_controllers_.insert(jt->first);
-            jt->second.overlapping_controllers_.insert(it->first);
-          }
+          controllers_by_index_[i]->overlapping_controllers_.insert(controllers_by_index_[j]->name_);
+          controllers_by_index_[j]->overlapping_controllers_.insert(controllers_by_index_[i]->name_);
         }
   }
 }
 
+bool TrajectoryExecutionManager::getJointMask(const std::set<std::string> &joints, boost::dynamic_bitset<> &mask) const
+{
+  mask.clear();
+  mask.resize(joint_names_.size());
+  for (std::set<std::string>::const_iterator it = joints.begin() ; it != joints.end() ; ++it)
+  {
+    std::map<std::string, std::size_t>::const_iterator jt = joint_index_.find(*it);
+    if (jt == joint_index_.end())
+      return false;
+    mask.set(jt->second);
+  }
+  return true;
+}
+
+void TrajectoryExecutionManager::getControllerMask(const std::vector<std::string> &controllers, boost::dynamic_bitset<> &mask) const
+{
+  mask.clear();
+  mask.resize(controllers_by_index_.size());
+  for (std::size_t i = 0 ; i < controllers.size() ; ++i)
+  {
+    std::map<std::string, ControllerInformation>::const_iterator it = known_controllers_.find(controllers[i]);
+    if (it != known_controllers_.end())
+      mask.set(it->second.index_);
+  }
+}
+
+void TrajectoryExecutionManager::getControllerNames(const std::vector<std::size_t> &controllers, std::vector<std::string> &names) const
+{
+  names.resize(controllers.size());
+  for (std::size_t i = 0 ; i < controllers.size() ; ++i)
+    names[i] = controllers_by_index_[controllers[i]]->name_;
+}
+
 void TrajectoryExecutionManager::updateControllerState(const std::string &controller, const ros::Duration &age)
 {
   std::map<std::string, ControllerInformation>::iterator it = known_controllers_.find(controller);
@@ -463,57 +705,48 @@ void TrajectoryExecutionManager::updateControllersState(const ros::Duration &age
     updateControllerState(it->second, age);
 }
 
-bool TrajectoryExecutionManager::checkControllerCombination(std::vector<std::string> &selected, const std::set<std::string> &actuated_joints)
+bool TrajectoryExecutionManager::checkControllerCombination(const std::vector<std::size_t> &selected, const boost::dynamic_bitset<> &combined_joints,
+                                                            const boost::dynamic_bitset<> &actuated_joints) const
 {
-  std::set<std::string> combined_joints;
-  for (std::size_t i = 0 ; i < selected.size() ; ++i)
-  {
-    const ControllerInformation &ci = known_controllers_[selected[i]];
-    combined_joints.insert(ci.joints_.begin(), ci.joints_.end());
-  }  
-
   if (verbose_)
   {
     std::stringstream ss, saj, sac;
     for (std::size_t i = 0 ; i < selected.size() ; ++i)
-      ss << selected[i] << " ";
-    for (std::set<std::string>::const_iterator it = actuated_joints.begin() ; it != actuated_joints.end() ; ++it)
-      saj << *it << " ";
-    for (std::set<std::string>::const_iterator it = combined_joints.begin() ; it != combined_joints.end() ; ++it)
-      sac << *it << " ";
+      ss << controllers_by_index_[selected[i]]->name_ << " ";
+    for (std::size_t i = actuated_joints.find_first() ; i != boost::dynamic_bitset<>::npos ; i = actuated_joints.find_next(i))
+      saj << joint_names_[i] << " ";
+    for (std::size_t i = combined_joints.find_first() ; i != boost::dynamic_bitset<>::npos ; i = combined_joints.find_next(i))
+      sac << joint_names_[i] << " ";
     ROS_INFO("Checking if controllers [ %s] operating on joints [ %s] cover joints [ %s]", ss.str().c_str(), sac.str().c_str(), saj.str().c_str());
   }
   
-  return std::includes(combined_joints.begin(), combined_joints.end(),
-                       actuated_joints.begin(), actuated_joints.end());
+  return actuated_joints.is_subset_of(combined_joints);
 }
 
 void TrajectoryExecutionManager::generateControllerCombination(std::size_t start_index, std::size_t controller_count,
-                                                               const std::vector<std::string> &available_controllers, 
-                                                               std::vector<std::string> &selected_controllers,
-                                                               std::vector< std::vector<std::string> > &selected_options,
-                                                               const std::set<std::string> &actuated_joints)
+                                                               const std::vector<std::size_t> &available_controllers, 
+                                                               std::vector<std::size_t> &selected_controllers,
+                                                               const boost::dynamic_bitset<> &combined_joints,
+                                                               std::vector< std::vector<std::size_t> > &selected_options,
+                                                               const boost::dynamic_bitset<> &actuated_joints)
 {
   if (selected_controllers.size() == controller_count)
   {
-    if (checkControllerCombination(selected_controllers, actuated_joints))
+    if (checkControllerCombination(selected_controllers, combined_joints, actuated_joints))
       selected_options.push_back(selected_controllers);
     return;
   }
   
   for (std::size_t i = start_index ; i < available_controllers.size() ; ++i)
   {
-    bool overlap = false;
-    const ControllerInformation &ci = known_controllers_[available_controllers[i]];
-    for (std::size_t j = 0 ; j < selected_controllers.size() && !overlap ; ++j)
-    {
-      if (ci.overlapping_controllers_.find(selected_controllers[j]) != ci.overlapping_controllers_.end())
-        overlap = true;
-    }
-    if (overlap)
+    // two controllers overlap if they share joints, so a controller overlaps one of the selected controllers
+    // exactly when it shares joints with their union
+    const ControllerInformation &ci = *controllers_by_index_[available_controllers[i]];
+    if (ci.joint_mask_.intersects(combined_joints))
       continue;
     selected_controllers.push_back(available_controllers[i]);
-    generateControllerCombination(i + 1, controller_count, available_controllers, selected_controllers, selected_options, actuated_joints);
+    generateControllerCombination(i + 1, controller_count, available_controllers, selected_controllers, combined_joints | ci.joint_mask_,
+                                  selected_options, actuated_joints);
     selected_controllers.pop_back();
   }
 }
@@ -545,29 +778,42 @@ struct OrderPotentialControllerCombination
     return false;
   }
   
-  std::vector< std::vector<std::string> > selected_options;
   std::vector<std::size_t> nrdefault;
   std::vector<std::size_t> nrjoints;
   std::vector<std::size_t> nractive;
 };
 }
 
-bool TrajectoryExecutionManager::findControllers(const std::set<std::string> &actuated_joints, std::size_t controller_count, const std::vector<std::string> &available_controllers, std::vector<std::string> &selected_controllers)
+bool TrajectoryExecutionManager::findControllers(const boost::dynamic_bitset<> &actuated_joints, std::size_t controller_count,
+                                                 const boost::dynamic_bitset<> &available_controllers, std::vector<std::string> &selected_controllers)
 {
-  // generate all combinations of controller_count controllers that operate on disjoint sets of joints 
-  std::vector<std::string> work_area;
-  OrderPotentialControllerCombination order; 
-  std::vector< std::vector<std::string> > &selected_options = order.selected_options;
-  generateControllerCombination(0, controller_count, available_controllers, work_area, selected_options, actuated_joints);
-
+  // generate all combinations of controller_count controllers that operate on disjoint sets of joints, unless this was already done
+  ControllerCombinations &combinations = controller_combinations_[std::make_pair(actuated_joints, available_controllers)];
+  if (combinations.options_.size() <= controller_count)
+  {
+    combinations.options_.resize(controller_count + 1);
+    combinations.computed_.resize(controller_count + 1, false);
+  }
+  const std::vector< std::vector<std::size_t> > &selected_options = combinations.options_[controller_count];
+  if (!combinations.computed_[controller_count])
+  {
+    std::vector<std::size_t> available;
+    for (std::size_t i = available_controllers.find_first() ; i != boost::dynamic_bitset<>::npos ; i = available_controllers.find_next(i))
+      available.push_back(i);
+    std::vector<std::size_t> work_area;
+    generateControllerCombination(0, controller_count, available, work_area, boost::dynamic_bitset<>(joint_names_.size()),
+                                  combinations.options_[controller_count], actuated_joints);
+    combinations.computed_[controller_count] = true;
+  }
+  
   if (verbose_)
   {
     std::stringstream saj;
     std::stringstream sac;
-    for (std::size_t i = 0 ; i < available_controllers.size() ; ++i)
-      sac << available_controllers[i] << " ";
-    for (std::set<std::string>::const_iterator it = actuated_joints.begin() ; it != actuated_joints.end() ; ++it)
-      saj << *it << " ";
+    for (std::size_t i = available_controllers.find_first() ; i != boost::dynamic_bitset<>::npos ; i = available_controllers.find_next(i))
+      sac << controllers_by_index_[i]->name_ << " ";
+    for (std::size_t i = actuated_joints.find_first() ; i != boost::dynamic_bitset<>::npos ; i = actuated_joints.find_next(i))
+      saj << joint_names_[i] << " ";
     ROS_INFO("Looking for %lu controllers among [ %s] that cover joints [ %s]. Found %ld options.", controller_count, sac.str().c_str(), saj.str().c_str(), selected_options.size());
   }
   
@@ -578,7 +824,7 @@ bool TrajectoryExecutionManager::findControllers(const std::set<std::string> &ac
   // if only one was found, return it
   if (selected_options.size() == 1)
   {
-    selected_controllers.swap(selected_options[0]);
+    getControllerNames(selected_options[0], selected_controllers);
     return true;
   }
 
@@ -586,6 +832,7 @@ bool TrajectoryExecutionManager::findControllers(const std::set<std::string> &ac
 
   // count how many default controllers are used in each reported option, and how many joints are actuated in total by the selected controllers,
   // to use that in the ranking of the options
+  OrderPotentialControllerCombination order; 
   order.nrdefault.resize(selected_options.size(), 0);
   order.nrjoints.resize(selected_options.size(), 0);
   order.nractive.resize(selected_options.size(), 0);
@@ -593,7 +840,7 @@ bool TrajectoryExecutionManager::findControllers(const std::set<std::string> &ac
   {
     for (std::size_t k = 0 ; k < selected_options[i].size() ; ++k)
     {
-      const ControllerInformation &ci = known_controllers_[selected_options[i][k]];
+      const ControllerInformation &ci = *controllers_by_index_[selected_options[i][k]];
       if (ci.state_.default_)
         order.nrdefault[i]++;
       if (ci.state_.active_)
@@ -615,16 +862,20 @@ bool TrajectoryExecutionManager::findControllers(const std::set<std::string> &ac
   if (!manage_controllers_)
   {
     // if we can't load different options at will, just choose one that is already loaded
+    std::vector<std::string> names;
     for (std::size_t i = 0 ; i < selected_options.size() ; ++i)
-      if (areControllersActive(selected_options[bijection[i]]))
+    {
+      getControllerNames(selected_options[bijection[i]], names);
+      if (areControllersActive(names))
       {
-        selected_controllers.swap(selected_options[bijection[i]]);
+        selected_controllers.swap(names);
         return true;
       }
+    }
   }
   
   // otherwise, just use the first valid option
-  selected_controllers.swap(selected_options[bijection[0]]);
+  getControllerNames(selected_options[bijection[0]], selected_controllers);
   return true;
 }
 
@@ -648,15 +899,25 @@ bool TrajectoryExecutionManager::areControllersActive(const std::vector<std::str
 
 bool TrajectoryExecutionManager::selectControllers(const std::set<std::string> &actuated_joints, const std::vector<std::string> &available_controllers, std::vector<std::string> &selected_controllers)
 {
+  boost::dynamic_bitset<> actuated_mask;
+  if (!getJointMask(actuated_joints, actuated_mask))
+  {
+    if (verbose_)
+      ROS_INFO("Some of the actuated joints are not operated by any known controller");
+    return false;
+  }
+  boost::dynamic_bitset<> available_mask;
+  getControllerMask(available_controllers, available_mask);
+  
   for (std::size_t i = 1 ; i <= available_controllers.size() ; ++i)
-    if (findControllers(actuated_joints, i, available_controllers, selected_controllers))
+    if (findControllers(actuated_mask, i, available_mask, selected_controllers))
     {
       // if we are not managing controllers, prefer to use active controllers even if there are more of them
       if (!manage_controllers_ && !areControllersActive(selected_controllers))
       {
         std::vector<std::string> other_option;
         for (std::size_t j = i + 1 ; j <= available_controllers.size() ; ++j)
-          if (findControllers(actuated_joints, j, available_controllers, other_option))
+          if (findControllers(actuated_mask, j, available_mask, other_option))
           {
             if (areControllersActive(other_option))
             {
@@ -675,12 +936,21 @@ bool TrajectoryExecutionManager::distributeTrajectory(const moveit_msgs::RobotTr
   parts.clear();
   parts.resize(controllers.size());
   
-  std::set<std::string> actuated_joints_mdof;
-  actuated_joints_mdof.insert(trajectory.multi_dof_joint_trajectory.joint_names.begin(),
-                              trajectory.multi_dof_joint_trajectory.joint_names.end());
-  std::set<std::string> actuated_joints_single;
-  actuated_joints_single.insert(trajectory.joint_trajectory.joint_names.begin(),
-                                trajectory.joint_trajectory.joint_names.end());
+  // the column of each known joint in the trajectory, or -1 if the trajectory does not include the joint
+  std::vector<int> column_mdof(joint_names_.size(), -1);
+  for (std::size_t j = 0 ; j < trajectory.multi_dof_joint_trajectory.joint_names.size() ; ++j)
+  {
+    std::map<std::string, std::size_t>::const_iterator it = joint_index_.find(trajectory.multi_dof_joint_trajectory.joint_names[j]);
+    if (it != joint_index_.end())
+      column_mdof[it->second] = j;
+  }
+  std::vector<int> column_single(joint_names_.size(), -1);
+  for (std::size_t j = 0 ; j < trajectory.joint_trajectory.joint_names.size() ; ++j)
+  {
+    std::map<std::string, std::size_t>::const_iterator it = joint_index_.find(trajectory.joint_trajectory.joint_names[j]);
+    if (it != joint_index_.end())
+      column_single[it->second] = j;
+  }
   
   for (std::size_t i = 0 ; i < controllers.size() ; ++i)
   {
@@ -690,30 +960,32 @@ bool TrajectoryExecutionManager::distributeTrajectory(const moveit_msgs::RobotTr
       ROS_ERROR_STREAM("Controller " << controllers[i] << " not found.");
       return false;
     }
-    std::vector<std::string> intersect_mdof;
-    std::set_intersection(it->second.joints_.begin(), it->second.joints_.end(),
-                          actuated_joints_mdof.begin(), actuated_joints_mdof.end(),
-                          std::back_inserter(intersect_mdof));
-    std::vector<std::string> intersect_single;
-    std::set_intersection(it->second.joints_.begin(), it->second.joints_.end(),
-                          actuated_joints_single.begin(), actuated_joints_single.end(),
-                          std::back_inserter(intersect_single));
-    if (intersect_mdof.empty() && intersect_single.empty())
+    
+    // the columns of the trajectory to be passed to this controller, in the order of the joint names
+    const boost::dynamic_bitset<> &joint_mask = it->second.joint_mask_;
+    std::vector<std::size_t> bijection_mdof;
+    std::vector<std::size_t> bijection_single;
+    for (std::size_t j = joint_mask.find_first() ; j != boost::dynamic_bitset<>::npos ; j = joint_mask.find_next(j))
+    {
+      if (column_mdof[j] >= 0)
+        bijection_mdof.push_back(column_mdof[j]);
+      if (column_single[j] >= 0)
+        bijection_single.push_back(column_single[j]);
+    }
+    
+    if (bijection_mdof.empty() && bijection_single.empty())
       ROS_WARN_STREAM("No joints to be distributed for controller " << controllers[i]);
     {
-      if (!intersect_mdof.empty())
+      if (!bijection_mdof.empty())
       {
+        const std::vector<std::size_t> &bijection = bijection_mdof;
         std::vector<std::string> &jnames = parts[i].multi_dof_joint_trajectory.joint_names;
-        jnames.insert(jnames.end(), intersect_mdof.begin(), intersect_mdof.end());
+        jnames.resize(bijection.size());
         parts[i].multi_dof_joint_trajectory.frame_ids.resize(jnames.size());
         parts[i].multi_dof_joint_trajectory.child_frame_ids.resize(jnames.size());
-        std::map<std::string, std::size_t> index;
-        for (std::size_t j = 0 ; j < trajectory.multi_dof_joint_trajectory.joint_names.size() ; ++j)
-          index[trajectory.multi_dof_joint_trajectory.joint_names[j]] = j;
-        std::vector<std::size_t> bijection(jnames.size());
         for (std::size_t j = 0 ; j < jnames.size() ; ++j)
         {
-          bijection[j] = index[jnames[j]];
+          jnames[j] = trajectory.multi_dof_joint_trajectory.joint_names[bijection[j]];
           if (trajectory.multi_dof_joint_trajectory.frame_ids.size() > bijection[j])
             parts[i].multi_dof_joint_trajectory.frame_ids[j] = trajectory.multi_dof_joint_trajectory.frame_ids[bijection[j]];
           if (trajectory.multi_dof_joint_trajectory.child_frame_ids.size() > bijection[j])
@@ -728,17 +1000,14 @@ bool TrajectoryExecutionManager::distributeTrajectory(const moveit_msgs::RobotTr
             parts[i].multi_dof_joint_trajectory.points[j].poses[k] = trajectory.multi_dof_joint_trajectory.points[j].poses[bijection[k]];
         }        
       }
-      if (!intersect_single.empty())
+      if (!bijection_single.empty())
       {
+        const std::vector<std::size_t> &bijection = bijection_single;
         std::vector<std::string> &jnames = parts[i].joint_trajectory.joint_names;
-        jnames.insert(jnames.end(), intersect_single.begin(), intersect_single.end());
-        parts[i].joint_trajectory.header = trajectory.joint_trajectory.header;
-        std::map<std::string, std::size_t> index;
-        for (std::size_t j = 0 ; j < trajectory.joint_trajectory.joint_names.size() ; ++j)
-          index[trajectory.joint_trajectory.joint_names[j]] = j;
-        std::vector<std::size_t> bijection(jnames.size());
+        jnames.resize(bijection.size());
         for (std::size_t j = 0 ; j < jnames.size() ; ++j)
-          bijection[j] = index[jnames[j]];
+          jnames[j] = trajectory.joint_trajectory.joint_names[bijection[j]];
+        parts[i].joint_trajectory.header = trajectory.joint_trajectory.header;
         parts[i].joint_trajectory.points.resize(trajectory.joint_trajectory.points.size());
         for (std::size_t j = 0 ; j < trajectory.joint_trajectory.points.size() ; ++j)
         {
@@ -903,6 +1172,11 @@ void TrajectoryExecutionManager::execute(const ExecutionCompleteCallback &callba
 {
   stopExecution(false);
   execution_complete_ = false;
+  {
+    // the robot moves outside of continuous mode, so nothing can be spliced into what was streamed before
+    boost::mutex::scoped_lock slock(streams_mutex_);
+    streams_.clear();
+  }
   // start the execution thread
   execution_thread_.reset(new boost::thread(&TrajectoryExecutionManager::executeThread, this, callback, auto_clear));
 }